@@ -0,0 +1,300 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2018 Jason King
+ */
+
+/*
+ * The atom table.
+ *
+ * A large build refers to the same names (macros, targets, and the
+ * members of lists like $(OBJS)) over and over.  Every distinct string is
+ * interned once, and is then identified by its atom_t: a small integer
+ * that indexes atom_ents.  Code that would otherwise strcmp() names (macro
+ * and target lookups, dependency edges) just compares atoms, and hash
+ * tables keyed by name can hash the atom instead of the string.
+ *
+ * Strings are copied (NUL terminated) into large chunks that are never
+ * moved or freed, so the pointer returned by atom_name() is valid for the
+ * life of the process.  The lookup table is open addressed with linear
+ * probing, and keeps the hash of each atom next to it, so a probe only
+ * touches the string itself on a full hash match.
+ *
+ * Most atoms are created by the parser, but build workers also create them
+ * (e.g. expanding $($X) in a recipe) while other workers are looking up
+ * existing ones, so only creating an atom takes atom_lock.  atom_ents is
+ * split into pages that are never moved once allocated (page n holds
+ * ATOM_MINENTS << n atoms), and an atom's entry is filled in before the atom
+ * is published (in atom_nents, and in a slot of the lookup table), so
+ * atom_name() and atom_len() can read any atom a thread has been handed.
+ * A slot's hash is set before its atom, and a reader that sees the atom
+ * sees the hash too.  When the lookup table grows, the new one is filled
+ * in before it replaces atom_tab.  A reader may still be probing the old
+ * one, so old tables are kept (on at_prev) rather than freed; together
+ * they are smaller than the current one.  A lookup that uses an old table
+ * can only miss atoms created after the lookup started.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/debug.h>
+#include <sys/types.h>
+#include <umem.h>
+
+#include "atom.h"
+#include "util.h"
+
+#define	ATOM_CHUNK	(64U * 1024U)	/* size of string chunks */
+#define	ATOM_MINSLOTS	1024U		/* must be a power of 2 */
+#define	ATOM_MINENTS	1024U		/* must be a power of 2 */
+#define	ATOM_NPAGES	23U		/* enough pages for UINT32_MAX atoms */
+
+typedef struct atom_ent {
+	const char	*ae_str;
+	uint32_t	ae_len;
+	uint32_t	ae_hash;
+} atom_ent_t;
+
+typedef struct atom_slot {
+	uint32_t	as_hash;
+	atom_t		as_atom;	/* ATOM_NONE if empty */
+} atom_slot_t;
+
+typedef struct atom_table {
+	struct atom_table *at_prev;	/* the table this one replaced */
+	size_t		at_nslots;
+	atom_slot_t	*at_slots;
+} atom_table_t;
+
+static atom_ent_t *atom_ents[ATOM_NPAGES];	/* see atom_ent() */
+static uint_t atom_npages;
+static size_t atom_nents;		/* including ATOM_NONE */
+static size_t atom_entalloc;
+
+static pthread_mutex_t atom_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static atom_table_t *atom_tab;
+
+static char *atom_buf;			/* current string chunk */
+static size_t atom_bufleft;
+
+/* 32-bit FNV-1a */
+static inline uint32_t
+atom_hash(const char *s, size_t len)
+{
+	uint32_t h = 2166136261U;
+
+	for (size_t i = 0; i < len; i++) {
+		h ^= (uchar_t)s[i];
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+/*
+ * Page n of atom_ents holds the ATOM_MINENTS << n atoms starting at
+ * ATOM_MINENTS * (2^n - 1).
+ */
+static inline atom_ent_t *
+atom_ent(atom_t atom)
+{
+	uint32_t q = atom / ATOM_MINENTS + 1;
+	uint_t n = 31 - (uint_t)__builtin_clz(q);
+
+	return (&atom_ents[n][atom - ATOM_MINENTS * ((1U << n) - 1)]);
+}
+
+static const char *
+atom_strdup(const char *s, size_t len)
+{
+	char *p = NULL;
+
+	/* Long strings get their own allocation instead of wasting a chunk */
+	if (len + 1 > ATOM_CHUNK / 4) {
+		p = zalloc(len + 1);
+		(void) memcpy(p, s, len);
+		return (p);
+	}
+
+	if (len + 1 > atom_bufleft) {
+		atom_buf = zalloc(ATOM_CHUNK);
+		atom_bufleft = ATOM_CHUNK;
+	}
+
+	p = atom_buf;
+	(void) memcpy(p, s, len);
+	p[len] = '\0';
+
+	atom_buf += len + 1;
+	atom_bufleft -= len + 1;
+	return (p);
+}
+
+static void
+atom_slot_insert(atom_table_t *at, uint32_t hash, atom_t atom)
+{
+	atom_slot_t *slots = at->at_slots;
+	size_t mask = at->at_nslots - 1;
+	size_t i;
+
+	for (i = hash & mask; slots[i].as_atom != ATOM_NONE; i = (i + 1) & mask)
+		;
+
+	slots[i].as_hash = hash;
+	__atomic_store_n(&slots[i].as_atom, atom, __ATOMIC_RELEASE);
+}
+
+/* Keep the table at most half full, so probe sequences stay short */
+static void
+atom_grow(void)
+{
+	atom_table_t *old = atom_tab;
+	atom_table_t *at = NULL;
+
+	if (atom_nents == atom_entalloc) {
+		size_t len = (size_t)ATOM_MINENTS << atom_npages;
+
+		VERIFY3U(atom_npages, <, ATOM_NPAGES);
+		atom_ents[atom_npages++] = xcalloc(len, sizeof (atom_ent_t));
+		atom_entalloc += len;
+		if (atom_nents == 0)
+			atom_nents = 1;		/* ATOM_NONE */
+	}
+
+	if (old != NULL && atom_nents * 2 < old->at_nslots)
+		return;
+
+	at = zalloc(sizeof (*at));
+	at->at_prev = old;
+	at->at_nslots = (old == NULL) ? ATOM_MINSLOTS : old->at_nslots * 2;
+	at->at_slots = xcalloc(at->at_nslots, sizeof (atom_slot_t));
+	for (size_t i = 0; old != NULL && i < old->at_nslots; i++) {
+		if (old->at_slots[i].as_atom != ATOM_NONE) {
+			atom_slot_insert(at, old->at_slots[i].as_hash,
+			    old->at_slots[i].as_atom);
+		}
+	}
+
+	__atomic_store_n(&atom_tab, at, __ATOMIC_RELEASE);
+}
+
+/* This doesn't need atom_lock (see above) */
+static atom_t
+atom_lookup(const char *s, size_t len, uint32_t hash)
+{
+	const atom_table_t *at = __atomic_load_n(&atom_tab, __ATOMIC_ACQUIRE);
+	const atom_slot_t *slots = NULL;
+	size_t mask;
+	atom_t atom;
+
+	if (at == NULL)
+		return (ATOM_NONE);
+
+	slots = at->at_slots;
+	mask = at->at_nslots - 1;
+	for (size_t i = hash & mask; (atom = __atomic_load_n(&slots[i].as_atom,
+	    __ATOMIC_ACQUIRE)) != ATOM_NONE; i = (i + 1) & mask) {
+		const atom_ent_t *ae = NULL;
+
+		if (slots[i].as_hash != hash)
+			continue;
+
+		ae = atom_ent(atom);
+		if (ae->ae_len == len && memcmp(ae->ae_str, s, len) == 0)
+			return (atom);
+	}
+
+	return (ATOM_NONE);
+}
+
+/*
+ * Return the atom for the len bytes at s, creating it if necessary.  s
+ * need not be NUL terminated.
+ */
+atom_t
+atom_intern(const char *s, size_t len)
+{
+	uint32_t hash = atom_hash(s, len);
+	atom_ent_t *ae = NULL;
+	atom_t atom;
+
+	/* Nearly every name is already an atom */
+	if ((atom = atom_lookup(s, len, hash)) != ATOM_NONE)
+		return (atom);
+
+	/* Another thread may have created it since */
+	(void) pthread_mutex_lock(&atom_lock);
+	if ((atom = atom_lookup(s, len, hash)) != ATOM_NONE) {
+		(void) pthread_mutex_unlock(&atom_lock);
+		return (atom);
+	}
+
+	VERIFY3U(len, <, UINT32_MAX);
+	VERIFY3U(atom_nents, <, UINT32_MAX);
+
+	atom_grow();
+
+	atom = (atom_t)atom_nents;
+	ae = atom_ent(atom);
+	ae->ae_str = atom_strdup(s, len);
+	ae->ae_len = (uint32_t)len;
+	ae->ae_hash = hash;
+	__atomic_store_n(&atom_nents, atom_nents + 1, __ATOMIC_RELEASE);
+
+	atom_slot_insert(atom_tab, hash, atom);
+	(void) pthread_mutex_unlock(&atom_lock);
+	return (atom);
+}
+
+atom_t
+atom_intern_str(const char *s)
+{
+	return (atom_intern(s, strlen(s)));
+}
+
+/*
+ * Return the atom for the len bytes at s if one exists, otherwise
+ * ATOM_NONE.  Unlike atom_intern(), this never creates an atom, so it can be
+ * used to look up a name (e.g. a macro) without growing the table when the
+ * name isn't defined.
+ */
+atom_t
+atom_find(const char *s, size_t len)
+{
+	return (atom_lookup(s, len, atom_hash(s, len)));
+}
+
+const char *
+atom_name(atom_t atom)
+{
+	VERIFY3U(atom, !=, ATOM_NONE);
+	VERIFY3U(atom, <, __atomic_load_n(&atom_nents, __ATOMIC_ACQUIRE));
+	return (atom_ent(atom)->ae_str);
+}
+
+size_t
+atom_len(atom_t atom)
+{
+	VERIFY3U(atom, !=, ATOM_NONE);
+	VERIFY3U(atom, <, __atomic_load_n(&atom_nents, __ATOMIC_ACQUIRE));
+	return (atom_ent(atom)->ae_len);
+}
+
+/* The number of atoms */
+size_t
+atom_count(void)
+{
+	size_t n = __atomic_load_n(&atom_nents, __ATOMIC_ACQUIRE);
+
+	return ((n > 0) ? n - 1 : 0);
+}
@@ -0,0 +1,45 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2018 Jason King
+ */
+
+#ifndef _ATOM_H
+#define	_ATOM_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * An interned string.  Two atoms are equal iff their strings are equal, so
+ * names can be compared (and hashed) as integers.
+ */
+typedef uint32_t atom_t;
+
+#define	ATOM_NONE	((atom_t)0)	/* never returned by atom_intern() */
+
+atom_t		atom_intern(const char *, size_t);
+atom_t		atom_intern_str(const char *);
+atom_t		atom_find(const char *, size_t);
+const char	*atom_name(atom_t);
+size_t		atom_len(atom_t);
+size_t		atom_count(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ATOM_H */
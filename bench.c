@@ -0,0 +1,1902 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2018 Jason King
+ */
+
+/*
+ * Benchmarks for the hot paths of make.  These are not run as part of
+ * the normal build, use 'make bench' to build them.
+ *
+ * Usage: bench [-i iters] [-d depth] [-x scale] [makefile...]
+ *
+ * With no makefiles, a synthetic makefile tree is generated (see gen_tree())
+ * and used.  Each phase (loading and indexing, tokenizing, tokenizing while
+ * following includes, and parsing) is timed separately, and the best time
+ * of all the iterations is reported along with the throughput and the
+ * number of allocations done per iteration.  Lastly, lookups in a large
+ * macro table are timed.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/debug.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <umem.h>
+#include <unistd.h>
+
+#include "atom.h"
+#include "custr.h"
+#include "filestat.h"
+#include "history.h"
+#include "input.h"
+#include "macro.h"
+#include "make.h"
+#include "parse.h"
+#include "prefetch.h"
+#include "schedule.h"
+#include "target.h"
+#include "token.h"
+#include "util.h"
+#include "var.h"
+#include "vpath.h"
+
+#define	BENCH_INDEX_SIZE	(64U * 1024U * 1024U)
+#define	BENCH_ITERS		10U
+#define	BENCH_DEPTH		32U
+#define	BENCH_SCALE		1U
+#define	BENCH_MACROS		50000U
+#define	BENCH_LOOKUPS		10000000U
+#define	BENCH_EXPANSIONS	1000000U
+#define	BENCH_ATOM_THREADS	4U
+#define	BENCH_ATOM_NAMES	100000U
+#define	BENCH_COND_TARGETS	500U
+#define	BENCH_MEMO_TARGETS	20000U
+#define	BENCH_LIST_WORDS	10000U
+#define	BENCH_LIST_EXPANSIONS	100U
+#define	BENCH_GRAPH_TARGETS	50000U
+#define	BENCH_GRAPH_DEPS	8U	/* per target */
+#define	BENCH_SCHED_WORK	2000U	/* loop iterations per "build" */
+#define	BENCH_SCHED_CHK_N	500U	/* random targets in the checks */
+#define	BENCH_STAT_DIRS		16U
+#define	BENCH_STAT_FILES	256U	/* per directory */
+#define	BENCH_STAT_LOOKUPS	300000U
+#define	BENCH_VPATH_DIRS	12U
+#define	BENCH_VPATH_FILES	1000U	/* per directory */
+
+#define	ARRAY_SIZE(x) (sizeof (x) / sizeof (x[0]))
+
+/* Sizes of the synthetic tree (multiplied by the scale) */
+#define	GEN_WORDS		10000U	/* words in a big macro value */
+#define	GEN_TARGETS		2000U	/* targets w/ recipes */
+#define	GEN_RECIPE_LINES	6U	/* lines per recipe */
+#define	GEN_CONT_LINES		5000U	/* continued lines */
+
+typedef struct bench_files {
+	char	**bf_paths;
+	size_t	bf_n;
+	size_t	bf_alloc;
+	size_t	bf_bytes;	/* total size of all the files */
+	char	*bf_dir;	/* generated tree (if any) */
+} bench_files_t;
+
+typedef struct bench_result {
+	hrtime_t	br_best;
+	size_t		br_allocs;	/* # allocations per iteration */
+	size_t		br_abytes;	/* bytes allocated per iteration */
+} bench_result_t;
+
+static size_t iters = BENCH_ITERS;
+
+const char *
+_umem_debug_init(void)
+{
+	return ("");
+}
+
+static void
+bench_report(const char *name, size_t bytes, const bench_result_t *br)
+{
+	double secs = (double)br->br_best / (double)NANOSEC;
+	double mbps = (secs > 0.0) ?
+	    (double)bytes / (1024.0 * 1024.0) / secs : 0.0;
+
+	(void) printf("%-24s %11zu bytes %9.3f ms %9.2f MB/s "
+	    "%9zu allocs %11zu bytes alloc\n", name, bytes,
+	    (double)br->br_best / 1000000.0, mbps, br->br_allocs,
+	    br->br_abytes);
+}
+
+static void
+bench_report_ops(const char *name, const char *what, size_t n,
+    const bench_result_t *br)
+{
+	(void) printf("%-24s %11zu %-5s %9.3f ms %9.2f ns/op\n", name, n, what,
+	    (double)br->br_best / 1000000.0,
+	    (double)br->br_best / (double)n);
+}
+
+static void
+bench_start(hrtime_t *startp, size_t *countp, size_t *bytesp)
+{
+	alloc_stats(countp, bytesp);
+	*startp = gethrtime();
+}
+
+static void
+bench_stop(bench_result_t *br, hrtime_t start, size_t count, size_t bytes)
+{
+	hrtime_t t = gethrtime() - start;
+	size_t ncount, nbytes;
+
+	alloc_stats(&ncount, &nbytes);
+
+	if (br->br_best == 0 || t < br->br_best)
+		br->br_best = t;
+	br->br_allocs = ncount - count;
+	br->br_abytes = nbytes - bytes;
+}
+
+static void
+files_add(bench_files_t *bf, const char *path)
+{
+	struct stat sb;
+
+	if (stat(path, &sb) == -1)
+		err(EXIT_FAILURE, "%s", path);
+
+	if (bf->bf_n == bf->bf_alloc) {
+		size_t newalloc = (bf->bf_alloc == 0) ? 8 : bf->bf_alloc * 2;
+
+		bf->bf_paths = xrealloc(bf->bf_paths,
+		    bf->bf_alloc * sizeof (char *), newalloc * sizeof (char *));
+		bf->bf_alloc = newalloc;
+	}
+
+	bf->bf_paths[bf->bf_n++] = xstrdup(path);
+	bf->bf_bytes += (size_t)sb.st_size;
+}
+
+static void
+files_free(bench_files_t *bf)
+{
+	for (size_t i = 0; i < bf->bf_n; i++) {
+		if (bf->bf_dir != NULL)
+			(void) unlink(bf->bf_paths[i]);
+		strfree(bf->bf_paths[i]);
+	}
+	cfree(bf->bf_paths, bf->bf_alloc, sizeof (char *));
+
+	if (bf->bf_dir != NULL) {
+		(void) rmdir(bf->bf_dir);
+		strfree(bf->bf_dir);
+	}
+}
+
+static FILE *
+gen_open(bench_files_t *bf, const char *name, char **pathp)
+{
+	FILE *f = NULL;
+
+	*pathp = xprintf("%s/%s", bf->bf_dir, name);
+	if ((f = fopen(*pathp, "w")) == NULL)
+		err(EXIT_FAILURE, "%s", *pathp);
+	return (f);
+}
+
+static void
+gen_close(bench_files_t *bf, FILE *f, char *path)
+{
+	if (fclose(f) != 0)
+		err(EXIT_FAILURE, "%s", path);
+	files_add(bf, path);
+	strfree(path);
+}
+
+/*
+ * Generate a synthetic makefile tree.  The first file is the top level
+ * makefile, which includes:
+ *	- A chain of depth files, each including the next
+ *	- A file of macros with very long values, both on a single line, and
+ *	  built from many continued lines.
+ *	- A file of targets with long recipes
+ */
+static void
+gen_tree(bench_files_t *bf, size_t depth, size_t scale)
+{
+	char tmpl[] = "/tmp/make-bench.XXXXXX";
+	char *path = NULL;
+	FILE *f = NULL;
+
+	if (mkdtemp(tmpl) == NULL)
+		err(EXIT_FAILURE, "mkdtemp");
+	bf->bf_dir = xstrdup(tmpl);
+
+	f = gen_open(bf, "Makefile", &path);
+	(void) fprintf(f, "# Synthetic makefile tree\n");
+	(void) fprintf(f, "include %s/inc0.mk\n", bf->bf_dir);
+	(void) fprintf(f, "include %s/macros.mk\n", bf->bf_dir);
+	(void) fprintf(f, "include %s/targets.mk\n", bf->bf_dir);
+	(void) fprintf(f, "\nall: $(TARGETS)\n");
+	gen_close(bf, f, path);
+
+	for (size_t i = 0; i < depth; i++) {
+		char *name = xprintf("inc%zu.mk", i);
+
+		f = gen_open(bf, name, &path);
+		(void) fprintf(f, "# Include level %zu\n", i);
+		(void) fprintf(f, "LEVEL%zu_CFLAGS = -DLEVEL=%zu "
+		    "-I$(SRC)/level%zu $(CFLAGS)\n", i, i, i);
+		(void) fprintf(f, "LEVEL%zu_OBJS += level%zu.o\n\n", i, i);
+		if (i + 1 < depth)
+			(void) fprintf(f, "include %s/inc%zu.mk\n", bf->bf_dir,
+			    i + 1);
+		(void) fprintf(f, "\nlevel%zu.o: level%zu.c\n", i, i);
+		(void) fprintf(f, "\t$(CC) $(LEVEL%zu_CFLAGS) -c -o $@ "
+		    "level%zu.c\n", i, i);
+		gen_close(bf, f, path);
+		strfree(name);
+	}
+
+	f = gen_open(bf, "macros.mk", &path);
+	(void) fprintf(f, "BIGLIST =");
+	for (size_t i = 0; i < GEN_WORDS * scale; i++)
+		(void) fprintf(f, " word%zu.o", i);
+	(void) fprintf(f, "\n\nCONTLIST =");
+	for (size_t i = 0; i < GEN_CONT_LINES * scale; i++) {
+		(void) fprintf(f, " \\\n\tsrc/dir%zu/file%zu.c "
+		    "src/dir%zu/file%zu.h", i % 64, i, i % 64, i);
+	}
+	(void) fprintf(f, "\n\nSRCS = $(BIGLIST:%%.o=%%.c)\n");
+	gen_close(bf, f, path);
+
+	f = gen_open(bf, "targets.mk", &path);
+	for (size_t i = 0; i < GEN_TARGETS * scale; i++) {
+		(void) fprintf(f, "TARGETS += target%zu\n", i);
+		(void) fprintf(f, "target%zu: target%zu.o $(LEVEL%zu_OBJS)\n",
+		    i, i, i % (depth > 0 ? depth : 1));
+		for (size_t j = 0; j < GEN_RECIPE_LINES; j++) {
+			(void) fprintf(f, "\t$(CC) $(CFLAGS) $(CPPFLAGS) "
+			    "-DTARGET=%zu -DSTEP=%zu -o $@.%zu $< "
+			    "$(LDFLAGS) $(LDLIBS) -lumem -lnvpair -lcustr "
+			    "# step %zu of target %zu\n", i, j, j, j, i);
+		}
+		(void) fprintf(f, "\n");
+	}
+	gen_close(bf, f, path);
+}
+
+/*
+ * Write a file of roughly len bytes consisting of makefile-like lines of
+ * varying length (including empty lines) to a temporary file.
+ */
+static char *
+bench_mkfile(size_t len)
+{
+	char *path = xprintf("/tmp/make-bench.%d", (int)getpid());
+	FILE *f = NULL;
+	size_t total = 0;
+	unsigned int seed = 1;
+
+	if ((f = fopen(path, "w")) == NULL)
+		err(EXIT_FAILURE, "%s", path);
+
+	while (total < len) {
+		size_t linelen = (size_t)(rand_r(&seed) % 120);
+
+		for (size_t i = 0; i < linelen; i++)
+			(void) fputc('a' + (i % 26), f);
+		(void) fputc('\n', f);
+		total += linelen + 1;
+	}
+
+	if (fclose(f) != 0)
+		err(EXIT_FAILURE, "%s", path);
+
+	return (path);
+}
+
+/*
+ * custr_reserve() grows by doubling from a 64 byte chunk, so appends of
+ * exactly a chunk (or a power of 2 multiple) to an empty custr are where a
+ * buffer without room for the NUL would show up.
+ */
+static void
+bench_custr_check(void)
+{
+	static const size_t lens[] = { 63, 64, 65, 127, 128, 129, 256 };
+	char buf[256];
+
+	(void) memset(buf, 'x', sizeof (buf));
+
+	for (size_t i = 0; i < ARRAY_SIZE(lens); i++) {
+		custr_t *cu = NULL;
+
+		VERIFY0(custr_alloc(&cu, cu_memops));
+		VERIFY0(custr_append_range(cu, buf, lens[i]));
+		VERIFY3U(custr_len(cu), ==, lens[i]);
+		VERIFY3U(strlen(custr_cstr(cu)), ==, lens[i]);
+
+		/* and again, growing a non-empty one */
+		VERIFY0(custr_append_range(cu, buf, lens[i]));
+		VERIFY3U(strlen(custr_cstr(cu)), ==, 2 * lens[i]);
+		custr_free(cu);
+	}
+}
+
+static void
+bench_index(void)
+{
+	char *path = bench_mkfile(BENCH_INDEX_SIZE);
+	input_t *in = NULL;
+	hrtime_t start, best = 0;
+	size_t lines = 0, bytes = 0;
+
+	for (size_t i = 0; i < iters; i++) {
+		hrtime_t t;
+
+		start = gethrtime();
+		if ((in = input_new(path)) == NULL)
+			errx(EXIT_FAILURE, "failed to load %s", path);
+		t = gethrtime() - start;
+
+		if (best == 0 || t < best)
+			best = t;
+
+		lines = input_numlines(in);
+		bytes = (size_t)(input_line(in, lines) - input_line(in, 0));
+		input_free(in);
+		input_cache_reset();
+	}
+
+	(void) printf("%-24s %11zu bytes %9zu lines %8.3f ms %7.2f GB/s\n",
+	    "input_new/index_input", bytes, lines, (double)best / 1000000.0,
+	    (best > 0) ? (double)bytes / (double)best : 0.0);
+
+	(void) unlink(path);
+	strfree(path);
+}
+
+static input_t **
+load_all(const bench_files_t *bf)
+{
+	input_t **ins = xcalloc(bf->bf_n, sizeof (input_t *));
+
+	for (size_t i = 0; i < bf->bf_n; i++) {
+		if ((ins[i] = input_new(bf->bf_paths[i])) == NULL)
+			errx(EXIT_FAILURE, "failed to load %s",
+			    bf->bf_paths[i]);
+	}
+	return (ins);
+}
+
+static void
+free_all(const bench_files_t *bf, input_t **ins)
+{
+	for (size_t i = 0; i < bf->bf_n; i++)
+		input_free(ins[i]);
+	cfree(ins, bf->bf_n, sizeof (input_t *));
+	input_cache_reset();
+}
+
+static void
+bench_load(const bench_files_t *bf)
+{
+	bench_result_t br = { 0 };
+
+	for (size_t i = 0; i < iters; i++) {
+		input_t **ins = NULL;
+		hrtime_t start;
+		size_t count, bytes;
+
+		bench_start(&start, &count, &bytes);
+		ins = load_all(bf);
+		free_all(bf, ins);
+		bench_stop(&br, start, count, bytes);
+	}
+
+	bench_report("input_new", bf->bf_bytes, &br);
+}
+
+/*
+ * An input (and its token streams) stays in the input cache after its last
+ * user is done with it, until the cache is reset.  Tokenizing an input for
+ * another make style leaves the token stream of the first style alone.
+ */
+static void
+bench_cache_check(make_t *mk, const char *path)
+{
+	make_t other = *mk;
+	input_t *in = NULL;
+	tok_array_t *ta = NULL;
+
+	other.mk_style = (mk->mk_style == MS_BSD) ? MS_GNU : MS_BSD;
+
+	if ((in = input_new(path)) == NULL)
+		errx(EXIT_FAILURE, "failed to load %s", path);
+	VERIFY3P(ta = tokenize(mk, in), !=, NULL);
+	VERIFY3P(tokenize(&other, in), !=, ta);
+	VERIFY3P(tokenize(mk, in), ==, ta);
+	VERIFY3U(tok_array_len(ta), >, 0);
+	input_free(in);
+
+	in = input_new(path);
+	VERIFY3P(input_tokens(in, mk->mk_style), ==, ta);
+	VERIFY3P(input_tokens(in, other.mk_style), !=, NULL);
+	input_free(in);
+
+	input_cache_reset();
+	in = input_new(path);
+	VERIFY3P(input_tokens(in, mk->mk_style), ==, NULL);
+	input_free(in);
+	input_cache_reset();
+}
+
+static void
+bench_tokenize(make_t *mk, const bench_files_t *bf)
+{
+	bench_result_t br = { 0 };
+	input_t **ins = NULL;
+
+	bench_cache_check(mk, bf->bf_paths[0]);
+
+	for (size_t i = 0; i < iters; i++) {
+		hrtime_t start;
+		size_t count, bytes;
+
+		/* Reload, so nothing has a token stream from the last time */
+		ins = load_all(bf);
+
+		bench_start(&start, &count, &bytes);
+		for (size_t j = 0; j < bf->bf_n; j++) {
+			if (tokenize(mk, ins[j]) == NULL)
+				errx(EXIT_FAILURE, "failed to tokenize %s",
+				    bf->bf_paths[j]);
+		}
+		bench_stop(&br, start, count, bytes);
+
+		free_all(bf, ins);
+	}
+
+	bench_report("tokenize", bf->bf_bytes, &br);
+}
+
+static void
+tree_cb(input_iter_t *iter, iter_event_t evt, void *arg)
+{
+	input_t *in = iter_input(iter);
+	size_t *bytesp = arg;
+
+	if (evt == IEVT_PUSH)
+		*bytesp += (size_t)(input_line(in, input_numlines(in)) -
+		    input_line(in, 0));
+}
+
+/*
+ * Tokenize the first file, along with everything it includes.  Returns the
+ * number of bytes of input tokenized.
+ */
+static size_t
+tokenize_tree(make_t *mk, input_t *top)
+{
+	size_t bytes = 0;
+	tokenizer_t *tk = tokenizer_new(mk, top, tree_cb, &bytes);
+	token_t t = { 0 };
+
+	while (tok_next(tk, &t))
+		;
+
+	if (tokenizer_error(tk))
+		errx(EXIT_FAILURE, "failed to tokenize %s", input_name(top));
+
+	tokenizer_free(tk);
+	return (bytes);
+}
+
+static void *
+atom_check_thr(void *arg)
+{
+	atom_t *atoms = arg;
+	char name[32];
+
+	for (size_t i = 0; i < BENCH_ATOM_NAMES; i++) {
+		(void) snprintf(name, sizeof (name), "chk.atom.%zu", i);
+		atoms[i] = atom_intern_str(name);
+
+		/* Look up one that another thread may be creating */
+		(void) snprintf(name, sizeof (name), "chk.atom.%zu", i + 1);
+		VERIFY3U(atom_find(name, strlen(name)), <=,
+		    atom_count());
+	}
+	return (NULL);
+}
+
+/*
+ * Several threads intern the same names at once, while the table grows
+ * under them.  Each name must still get exactly one atom.
+ */
+static void
+bench_atom_check(void)
+{
+	pthread_t thr[BENCH_ATOM_THREADS];
+	atom_t *atoms[BENCH_ATOM_THREADS];
+	size_t before = atom_count();
+	char name[32];
+
+	for (size_t t = 0; t < BENCH_ATOM_THREADS; t++) {
+		atoms[t] = xcalloc(BENCH_ATOM_NAMES, sizeof (atom_t));
+		VERIFY0(pthread_create(&thr[t], NULL, atom_check_thr,
+		    atoms[t]));
+	}
+	for (size_t t = 0; t < BENCH_ATOM_THREADS; t++)
+		VERIFY0(pthread_join(thr[t], NULL));
+
+	VERIFY3U(atom_count(), ==, before + BENCH_ATOM_NAMES);
+	for (size_t i = 0; i < BENCH_ATOM_NAMES; i++) {
+		(void) snprintf(name, sizeof (name), "chk.atom.%zu", i);
+		VERIFY0(strcmp(atom_name(atoms[0][i]), name));
+		VERIFY3U(atom_find(name, strlen(name)), ==, atoms[0][i]);
+		for (size_t t = 1; t < BENCH_ATOM_THREADS; t++)
+			VERIFY3U(atoms[t][i], ==, atoms[0][i]);
+	}
+
+	for (size_t t = 0; t < BENCH_ATOM_THREADS; t++)
+		cfree(atoms[t], BENCH_ATOM_NAMES, sizeof (atom_t));
+}
+
+/*
+ * Intern every word in the tree.  After the first iteration, every word is
+ * already an atom, so this is mostly the cost of a lookup.
+ */
+static void
+bench_atoms(make_t *mk, const bench_files_t *bf)
+{
+	bench_result_t br = { 0 };
+	input_t **ins = load_all(bf);
+	size_t words = 0;
+	size_t bytes = 0;
+
+	for (size_t i = 0; i < iters; i++) {
+		hrtime_t start;
+		size_t count, abytes;
+
+		words = bytes = 0;
+		bench_start(&start, &count, &abytes);
+		for (size_t j = 0; j < bf->bf_n; j++) {
+			tok_array_t *ta = tokenize(mk, ins[j]);
+			tok_iter_t iter;
+			token_t t;
+
+			if (ta == NULL)
+				errx(EXIT_FAILURE, "failed to tokenize %s",
+				    bf->bf_paths[j]);
+
+			tok_iter_init(&iter, ta);
+			while (tok_iter_next(&iter, &t)) {
+				if (t.tok_type != TOK_STRING)
+					continue;
+				(void) atom_intern(t.tok_val, t.tok_len);
+				words++;
+				bytes += t.tok_len;
+			}
+		}
+		bench_stop(&br, start, count, abytes);
+	}
+
+	bench_report("atom_intern", bytes, &br);
+	(void) printf("%24s %11zu words %9zu atoms\n", "", words,
+	    atom_count());
+	free_all(bf, ins);
+
+	bench_atom_check();
+}
+
+/*
+ * BENCH_LOOKUPS random lookups in a table of BENCH_MACROS macros, both by
+ * atom (as expansion does) and by name.
+ */
+static void
+bench_macros(void)
+{
+	bench_result_t br_atom = { 0 };
+	bench_result_t br_name = { 0 };
+	atom_t *atoms = xcalloc(BENCH_MACROS, sizeof (atom_t));
+	char **names = xcalloc(BENCH_MACROS, sizeof (char *));
+	bookmark_t where = { 0 };
+	uintptr_t sum = 0;
+
+	for (size_t i = 0; i < BENCH_MACROS; i++) {
+		char *val = xprintf("value of macro %zu", i);
+
+		names[i] = xprintf("MACRO_%zu", i);
+		macro_assign(names[i], val, where);
+		atoms[i] = atom_intern_str(names[i]);
+		strfree(val);
+	}
+
+	for (size_t i = 0; i < iters; i++) {
+		hrtime_t start;
+		size_t count, bytes;
+		uint32_t x = 2463534242U;
+
+		bench_start(&start, &count, &bytes);
+		for (size_t j = 0; j < BENCH_LOOKUPS; j++) {
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			sum += (uintptr_t)macro_get(atoms[x % BENCH_MACROS]);
+		}
+		bench_stop(&br_atom, start, count, bytes);
+
+		x = 2463534242U;
+		bench_start(&start, &count, &bytes);
+		for (size_t j = 0; j < BENCH_LOOKUPS; j++) {
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			sum += (uintptr_t)macro_value(names[x % BENCH_MACROS]);
+		}
+		bench_stop(&br_name, start, count, bytes);
+	}
+
+	/* Keep the compiler from discarding the lookups */
+	if (sum == 0)
+		(void) printf("\n");
+
+	bench_report_ops("macro_get", "ops", BENCH_LOOKUPS, &br_atom);
+	bench_report_ops("macro_value", "ops", BENCH_LOOKUPS, &br_name);
+
+	for (size_t i = 0; i < BENCH_MACROS; i++)
+		strfree(names[i]);
+	cfree(names, BENCH_MACROS, sizeof (char *));
+	cfree(atoms, BENCH_MACROS, sizeof (atom_t));
+}
+
+/*
+ * Expand a CFLAGS-like macro BENCH_EXPANSIONS times.  var_get() runs the
+ * compiled program for the macro, while var_expand() of the same text must
+ * compile it every time (as a naive expansion would scan it every time).
+ */
+static void
+bench_expand(make_t *mk)
+{
+	static const char *defs[][2] = {
+		{ "MACH", "i386" },
+		{ "SRC", "/ws/usr/src" },
+		{ "COPTFLAG", "-xO3" },
+		{ "CFLAGS_i386", "-m32 -march=pentiumpro" },
+		{ "CPPFLAGS", "-D_KERNEL -D_SYSCALL32 -I$(SRC)/uts/intel" },
+		{ "CERRWARN", "-errtags=yes -errwarn=%all -_gcc=-Wno-switch" },
+		{ "CFLAGS", "$(COPTFLAG) $(CFLAGS_$(MACH)) $(CERRWARN) "
+		    "$(CPPFLAGS) -I$(SRC)/uts/common -I$(SRC)/common" },
+		{ "SRCS", "a.c b.c c.c d.c e.c f.c g.c h.c" },
+		{ "OBJS", "$(SRCS:%.c=obj/%.o)" },
+		{ "LINTFLAGS", "-axsm" },
+	};
+	bench_result_t br_get = { 0 };
+	bench_result_t br_dep = { 0 };
+	bench_result_t br_other = { 0 };
+	bench_result_t br_exp = { 0 };
+	custr_t *out = NULL;
+	size_t len = 0;
+
+	VERIFY0(custr_alloc(&out, cu_memops));
+
+	for (size_t i = 0; i < ARRAY_SIZE(defs); i++)
+		var_set(mk, defs[i][0], defs[i][1]);
+
+	for (size_t i = 0; i < iters; i++) {
+		hrtime_t start;
+		size_t count, bytes;
+
+		bench_start(&start, &count, &bytes);
+		for (size_t j = 0; j < BENCH_EXPANSIONS; j++) {
+			custr_reset(out);
+			if (!var_get(mk, "CFLAGS", out))
+				errx(EXIT_FAILURE, "failed to expand CFLAGS");
+		}
+		bench_stop(&br_get, start, count, bytes);
+		len = custr_len(out);
+
+		/* Changing something CFLAGS uses means expanding it again */
+		bench_start(&start, &count, &bytes);
+		for (size_t j = 0; j < BENCH_EXPANSIONS; j++) {
+			var_set(mk, defs[0][0], defs[0][1]);
+			custr_reset(out);
+			if (!var_get(mk, "CFLAGS", out))
+				errx(EXIT_FAILURE, "failed to expand CFLAGS");
+		}
+		bench_stop(&br_dep, start, count, bytes);
+
+		/* But changing an unrelated macro doesn't */
+		bench_start(&start, &count, &bytes);
+		for (size_t j = 0; j < BENCH_EXPANSIONS; j++) {
+			var_set(mk, defs[9][0], defs[9][1]);
+			custr_reset(out);
+			if (!var_get(mk, "CFLAGS", out))
+				errx(EXIT_FAILURE, "failed to expand CFLAGS");
+		}
+		bench_stop(&br_other, start, count, bytes);
+
+		bench_start(&start, &count, &bytes);
+		for (size_t j = 0; j < BENCH_EXPANSIONS; j++) {
+			custr_reset(out);
+			if (!var_expand(mk, defs[6][1], out))
+				errx(EXIT_FAILURE, "failed to expand CFLAGS");
+		}
+		bench_stop(&br_exp, start, count, bytes);
+	}
+
+	VERIFY3U(len, ==, custr_len(out));
+	bench_report_ops("var_get (memo hit)", "ops", BENCH_EXPANSIONS,
+	    &br_get);
+	bench_report_ops("var_get (dep changed)", "ops",
+	    BENCH_EXPANSIONS, &br_dep);
+	bench_report_ops("var_get (other changed)", "ops",
+	    BENCH_EXPANSIONS, &br_other);
+	bench_report_ops("var_expand (uncompiled)", "ops", BENCH_EXPANSIONS,
+	    &br_exp);
+	custr_free(out);
+}
+
+/*
+ * Find the conditional values of one macro for each of BENCH_COND_TARGETS
+ * targets, by walking the conditional values of the macro (as was done
+ * before they were indexed), and with the index.
+ */
+static void
+bench_cond(void)
+{
+	bench_result_t br_walk = { 0 };
+	bench_result_t br_env = { 0 };
+	atom_t *targets = xcalloc(BENCH_COND_TARGETS, sizeof (atom_t));
+	bookmark_t where = { 0 };
+	macro_t *m = NULL;
+	size_t sum = 0;
+
+	macro_assign("CONDFLAGS", "-O", where);
+	for (size_t i = 0; i < BENCH_COND_TARGETS; i++) {
+		char *target = xprintf("obj/file%zu.o", i);
+
+		macro_cond_append(target, "CONDFLAGS", "-DFILE", where);
+		targets[i] = atom_intern_str(target);
+		strfree(target);
+	}
+	m = macro_get(atom_intern_str("CONDFLAGS"));
+
+	for (size_t i = 0; i < iters; i++) {
+		hrtime_t start;
+		size_t count, bytes;
+
+		bench_start(&start, &count, &bytes);
+		for (size_t j = 0; j < BENCH_EXPANSIONS; j++) {
+			atom_t target = targets[j % BENCH_COND_TARGETS];
+
+			for (cond_macro_t *cm = m->cond; cm != NULL;
+			    cm = cm->next) {
+				if (cm->target == target)
+					sum++;
+			}
+		}
+		bench_stop(&br_walk, start, count, bytes);
+
+		bench_start(&start, &count, &bytes);
+		for (size_t j = 0; j < BENCH_EXPANSIONS; j++) {
+			const macro_env_t *env =
+			    macro_env(targets[j % BENCH_COND_TARGETS]);
+			size_t n;
+
+			(void) macro_env_find(env, m, &n);
+			sum += n;
+		}
+		bench_stop(&br_env, start, count, bytes);
+	}
+
+	VERIFY3U(sum, ==, 2 * iters * BENCH_EXPANSIONS);
+	bench_report_ops("cond (walk)", "ops", BENCH_EXPANSIONS, &br_walk);
+	bench_report_ops("cond (macro_env)", "ops", BENCH_EXPANSIONS,
+	    &br_env);
+	cfree(targets, BENCH_COND_TARGETS, sizeof (atom_t));
+}
+
+/*
+ * Expand a macro with a conditional value for each of BENCH_MEMO_TARGETS
+ * targets.  Each target gets its own memo, so this shows how the cost of
+ * finding one grows with the number of targets.
+ */
+static void
+bench_cond_memo(make_t *mk)
+{
+	bench_result_t br_miss = { 0 };
+	bench_result_t br_hit = { 0 };
+	char **targets = xcalloc(BENCH_MEMO_TARGETS, sizeof (char *));
+	bookmark_t where = { 0 };
+	custr_t *out = NULL;
+
+	VERIFY0(custr_alloc(&out, cu_memops));
+	for (size_t i = 0; i < BENCH_MEMO_TARGETS; i++) {
+		targets[i] = xprintf("obj/memo%zu.o", i);
+		macro_cond_append(targets[i], "MEMOFLAGS", "-DMEMO", where);
+	}
+
+	for (size_t i = 0; i < iters; i++) {
+		hrtime_t start;
+		size_t count, bytes;
+
+		/* A new value makes every memo stale */
+		macro_assign("MEMOFLAGS", "-O", where);
+
+		bench_start(&start, &count, &bytes);
+		for (size_t j = 0; j < BENCH_MEMO_TARGETS; j++) {
+			custr_reset(out);
+			if (!var_get_target(mk, targets[j], "MEMOFLAGS", out))
+				errx(EXIT_FAILURE, "failed to expand %s",
+				    "MEMOFLAGS");
+		}
+		bench_stop(&br_miss, start, count, bytes);
+
+		bench_start(&start, &count, &bytes);
+		for (size_t j = 0; j < BENCH_MEMO_TARGETS; j++) {
+			custr_reset(out);
+			if (!var_get_target(mk, targets[j], "MEMOFLAGS", out))
+				errx(EXIT_FAILURE, "failed to expand %s",
+				    "MEMOFLAGS");
+		}
+		bench_stop(&br_hit, start, count, bytes);
+		VERIFY0(strcmp(custr_cstr(out), "-O -DMEMO"));
+	}
+
+	bench_report_ops("var_get_target (expand)", "targets",
+	    BENCH_MEMO_TARGETS, &br_miss);
+	bench_report_ops("var_get_target (memo hit)", "targets",
+	    BENCH_MEMO_TARGETS, &br_hit);
+	for (size_t i = 0; i < BENCH_MEMO_TARGETS; i++)
+		strfree(targets[i]);
+	cfree(targets, BENCH_MEMO_TARGETS, sizeof (char *));
+	custr_free(out);
+}
+
+/*
+ * Check what the modifiers timed by bench_lists() produce, including a
+ * SysV from=to whose from starts with a BSD modifier letter.
+ */
+static void
+bench_lists_check(make_t *mk)
+{
+	static const struct {
+		const char *expr;
+		const char *want;
+	} checks[] = {
+		{ "$(CHKOBJS:%.o=%.c)",
+		    "b.c a.c Makefile c.c a.c x*y.c N1.c d1.c" },
+		{ "$(CHKOBJS:.o=.c)",
+		    "b.c a.c Makefile c.c a.c x*y.c N1.c d1.c" },
+		{ "$(CHKOBJS:M[a-c].o)", "b.o a.o c.o a.o" },
+		{ "$(CHKOBJS:M[!a-c]*.o)", "x*y.o N1.o d1.o" },
+		{ "$(CHKOBJS:Mx\\*y.o)", "x*y.o" },
+		{ "$(CHKOBJS:N*.o)", "Makefile" },
+		{ "$(CHKOBJS:M[ab].o:.o=.c)", "b.c a.c a.c" },
+		{ "$(CHKOBJS:O:u)", "Makefile N1.o a.o b.o c.o d1.o x*y.o" },
+		{ "$(CHKOBJS:Makefile=mk)",
+		    "b.o a.o mk c.o a.o x*y.o N1.o d1.o" },
+		{ "$(CHKOBJS:N%=Y%)",
+		    "b.o a.o Makefile c.o a.o x*y.o Y1.o d1.o" },
+		{ "$(CHKMODS:Q:a=b)", "Q:a a" },
+	};
+	bookmark_t where = { 0 };
+	custr_t *out = NULL;
+
+	VERIFY0(custr_alloc(&out, cu_memops));
+	macro_assign("CHKOBJS", "b.o a.o Makefile c.o a.o x*y.o N1.o d1.o",
+	    where);
+	macro_assign("CHKMODS", "Q:a a", where);
+
+	for (size_t i = 0; i < ARRAY_SIZE(checks); i++) {
+		custr_reset(out);
+		VERIFY(var_expand(mk, checks[i].expr, out));
+		if (strcmp(custr_cstr(out), checks[i].want) != 0) {
+			errx(EXIT_FAILURE, "%s expanded to '%s', not '%s'",
+			    checks[i].expr, custr_cstr(out), checks[i].want);
+		}
+	}
+
+	custr_free(out);
+}
+
+/*
+ * Build a BENCH_LIST_WORDS word list with += (as OBJS is), and then run
+ * modifiers over it.  Appends and modifiers are reported per word.
+ */
+static void
+bench_lists(make_t *mk)
+{
+	static const char *mods[] = {
+		"$(BIGOBJS:%.o=%.c)",
+		"$(BIGOBJS:.o=.c)",
+		"$(BIGOBJS:M*1.o)",
+		"$(BIGOBJS:O:u)",
+	};
+	bench_result_t br_app = { 0 };
+	bench_result_t br_mod[ARRAY_SIZE(mods)] = { 0 };
+	char **words = xcalloc(BENCH_LIST_WORDS, sizeof (char *));
+	bookmark_t where = { 0 };
+	custr_t *out = NULL;
+
+	bench_lists_check(mk);
+	VERIFY0(custr_alloc(&out, cu_memops));
+
+	for (size_t i = 0; i < BENCH_LIST_WORDS; i++)
+		words[i] = xprintf("obj/file%zu.o", BENCH_LIST_WORDS - i);
+
+	for (size_t i = 0; i < iters; i++) {
+		hrtime_t start;
+		size_t count, bytes;
+
+		bench_start(&start, &count, &bytes);
+		macro_assign("BIGOBJS", "", where);
+		for (size_t j = 0; j < BENCH_LIST_WORDS; j++)
+			macro_append("BIGOBJS", words[j], where);
+		if (macro_value("BIGOBJS") == NULL)
+			errx(EXIT_FAILURE, "BIGOBJS is not defined");
+		bench_stop(&br_app, start, count, bytes);
+
+		for (size_t m = 0; m < ARRAY_SIZE(mods); m++) {
+			bench_start(&start, &count, &bytes);
+			for (size_t j = 0; j < BENCH_LIST_EXPANSIONS; j++) {
+				custr_reset(out);
+				if (!var_expand(mk, mods[m], out)) {
+					errx(EXIT_FAILURE, "failed to expand "
+					    "%s", mods[m]);
+				}
+			}
+			bench_stop(&br_mod[m], start, count, bytes);
+		}
+	}
+
+	bench_report_ops("macro_append", "words", BENCH_LIST_WORDS, &br_app);
+	for (size_t m = 0; m < ARRAY_SIZE(mods); m++) {
+		bench_report_ops(mods[m], "words",
+		    BENCH_LIST_WORDS * BENCH_LIST_EXPANSIONS, &br_mod[m]);
+	}
+
+	for (size_t i = 0; i < BENCH_LIST_WORDS; i++)
+		strfree(words[i]);
+	cfree(words, BENCH_LIST_WORDS, sizeof (char *));
+	custr_free(out);
+}
+
+/*
+ * Build a dependency graph of BENCH_GRAPH_TARGETS targets, each with
+ * BENCH_GRAPH_DEPS (random, earlier) dependencies, and compare walking
+ * every edge through the target_t's with walking the frozen graph.
+ */
+static void
+bench_graph(void)
+{
+	bench_result_t br_freeze = { 0 };
+	bench_result_t br_ptr = { 0 };
+	bench_result_t br_csr = { 0 };
+	bench_result_t br_order = { 0 };
+	target_t **targets = xcalloc(BENCH_GRAPH_TARGETS, sizeof (target_t *));
+	uint32_t *order = xcalloc(BENCH_GRAPH_TARGETS, sizeof (uint32_t));
+	bookmark_t where = { 0 };
+	uint32_t x = 2463534242U;
+	size_t nedges = 0;
+	uint64_t sum_ptr = 0, sum_csr = 0;
+
+	for (size_t i = 0; i < BENCH_GRAPH_TARGETS; i++) {
+		char *name = xprintf("obj/graph%zu.o", i);
+
+		targets[i] = target_lookup_add(atom_intern_str(name), where);
+		strfree(name);
+
+		for (size_t k = 0; i > 0 && k < BENCH_GRAPH_DEPS; k++) {
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			target_dep_add(targets[i], targets[x % i], where);
+		}
+	}
+
+	for (size_t i = 0; i < iters; i++) {
+		target_graph_t *tg = NULL;
+		hrtime_t start;
+		size_t count, bytes;
+
+		bench_start(&start, &count, &bytes);
+		tg = target_graph_freeze();
+		bench_stop(&br_freeze, start, count, bytes);
+		nedges = tg->tg_nedges;
+
+		sum_ptr = 0;
+		bench_start(&start, &count, &bytes);
+		for (size_t j = 0; j < BENCH_GRAPH_TARGETS; j++) {
+			const target_t *t = targets[j];
+
+			for (size_t k = 0; k < t->ndeps; k++)
+				sum_ptr += t->deps[k]->target->id;
+		}
+		bench_stop(&br_ptr, start, count, bytes);
+
+		sum_csr = 0;
+		bench_start(&start, &count, &bytes);
+		for (size_t j = 0; j < tg->tg_n; j++) {
+			for (uint32_t k = tg->tg_deps_off[j];
+			    k < tg->tg_deps_off[j + 1]; k++)
+				sum_csr += tg->tg_deps[k];
+		}
+		bench_stop(&br_csr, start, count, bytes);
+
+		bench_start(&start, &count, &bytes);
+		if (!target_graph_order(tg, order))
+			errx(EXIT_FAILURE, "dependency graph has a cycle");
+		bench_stop(&br_order, start, count, bytes);
+
+		target_graph_free(tg);
+	}
+
+	/* Duplicate edges are dropped by the freeze */
+	VERIFY3U(sum_csr, <=, sum_ptr);
+
+	bench_report_ops("graph freeze", "edges", nedges, &br_freeze);
+	bench_report_ops("graph walk (pointers)", "edges", nedges, &br_ptr);
+	bench_report_ops("graph walk (CSR)", "edges", nedges, &br_csr);
+	bench_report_ops("graph order", "edges", nedges, &br_order);
+
+	cfree(order, BENCH_GRAPH_TARGETS, sizeof (uint32_t));
+	cfree(targets, BENCH_GRAPH_TARGETS, sizeof (target_t *));
+}
+
+/*
+ * The scheduler's own overhead: build every target of the graph from
+ * bench_graph() with a stand-in for running commands that takes a
+ * microsecond or so.
+ */
+static boolean_t
+bench_sched_build(target_t *t, void *arg)
+{
+	uint32_t x = t->id + 1;
+
+	for (size_t i = 0; i < BENCH_SCHED_WORK; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+	}
+	(void) __atomic_add_fetch((uint64_t *)arg, x & 1, __ATOMIC_RELAXED);
+	return (B_TRUE);
+}
+
+/*
+ * What the scheduler checks record about each build.  Every target is
+ * numbered when it starts and when it finishes from bc_seq.
+ */
+typedef struct bench_chk {
+	target_graph_t	*bc_tg;
+	uint64_t	bc_seq;
+	uint64_t	*bc_start;	/* by id, 0 if not started */
+	uint64_t	*bc_fin;	/* by id, 0 if not finished */
+	uint_t		bc_nserial;	/* .NOTPARALLEL targets running */
+	uint_t		bc_maxserial;
+	atom_t		bc_fail;	/* the target that fails */
+	boolean_t	bc_slow;
+} bench_chk_t;
+
+static boolean_t
+bench_chk_build(target_t *t, void *arg)
+{
+	bench_chk_t *bc = arg;
+	const target_graph_t *tg = bc->bc_tg;
+	const char *name = atom_name(t->name);
+	boolean_t serial = (strncmp(name, "chk.s", 5) == 0) ? B_TRUE : B_FALSE;
+	const uint32_t *deps = NULL;
+	size_t ndeps;
+	uint_t n;
+
+	/* Every dependency (but .WAIT, which isn't built) must be done */
+	deps = target_graph_deps(tg, t->id, &ndeps);
+	for (size_t i = 0; i < ndeps; i++) {
+		if (atom_name(tg->tg_targets[deps[i]]->name)[0] == '.')
+			continue;
+		VERIFY3U(__atomic_load_n(&bc->bc_fin[deps[i]],
+		    __ATOMIC_ACQUIRE), !=, 0);
+	}
+
+	if (serial) {
+		n = __atomic_add_fetch(&bc->bc_nserial, 1, __ATOMIC_SEQ_CST);
+		if (n > __atomic_load_n(&bc->bc_maxserial, __ATOMIC_SEQ_CST))
+			__atomic_store_n(&bc->bc_maxserial, n,
+			    __ATOMIC_SEQ_CST);
+	}
+
+	VERIFY3U(bc->bc_start[t->id], ==, 0);
+	bc->bc_start[t->id] = __atomic_add_fetch(&bc->bc_seq, 1,
+	    __ATOMIC_SEQ_CST);
+	if (bc->bc_slow)
+		(void) usleep(200);
+
+	if (serial)
+		(void) __atomic_sub_fetch(&bc->bc_nserial, 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&bc->bc_fin[t->id],
+	    __atomic_add_fetch(&bc->bc_seq, 1, __ATOMIC_SEQ_CST),
+	    __ATOMIC_RELEASE);
+
+	return ((t->name == bc->bc_fail) ? B_FALSE : B_TRUE);
+}
+
+static void
+bench_chk_dep(const char *target, const char *dep, size_t line)
+{
+	bookmark_t where = { .bm_line = line };
+
+	target_dep_add(target_lookup_add(atom_intern_str(target), where),
+	    target_lookup_add(atom_intern_str(dep), where), where);
+}
+
+static uint32_t
+bench_chk_id(const char *name)
+{
+	target_t *t = target_get(atom_find(name, strlen(name)));
+
+	VERIFY3P(t, !=, NULL);
+	return (t->id);
+}
+
+/* Run the scheduler over tg to build goal, and record what happens */
+static boolean_t
+bench_chk_run(bench_chk_t *bc, const char *goal, const sched_opts_t *so)
+{
+	uint32_t id = bench_chk_id(goal);
+
+	(void) memset(bc->bc_start, 0, bc->bc_tg->tg_n * sizeof (uint64_t));
+	(void) memset(bc->bc_fin, 0, bc->bc_tg->tg_n * sizeof (uint64_t));
+	bc->bc_seq = 0;
+	bc->bc_maxserial = 0;
+	return (sched_run(bc->bc_tg, &id, 1, so));
+}
+
+static uint64_t
+bench_chk_start(const bench_chk_t *bc, const char *name)
+{
+	return (bc->bc_start[bench_chk_id(name)]);
+}
+
+static uint64_t
+bench_chk_fin(const bench_chk_t *bc, const char *name)
+{
+	return (bc->bc_fin[bench_chk_id(name)]);
+}
+
+/* Check that later wasn't started until earlier had finished */
+static void
+bench_chk_after(const bench_chk_t *bc, const char *later,
+    const char *earlier)
+{
+	VERIFY3U(bench_chk_fin(bc, earlier), !=, 0);
+	VERIFY3U(bench_chk_start(bc, later), >, bench_chk_fin(bc, earlier));
+}
+
+/*
+ * Check the order the scheduler builds things in with -j1, -j4 and -j16:
+ * dependencies, .WAIT, .ORDER and .NOTPARALLEL, what a failure skips
+ * (with and without -k), and that a cycle made by .ORDER is rejected.
+ * The targets (all named chk.*) are added to the global target table, so
+ * this runs after everything else that uses it.
+ */
+static void
+bench_sched_check(void)
+{
+	static const uint_t jobs[] = { 1, 4, 16 };
+	bench_chk_t bc = { 0 };
+	sched_opts_t so = { .so_build = bench_chk_build, .so_arg = &bc };
+	uint32_t x = 2463534242U;
+	char name[32], dep[32];
+
+	/* chk.top: chk.all chk.x chk.z chk.y chk.sgrp chk.n<last> */
+	bench_chk_dep("chk.all", "chk.a", 1);
+	bench_chk_dep("chk.all", "chk.b", 1);
+	bench_chk_dep("chk.all", ".WAIT", 1);
+	bench_chk_dep("chk.all", "chk.c", 1);
+	bench_chk_dep("chk.all", "chk.d", 1);
+	bench_chk_dep("chk.c", "chk.e", 2);
+	bench_chk_dep(".ORDER", "chk.x", 3);
+	bench_chk_dep(".ORDER", "chk.y", 3);
+	bench_chk_dep(".ORDER", "chk.z", 3);
+	bench_chk_dep(".NOTPARALLEL", "chk.s1", 4);
+	bench_chk_dep(".NOTPARALLEL", "chk.s2", 4);
+	bench_chk_dep(".NOTPARALLEL", "chk.s3", 4);
+	bench_chk_dep(".NOTPARALLEL", "chk.s4", 4);
+	bench_chk_dep("chk.sgrp", "chk.s1", 5);
+	bench_chk_dep("chk.sgrp", "chk.s2", 5);
+	bench_chk_dep("chk.sgrp", "chk.s3", 5);
+	bench_chk_dep("chk.sgrp", "chk.s4", 5);
+	bench_chk_dep("chk.top", "chk.all", 6);
+	bench_chk_dep("chk.top", "chk.z", 6);
+	bench_chk_dep("chk.top", "chk.y", 6);
+	bench_chk_dep("chk.top", "chk.x", 6);
+	bench_chk_dep("chk.top", "chk.sgrp", 6);
+
+	/* A random graph, where each target depends on up to 4 earlier ones */
+	for (size_t i = 1; i < BENCH_SCHED_CHK_N; i++) {
+		(void) snprintf(name, sizeof (name), "chk.n%zu", i);
+		for (size_t k = 0; k < 4; k++) {
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			(void) snprintf(dep, sizeof (dep), "chk.n%zu", x % i);
+			bench_chk_dep(name, dep, 7);
+		}
+	}
+	(void) snprintf(name, sizeof (name), "chk.n%u",
+	    BENCH_SCHED_CHK_N - 1);
+	bench_chk_dep("chk.top", name, 6);
+
+	bc.bc_tg = target_graph_freeze();
+	bc.bc_start = xcalloc(bc.bc_tg->tg_n, sizeof (uint64_t));
+	bc.bc_fin = xcalloc(bc.bc_tg->tg_n, sizeof (uint64_t));
+
+	for (size_t j = 0; j < ARRAY_SIZE(jobs); j++) {
+		so.so_jobs = jobs[j];
+		so.so_keep_going = B_FALSE;
+
+		for (int slow = 0; slow < 2; slow++) {
+			bc.bc_slow = (slow != 0) ? B_TRUE : B_FALSE;
+			VERIFY(bench_chk_run(&bc, "chk.top", &so));
+
+			/* Only .WAIT's own group is held back */
+			bench_chk_after(&bc, "chk.c", "chk.a");
+			bench_chk_after(&bc, "chk.c", "chk.b");
+			bench_chk_after(&bc, "chk.d", "chk.a");
+			bench_chk_after(&bc, "chk.d", "chk.b");
+
+			bench_chk_after(&bc, "chk.y", "chk.x");
+			bench_chk_after(&bc, "chk.z", "chk.y");
+
+			VERIFY3U(bench_chk_fin(&bc, "chk.s4"), !=, 0);
+			VERIFY3U(bc.bc_maxserial, ==, 1);
+			VERIFY3U(bench_chk_fin(&bc, "chk.top"), ==, bc.bc_seq);
+		}
+
+		/* .ORDER doesn't cause anything to be built */
+		VERIFY(bench_chk_run(&bc, "chk.y", &so));
+		VERIFY3U(bench_chk_start(&bc, "chk.x"), ==, 0);
+		VERIFY3U(bench_chk_start(&bc, "chk.z"), ==, 0);
+
+		/* When chk.e fails, nothing that depends on it is built */
+		bc.bc_fail = atom_intern_str("chk.e");
+		so.so_keep_going = B_TRUE;
+		VERIFY(!bench_chk_run(&bc, "chk.top", &so));
+		VERIFY3U(bench_chk_start(&bc, "chk.e"), !=, 0);
+		VERIFY3U(bench_chk_start(&bc, "chk.c"), ==, 0);
+		VERIFY3U(bench_chk_start(&bc, "chk.all"), ==, 0);
+		VERIFY3U(bench_chk_start(&bc, "chk.top"), ==, 0);
+		VERIFY3U(bench_chk_fin(&bc, "chk.z"), !=, 0);
+		VERIFY3U(bench_chk_fin(&bc, "chk.sgrp"), !=, 0);
+		VERIFY3U(bench_chk_fin(&bc, name), !=, 0);
+
+		so.so_keep_going = B_FALSE;
+		VERIFY(!bench_chk_run(&bc, "chk.top", &so));
+		VERIFY3U(bench_chk_start(&bc, "chk.c"), ==, 0);
+		VERIFY3U(bench_chk_start(&bc, "chk.all"), ==, 0);
+		VERIFY3U(bench_chk_start(&bc, "chk.top"), ==, 0);
+		bc.bc_fail = ATOM_NONE;
+	}
+
+	cfree(bc.bc_start, bc.bc_tg->tg_n, sizeof (uint64_t));
+	cfree(bc.bc_fin, bc.bc_tg->tg_n, sizeof (uint64_t));
+	target_graph_free(bc.bc_tg);
+
+	/* chk.q must be built before chk.r, but depends on it (this warns) */
+	bench_chk_dep("chk.q", "chk.r", 8);
+	bench_chk_dep(".ORDER", "chk.q", 9);
+	bench_chk_dep(".ORDER", "chk.r", 9);
+
+	bc.bc_tg = target_graph_freeze();
+	bc.bc_start = xcalloc(bc.bc_tg->tg_n, sizeof (uint64_t));
+	bc.bc_fin = xcalloc(bc.bc_tg->tg_n, sizeof (uint64_t));
+	so.so_jobs = 4;
+	VERIFY(!bench_chk_run(&bc, "chk.q", &so));
+	VERIFY3U(bc.bc_seq, ==, 0);
+
+	cfree(bc.bc_start, bc.bc_tg->tg_n, sizeof (uint64_t));
+	cfree(bc.bc_fin, bc.bc_tg->tg_n, sizeof (uint64_t));
+	target_graph_free(bc.bc_tg);
+}
+
+/*
+ * With one job, the scheduler should start the head of a long chain before
+ * any of a group of independent targets, and with a history, the target
+ * that took longest last time before the rest of its group.
+ */
+static void
+bench_prio_check(void)
+{
+	bench_chk_t bc = { 0 };
+	sched_opts_t so = {
+		.so_jobs = 1,
+		.so_build = bench_chk_build,
+		.so_arg = &bc,
+	};
+	history_t *h = NULL;
+	char name[32], dep[32];
+
+	/* prio.top: prio.l0 ... prio.l19 prio.c9, and prio.c9 ... prio.c0 */
+	for (size_t i = 0; i < 20; i++) {
+		(void) snprintf(name, sizeof (name), "prio.l%zu", i);
+		bench_chk_dep("prio.top", name, 1);
+	}
+	for (size_t i = 1; i < 10; i++) {
+		(void) snprintf(name, sizeof (name), "prio.c%zu", i);
+		(void) snprintf(dep, sizeof (dep), "prio.c%zu", i - 1);
+		bench_chk_dep(name, dep, 2);
+	}
+	bench_chk_dep("prio.top", "prio.c9", 1);
+
+	/* prio.flat: prio.f0 ... prio.f9 */
+	for (size_t i = 0; i < 10; i++) {
+		(void) snprintf(name, sizeof (name), "prio.f%zu", i);
+		bench_chk_dep("prio.flat", name, 3);
+	}
+
+	bc.bc_tg = target_graph_freeze();
+	bc.bc_start = xcalloc(bc.bc_tg->tg_n, sizeof (uint64_t));
+	bc.bc_fin = xcalloc(bc.bc_tg->tg_n, sizeof (uint64_t));
+
+	VERIFY(bench_chk_run(&bc, "prio.top", &so));
+	VERIFY3U(bench_chk_start(&bc, "prio.c0"), ==, 1);
+
+	h = history_load("/nonexistent/history");
+	for (size_t i = 0; i < 10; i++) {
+		(void) snprintf(name, sizeof (name), "prio.f%zu", i);
+		history_record(h, atom_intern_str(name),
+		    (i == 7) ? 1000000000ULL : 1000000ULL);
+	}
+	so.so_history = h;
+	VERIFY(bench_chk_run(&bc, "prio.flat", &so));
+	VERIFY3U(bench_chk_start(&bc, "prio.f7"), ==, 1);
+	history_free(h);
+
+	cfree(bc.bc_start, bc.bc_tg->tg_n, sizeof (uint64_t));
+	cfree(bc.bc_fin, bc.bc_tg->tg_n, sizeof (uint64_t));
+	target_graph_free(bc.bc_tg);
+}
+
+static void
+bench_history_write(const char *path, const char *text)
+{
+	FILE *f = NULL;
+
+	if ((f = fopen(path, "w")) == NULL)
+		err(EXIT_FAILURE, "%s", path);
+	if (fputs(text, f) == EOF || fclose(f) != 0)
+		err(EXIT_FAILURE, "%s", path);
+}
+
+/* Save and load a history, and load some that are damaged */
+static void
+bench_history_check(void)
+{
+	char *path = xprintf("/tmp/make-bench.%d.history", (int)getpid());
+	atom_t a = atom_intern_str("hist.a");
+	atom_t b = atom_intern_str("hist b");
+	history_t *h = NULL;
+
+	(void) unlink(path);
+	h = history_load(path);
+	VERIFY3U(history_mean(h), ==, 0);
+	VERIFY3U(history_get(h, a), ==, 0);
+	history_record(h, a, 1000);
+	history_record(h, b, 3000);
+	VERIFY(history_save(h, path));
+	history_free(h);
+
+	h = history_load(path);
+	VERIFY3U(history_get(h, a), ==, 1000);
+	VERIFY3U(history_get(h, b), ==, 3000);
+	VERIFY3U(history_mean(h), ==, 2000);
+	history_record(h, a, 3000);
+	VERIFY3U(history_get(h, a), ==, 2000);
+	history_free(h);
+
+	/* A different version is ignored entirely */
+	bench_history_write(path, "MKHISTORY 2\n1000 hist.a\n");
+	h = history_load(path);
+	VERIFY3U(history_get(h, a), ==, 0);
+	history_free(h);
+
+	/* As are lines that can't be parsed */
+	bench_history_write(path, "MKHISTORY 1\n"
+	    "123 hist b\n"
+	    "xyz hist.a\n"
+	    "55\n"
+	    "42 \n"
+	    "0 hist.zero\n"
+	    "99 hist.ok\n");
+	h = history_load(path);
+	VERIFY3U(history_get(h, b), ==, 123);
+	VERIFY3U(history_get(h, a), ==, 0);
+	VERIFY3U(history_get(h, atom_intern_str("hist.zero")), ==, 0);
+	VERIFY3U(history_get(h, atom_intern_str("hist.ok")), ==, 99);
+	VERIFY3U(history_mean(h), ==, 111);
+	history_free(h);
+
+	(void) unlink(path);
+	strfree(path);
+}
+
+static void
+bench_sched(void)
+{
+	static const uint_t jobs[] = { 1, 4, 16 };
+	target_graph_t *tg = target_graph_freeze();
+	uint64_t sink = 0;
+
+	for (size_t j = 0; j < ARRAY_SIZE(jobs); j++) {
+		bench_result_t br = { 0 };
+		sched_opts_t opts = {
+			.so_jobs = jobs[j],
+			.so_build = bench_sched_build,
+			.so_arg = &sink,
+		};
+		char name[32];
+
+		for (size_t i = 0; i < iters; i++) {
+			hrtime_t start;
+			size_t count, bytes;
+
+			bench_start(&start, &count, &bytes);
+			if (!sched_run(tg, NULL, 0, &opts))
+				errx(EXIT_FAILURE, "scheduling failed");
+			bench_stop(&br, start, count, bytes);
+		}
+
+		(void) snprintf(name, sizeof (name), "schedule (-j%u)",
+		    jobs[j]);
+		bench_report_ops(name, "targets", tg->tg_n, &br);
+	}
+
+	target_graph_free(tg);
+	bench_prio_check();
+	bench_history_check();
+	bench_sched_check();
+}
+
+/*
+ * A build with nothing to do: look up the status of files in a tree of
+ * "headers" over and over (one in sixteen of the names doesn't exist),
+ * with stat() and with the file status cache.
+ */
+static void
+bench_stat(void)
+{
+	char tmpl[] = "/tmp/make-bench.XXXXXX";
+	size_t npaths = BENCH_STAT_DIRS * BENCH_STAT_FILES;
+	atom_t *paths = xcalloc(npaths, sizeof (atom_t));
+	bench_result_t br_stat = { 0 };
+	bench_result_t br_cache = { 0 };
+	size_t nexist = 0;
+
+	if (mkdtemp(tmpl) == NULL)
+		err(EXIT_FAILURE, "mkdtemp");
+
+	for (size_t d = 0; d < BENCH_STAT_DIRS; d++) {
+		char *dir = xprintf("%s/inc%zu", tmpl, d);
+
+		if (mkdir(dir, 0755) == -1)
+			err(EXIT_FAILURE, "%s", dir);
+
+		for (size_t i = 0; i < BENCH_STAT_FILES; i++) {
+			char *path = xprintf("%s/hdr%zu.h", dir, i);
+			int fd;
+
+			if (i % 16 != 0) {
+				fd = open(path, O_WRONLY | O_CREAT, 0644);
+				if (fd == -1)
+					err(EXIT_FAILURE, "%s", path);
+				(void) close(fd);
+			}
+			paths[d * BENCH_STAT_FILES + i] =
+			    atom_intern_str(path);
+			strfree(path);
+		}
+		strfree(dir);
+	}
+
+	for (size_t i = 0; i < iters; i++) {
+		hrtime_t start;
+		size_t count, bytes;
+		uint32_t x = 2463534242U;
+
+		nexist = 0;
+		bench_start(&start, &count, &bytes);
+		for (size_t j = 0; j < BENCH_STAT_LOOKUPS; j++) {
+			struct stat sb;
+
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			if (stat(atom_name(paths[x % npaths]), &sb) == 0)
+				nexist++;
+		}
+		bench_stop(&br_stat, start, count, bytes);
+
+		x = 2463534242U;
+		bench_start(&start, &count, &bytes);
+		for (size_t j = 0; j < BENCH_STAT_LOOKUPS; j++) {
+			filestat_t fs;
+
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			filestat_get(paths[x % npaths], &fs);
+			if (fs.fs_exists)
+				nexist--;
+		}
+		filestat_reset();
+		bench_stop(&br_cache, start, count, bytes);
+
+		VERIFY3U(nexist, ==, 0);
+	}
+
+	bench_report_ops("stat", "lookups", BENCH_STAT_LOOKUPS, &br_stat);
+	bench_report_ops("filestat", "lookups", BENCH_STAT_LOOKUPS,
+	    &br_cache);
+
+	for (size_t d = 0; d < BENCH_STAT_DIRS; d++) {
+		char *dir = xprintf("%s/inc%zu", tmpl, d);
+
+		for (size_t i = 0; i < BENCH_STAT_FILES; i++) {
+			atom_t path = paths[d * BENCH_STAT_FILES + i];
+
+			(void) unlink(atom_name(path));
+		}
+		(void) rmdir(dir);
+		strfree(dir);
+	}
+	(void) rmdir(tmpl);
+	cfree(paths, npaths, sizeof (atom_t));
+}
+
+/*
+ * Search a dozen directories for sources spread evenly across them (and
+ * for names that aren't in any), with a stat() of each candidate and
+ * with the search path's directory listings.
+ */
+static void
+bench_vpath(void)
+{
+	char tmpl[] = "/tmp/make-bench.XXXXXX";
+	size_t nnames = BENCH_VPATH_DIRS * BENCH_VPATH_FILES;
+	atom_t *names = xcalloc(nnames, sizeof (atom_t));
+	atom_t *found = xcalloc(nnames, sizeof (atom_t));
+	char *dirs[BENCH_VPATH_DIRS] = { 0 };
+	bench_result_t br_stat = { 0 };
+	bench_result_t br_vpath = { 0 };
+	custr_t *cu = NULL;
+
+	VERIFY0(custr_alloc(&cu, cu_memops));
+	if (mkdtemp(tmpl) == NULL)
+		err(EXIT_FAILURE, "mkdtemp");
+
+	for (size_t d = 0; d < BENCH_VPATH_DIRS; d++) {
+		dirs[d] = xprintf("%s/src%zu", tmpl, d);
+		if (mkdir(dirs[d], 0755) == -1)
+			err(EXIT_FAILURE, "%s", dirs[d]);
+	}
+
+	/* One name in eight isn't anywhere */
+	for (size_t i = 0; i < nnames; i++) {
+		char *name = xprintf("file%zu.c", i);
+
+		names[i] = atom_intern_str(name);
+		if (i % 8 != 0) {
+			char *path = xprintf("%s/%s",
+			    dirs[i % BENCH_VPATH_DIRS], name);
+			int fd = open(path, O_WRONLY | O_CREAT, 0644);
+
+			if (fd == -1)
+				err(EXIT_FAILURE, "%s", path);
+			(void) close(fd);
+			strfree(path);
+		}
+		strfree(name);
+	}
+
+	for (size_t i = 0; i < iters; i++) {
+		hrtime_t start;
+		size_t count, bytes;
+
+		bench_start(&start, &count, &bytes);
+		for (size_t j = 0; j < nnames; j++) {
+			found[j] = ATOM_NONE;
+			for (size_t d = 0; d < BENCH_VPATH_DIRS; d++) {
+				struct stat sb;
+
+				custr_reset(cu);
+				VERIFY0(custr_append(cu, dirs[d]));
+				VERIFY0(custr_appendc(cu, '/'));
+				VERIFY0(custr_append(cu, atom_name(names[j])));
+				if (stat(custr_cstr(cu), &sb) == 0) {
+					found[j] = atom_intern_str(
+					    custr_cstr(cu));
+					break;
+				}
+			}
+		}
+		bench_stop(&br_stat, start, count, bytes);
+
+		bench_start(&start, &count, &bytes);
+		for (size_t d = 0; d < BENCH_VPATH_DIRS; d++)
+			vpath_add(dirs[d], strlen(dirs[d]));
+		for (size_t j = 0; j < nnames; j++)
+			VERIFY3U(vpath_find(names[j]), ==, found[j]);
+		vpath_reset();
+		bench_stop(&br_vpath, start, count, bytes);
+	}
+
+	bench_report_ops("search path (stat)", "names", nnames, &br_stat);
+	bench_report_ops("search path (cached)", "names", nnames, &br_vpath);
+
+	for (size_t i = 0; i < nnames; i++) {
+		if (found[i] != ATOM_NONE)
+			(void) unlink(atom_name(found[i]));
+	}
+	for (size_t d = 0; d < BENCH_VPATH_DIRS; d++) {
+		(void) rmdir(dirs[d]);
+		strfree(dirs[d]);
+	}
+	(void) rmdir(tmpl);
+	custr_free(cu);
+	cfree(found, nnames, sizeof (atom_t));
+	cfree(names, nnames, sizeof (atom_t));
+}
+
+static void
+incl_write(const char *path, const char *text)
+{
+	FILE *f = NULL;
+
+	if ((f = fopen(path, "w")) == NULL)
+		err(EXIT_FAILURE, "%s", path);
+	(void) fputs(text, f);
+	if (fclose(f) != 0)
+		err(EXIT_FAILURE, "%s", path);
+}
+
+static void
+incl_cb(input_iter_t *iter, iter_event_t evt, void *arg)
+{
+	custr_t *cu = arg;
+	const char *name = NULL;
+
+	if (evt != IEVT_PUSH)
+		return;
+
+	name = strrchr(input_name(iter_input(iter)), '/') + 1;
+	VERIFY0(custr_append(cu, name));
+	VERIFY0(custr_appendc(cu, ';'));
+}
+
+/*
+ * Only the BSD style looks for a relative include next to the including
+ * file first.  The files named on an include line are read in order, each
+ * after the one before it is done, and the line may end the file.
+ */
+static void
+bench_include_check(make_t *mk)
+{
+	char tmpl[] = "/tmp/make-incl.XXXXXX";
+	char *top = NULL, *a = NULL, *b = NULL, *text = NULL, *p = NULL;
+	custr_t *cu = NULL;
+	tokenizer_t *tk = NULL;
+	input_t *in = NULL;
+	token_t t = { 0 };
+
+	if (mkdtemp(tmpl) == NULL)
+		err(EXIT_FAILURE, "mkdtemp");
+	top = xprintf("%s/top.mk", tmpl);
+	a = xprintf("%s/a.mk", tmpl);
+	b = xprintf("%s/b.mk", tmpl);
+	text = xprintf("include %s %s\nTOP = 1\ninclude %s", a, b, a);
+	incl_write(top, text);
+	incl_write(a, "A = 1\n");
+	incl_write(b, "B = 1\n");
+
+	VERIFY3P(in = input_new(top), !=, NULL);
+	p = input_include_path(in, MS_BSD, "a.mk", 4);
+	VERIFY0(strcmp(p, a));
+	strfree(p);
+	p = input_include_path(in, MS_SYSV, "a.mk", 4);
+	VERIFY0(strcmp(p, "a.mk"));
+	strfree(p);
+
+	VERIFY0(custr_alloc(&cu, cu_memops));
+	tk = tokenizer_new(mk, in, incl_cb, cu);
+	while (tok_next(tk, &t))
+		;
+	VERIFY(!tokenizer_error(tk));
+	tokenizer_free(tk);
+	VERIFY0(strcmp(custr_cstr(cu), "top.mk;a.mk;b.mk;a.mk;"));
+
+	custr_free(cu);
+	input_free(in);
+	input_cache_reset();
+	(void) unlink(top);
+	(void) unlink(a);
+	(void) unlink(b);
+	(void) rmdir(tmpl);
+	strfree(text);
+	strfree(top);
+	strfree(a);
+	strfree(b);
+}
+
+static void
+bench_tok_next(make_t *mk, const bench_files_t *bf)
+{
+	bench_result_t br = { 0 };
+	input_t **ins = NULL;
+	size_t total = 0;
+
+	bench_include_check(mk);
+	ins = load_all(bf);
+
+	for (size_t i = 0; i < iters; i++) {
+		hrtime_t start;
+		size_t count, bytes;
+
+		bench_start(&start, &count, &bytes);
+		total = tokenize_tree(mk, ins[0]);
+		bench_stop(&br, start, count, bytes);
+	}
+
+	bench_report("tok_next (w/ includes)", total, &br);
+	free_all(bf, ins);
+}
+
+/*
+ * Load and tokenize the tree from scratch (nothing is held between
+ * iterations, so every file is reloaded), with nthreads prefetch threads.
+ */
+static void
+bench_prefetch(make_t *mk, const bench_files_t *bf, uint_t nthreads)
+{
+	bench_result_t br = { 0 };
+	size_t total = 0;
+
+	for (size_t i = 0; i < iters; i++) {
+		input_t *top = NULL;
+		hrtime_t start;
+		size_t count, bytes;
+
+		bench_start(&start, &count, &bytes);
+		if (nthreads > 0 && prefetch_init(mk, nthreads))
+			prefetch(bf->bf_paths[0]);
+
+		if ((top = prefetch_input(bf->bf_paths[0])) == NULL)
+			errx(EXIT_FAILURE, "failed to load %s",
+			    bf->bf_paths[0]);
+		total = tokenize_tree(mk, top);
+		input_free(top);
+
+		prefetch_fini();
+		input_cache_reset();
+		bench_stop(&br, start, count, bytes);
+	}
+
+	bench_report(nthreads > 0 ? "load+tok_next (prefetch)" :
+	    "load+tok_next (serial)", total, &br);
+}
+
+/* Parse the first file, which includes the rest of the tree */
+static void
+bench_parse(make_t *mk, const bench_files_t *bf)
+{
+	bench_result_t br = { 0 };
+	input_t **ins = load_all(bf);
+	size_t total = tokenize_tree(mk, ins[0]);
+
+	for (size_t i = 0; i < iters; i++) {
+		hrtime_t start;
+		size_t count, bytes;
+
+		bench_start(&start, &count, &bytes);
+		if (!parse_input(mk, ins[0]))
+			errx(EXIT_FAILURE, "failed to parse %s",
+			    bf->bf_paths[0]);
+		bench_stop(&br, start, count, bytes);
+	}
+
+	bench_report("parse_input (includes)", total, &br);
+	free_all(bf, ins);
+}
+
+static size_t
+get_num(const char *s, char c)
+{
+	char *end = NULL;
+	unsigned long val;
+
+	errno = 0;
+	val = strtoul(s, &end, 10);
+	if (errno != 0 || *end != '\0' || val == 0)
+		errx(EXIT_FAILURE, "invalid value for -%c: %s", c, s);
+	return ((size_t)val);
+}
+
+int
+main(int argc, char **argv)
+{
+	make_t mk = {
+		.mk_debug = stderr,
+		.mk_debug_flags = MDF_NONE,
+		.mk_style = MS_SYSV,
+	};
+	bench_files_t bf = { 0 };
+	size_t depth = BENCH_DEPTH;
+	size_t scale = BENCH_SCALE;
+	int c;
+
+	while ((c = getopt(argc, argv, "d:i:x:")) != -1) {
+		switch (c) {
+		case 'd':
+			depth = get_num(optarg, c);
+			break;
+		case 'i':
+			iters = get_num(optarg, c);
+			break;
+		case 'x':
+			scale = get_num(optarg, c);
+			break;
+		default:
+			(void) fprintf(stderr, "Usage: %s [-i iters] "
+			    "[-d depth] [-x scale] [makefile...]\n", argv[0]);
+			return (EXIT_FAILURE);
+		}
+	}
+
+	if (optind < argc) {
+		for (int i = optind; i < argc; i++)
+			files_add(&bf, argv[i]);
+	} else {
+		gen_tree(&bf, depth, scale);
+	}
+
+	bench_custr_check();
+	bench_index();
+	bench_load(&bf);
+	bench_tokenize(&mk, &bf);
+	bench_tok_next(&mk, &bf);
+	bench_atoms(&mk, &bf);
+	bench_prefetch(&mk, &bf, 0);
+	bench_prefetch(&mk, &bf, PREFETCH_MAX_THREADS);
+	bench_parse(&mk, &bf);
+	bench_macros();
+	bench_expand(&mk);
+	bench_cond();
+	bench_cond_memo(&mk);
+	bench_lists(&mk);
+	bench_graph();
+	bench_sched();
+	bench_stat();
+	bench_vpath();
+
+	files_free(&bf);
+	return (0);
+}
@@ -129,7 +129,7 @@ custr_reserve(custr_t *cus, size_t len)
 		return (-1);
 	}
 
-	if (new_len < cus->cus_datalen) {
+	if (new_len <= cus->cus_datalen) {
 		return (0);
 	}
 
@@ -138,7 +138,15 @@ custr_reserve(custr_t *cus, size_t len)
 		return (-1);
 	}
 
-	while (chunksz < len) {
+	/*
+	 * Grow geometrically, so building a long string from many short
+	 * appends (e.g. a line with many continuations) is not quadratic.
+	 * new_len is what's needed, including the terminating NUL.
+	 */
+	if (chunksz < cus->cus_datalen)
+		chunksz = cus->cus_datalen;
+
+	while (cus->cus_datalen + chunksz < new_len) {
 		if (umul_overflow(chunksz, 2, &chunksz)) {
 			errno = EOVERFLOW;
 			return (-1);
@@ -240,6 +248,18 @@ custr_append(custr_t *cus, const char *name)
 	return (0);
 }
 
+int
+custr_append_range(custr_t *cus, const char *p, size_t len)
+{
+	if (custr_reserve(cus, len) == -1)
+		return (-1);
+
+	(void) memcpy(cus->cus_data + cus->cus_strlen, p, len);
+	cus->cus_strlen += len;
+	cus->cus_data[cus->cus_strlen] = '\0';
+	return (0);
+}
+
 int
 custr_insert_vprintf(custr_t *cus, size_t pos, const char *fmt, va_list ap)
 {
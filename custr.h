@@ -51,6 +51,13 @@ int custr_alloc_buf(custr_t **, void *, size_t);
 int custr_appendc(custr_t *, char);
 int custr_append(custr_t *, const char *);
 
+/*
+ * Append len bytes starting at p to a dynamic string.  The bytes need not be
+ * NUL-terminated.  Returns 0 on success and -1 otherwise.  The dynamic string
+ * will be unmodified if the function returns -1.
+ */
+int custr_append_range(custr_t *, const char *, size_t);
+
 /*
  * Append a format string and arguments as though the contents were being parsed
  * through snprintf. Returns 0 on success and -1 otherwise.  The dynamic string
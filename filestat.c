@@ -0,0 +1,387 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2018 Jason King
+ */
+
+
+/*
+ * The file status cache.
+ *
+ * Deciding what is out of date needs the status of every target and
+ * prerequisite, and many files (headers, libraries) are prerequisites of
+ * thousands of targets, so a build that has nothing to do can spend most
+ * of its time calling stat() on the same files over and over.  Here, the
+ * status of each file is kept by the atom of its path, so every file is
+ * looked up once.
+ *
+ * Files tend to be looked up a directory at a time, so once a directory
+ * has had FS_SWEEP_AFTER lookups, the rest of it is read in one sweep:
+ * readdir() for the names, and fstatat() relative to the directory for
+ * each (which saves resolving the whole path each time).  After that, any
+ * file in the directory is found in the sweep, and one that isn't there
+ * doesn't exist.  A directory that can't be read (other than because it
+ * doesn't exist) is never swept, and its files are stat()ed one at a time.
+ *
+ * The cache assumes that nothing but make changes the files it looks at
+ * during the run.  When make rebuilds a file, filestat_invalidate() makes
+ * the next lookup of that file (only) stat() it again.
+ *
+ * Lookups may come from any thread, so everything is protected by fs_lock.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/debug.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <umem.h>
+#include <unistd.h>
+
+#include "atom.h"
+#include "filestat.h"
+#include "util.h"
+
+#define	FS_SWEEP_AFTER	4U	/* lookups in a directory before a sweep */
+#define	FS_MINENTS	1024U
+#define	FS_MINDIRS	64U	/* must be a power of 2 */
+#define	FS_MINDENTS	16U
+
+#ifndef MAX
+#define	MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+/* fe_state */
+#define	FE_UNKNOWN	0	/* never looked up */
+#define	FE_CACHED	1
+#define	FE_STALE	2	/* rebuilt since it was looked up */
+
+typedef struct fs_ent {
+	filestat_t	fe_stat;
+	uint8_t		fe_state;
+} fs_ent_t;
+
+/* A file found by a sweep */
+typedef struct fs_dent {
+	char		*de_name;
+	filestat_t	de_stat;
+} fs_dent_t;
+
+/* dr_state */
+#define	DR_NEW		0
+#define	DR_SWEPT	1
+#define	DR_NOSWEEP	2	/* couldn't be read */
+
+typedef struct fs_dir {
+	struct fs_dir	*dr_next;	/* hash chain */
+	char		*dr_path;
+	size_t		dr_len;
+	uint32_t	dr_hash;
+	uint32_t	dr_lookups;
+	uint8_t		dr_state;
+	fs_dent_t	*dr_ents;	/* sorted by name */
+	size_t		dr_nents;
+	size_t		dr_alloc;
+} fs_dir_t;
+
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static fs_ent_t *fs_ents;	/* indexed by atom_t */
+static size_t fs_entalloc;
+
+static fs_dir_t **fs_dirs;	/* hash table of directories */
+static size_t fs_ndirs;
+static size_t fs_dirbuckets;
+
+/* 32-bit FNV-1a */
+static uint32_t
+fs_hash(const char *s, size_t len)
+{
+	uint32_t h = 2166136261U;
+
+	for (size_t i = 0; i < len; i++) {
+		h ^= (uchar_t)s[i];
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+static void
+fs_fill(filestat_t *fs, const struct stat *sb)
+{
+	fs->fs_exists = B_TRUE;
+	fs->fs_mode = sb->st_mode;
+	fs->fs_mtime = (int64_t)sb->st_mtim.tv_sec * 1000000000LL +
+	    (int64_t)sb->st_mtim.tv_nsec;
+}
+
+static fs_ent_t *
+fs_ent(atom_t path)
+{
+	VERIFY3U(path, !=, ATOM_NONE);
+
+	if (path >= fs_entalloc) {
+		size_t newn = MAX(fs_entalloc, FS_MINENTS);
+
+		while (newn <= path)
+			newn *= 2;
+
+		fs_ents = xrealloc(fs_ents, fs_entalloc * sizeof (fs_ent_t),
+		    newn * sizeof (fs_ent_t));
+		fs_entalloc = newn;
+	}
+
+	return (&fs_ents[path]);
+}
+
+/* Keep the hash table at most twice as full as it has buckets */
+static void
+fs_dir_grow(void)
+{
+	fs_dir_t **dirs = NULL;
+	size_t nbuckets;
+
+	if (fs_ndirs < fs_dirbuckets * 2)
+		return;
+
+	nbuckets = (fs_dirbuckets == 0) ? FS_MINDIRS : fs_dirbuckets * 2;
+	dirs = xcalloc(nbuckets, sizeof (fs_dir_t *));
+
+	for (size_t i = 0; i < fs_dirbuckets; i++) {
+		fs_dir_t *dr = fs_dirs[i];
+
+		while (dr != NULL) {
+			fs_dir_t *next = dr->dr_next;
+			size_t b = dr->dr_hash & (nbuckets - 1);
+
+			dr->dr_next = dirs[b];
+			dirs[b] = dr;
+			dr = next;
+		}
+	}
+
+	cfree(fs_dirs, fs_dirbuckets, sizeof (fs_dir_t *));
+	fs_dirs = dirs;
+	fs_dirbuckets = nbuckets;
+}
+
+/* Find (or create) the directory with the len byte path */
+static fs_dir_t *
+fs_dir(const char *path, size_t len)
+{
+	uint32_t hash = fs_hash(path, len);
+	fs_dir_t *dr = NULL;
+	size_t b;
+
+	fs_dir_grow();
+
+	b = hash & (fs_dirbuckets - 1);
+	for (dr = fs_dirs[b]; dr != NULL; dr = dr->dr_next) {
+		if (dr->dr_hash == hash && dr->dr_len == len &&
+		    memcmp(dr->dr_path, path, len) == 0)
+			return (dr);
+	}
+
+	dr = zalloc(sizeof (*dr));
+	dr->dr_path = zalloc(len + 1);
+	(void) memcpy(dr->dr_path, path, len);
+	dr->dr_len = len;
+	dr->dr_hash = hash;
+
+	dr->dr_next = fs_dirs[b];
+	fs_dirs[b] = dr;
+	fs_ndirs++;
+	return (dr);
+}
+
+static int
+fs_dent_cmp(const void *a, const void *b)
+{
+	const fs_dent_t *l = a;
+	const fs_dent_t *r = b;
+
+	return (strcmp(l->de_name, r->de_name));
+}
+
+static void
+fs_dent_add(fs_dir_t *dr, int dfd, const char *name)
+{
+	fs_dent_t *de = NULL;
+	struct stat sb;
+
+	if (dr->dr_nents == dr->dr_alloc) {
+		size_t newn = MAX(dr->dr_alloc * 2, FS_MINDENTS);
+
+		dr->dr_ents = xrealloc(dr->dr_ents,
+		    dr->dr_alloc * sizeof (fs_dent_t),
+		    newn * sizeof (fs_dent_t));
+		dr->dr_alloc = newn;
+	}
+
+	de = &dr->dr_ents[dr->dr_nents++];
+	de->de_name = xstrdup(name);
+
+	/* A dangling symlink doesn't exist, as far as make is concerned */
+	if (fstatat(dfd, name, &sb, 0) == 0)
+		fs_fill(&de->de_stat, &sb);
+}
+
+/* Read the status of everything in dr */
+static void
+fs_sweep(fs_dir_t *dr)
+{
+	struct dirent *dp = NULL;
+	DIR *d = NULL;
+
+	if ((d = opendir(dr->dr_path)) == NULL) {
+		/* If it doesn't exist, neither does anything in it */
+		dr->dr_state = (errno == ENOENT || errno == ENOTDIR) ?
+		    DR_SWEPT : DR_NOSWEEP;
+		return;
+	}
+
+	while ((dp = readdir(d)) != NULL) {
+		if (strcmp(dp->d_name, ".") == 0 ||
+		    strcmp(dp->d_name, "..") == 0)
+			continue;
+		fs_dent_add(dr, dirfd(d), dp->d_name);
+	}
+	(void) closedir(d);
+
+	if (dr->dr_nents > 1) {
+		qsort(dr->dr_ents, dr->dr_nents, sizeof (fs_dent_t),
+		    fs_dent_cmp);
+	}
+	dr->dr_state = DR_SWEPT;
+}
+
+/*
+ * Look up path (len bytes) in the sweep of its directory (sweeping it if
+ * it's time).  Returns B_FALSE if the directory hasn't been swept.
+ */
+static boolean_t
+fs_dir_lookup(const char *path, size_t len, filestat_t *fs)
+{
+	const char *base = path + len;
+	const char *slash = NULL;
+	fs_dir_t *dr = NULL;
+	fs_dent_t key = { 0 };
+	const fs_dent_t *de = NULL;
+
+	/* The name is everything after the last '/' of the len bytes */
+	while (base > path && base[-1] != '/')
+		base--;
+	if (base > path)
+		slash = base - 1;
+
+	/* A sweep doesn't have these */
+	if (*base == '\0' || strcmp(base, ".") == 0 || strcmp(base, "..") == 0)
+		return (B_FALSE);
+
+	if (slash == NULL)
+		dr = fs_dir(".", 1);
+	else if (slash == path)
+		dr = fs_dir("/", 1);
+	else
+		dr = fs_dir(path, (size_t)(slash - path));
+
+	if (dr->dr_state == DR_NEW && ++dr->dr_lookups > FS_SWEEP_AFTER)
+		fs_sweep(dr);
+	if (dr->dr_state != DR_SWEPT)
+		return (B_FALSE);
+
+	key.de_name = (char *)base;
+	if (dr->dr_nents > 0) {
+		de = bsearch(&key, dr->dr_ents, dr->dr_nents,
+		    sizeof (fs_dent_t), fs_dent_cmp);
+	}
+	if (de != NULL)
+		*fs = de->de_stat;
+	else
+		(void) memset(fs, 0, sizeof (*fs));
+	return (B_TRUE);
+}
+
+/* Get the status of the file path (an atom of the path) */
+void
+filestat_get(atom_t path, filestat_t *fs)
+{
+	const char *name = atom_name(path);
+	fs_ent_t *fe = NULL;
+	struct stat sb;
+
+	(void) pthread_mutex_lock(&fs_lock);
+
+	fe = fs_ent(path);
+	if (fe->fe_state == FE_CACHED) {
+		*fs = fe->fe_stat;
+		(void) pthread_mutex_unlock(&fs_lock);
+		return;
+	}
+
+	/* Once a file is rebuilt, the sweep of its directory is out of date */
+	if (fe->fe_state == FE_STALE ||
+	    !fs_dir_lookup(name, atom_len(path), &fe->fe_stat)) {
+		(void) memset(&fe->fe_stat, 0, sizeof (fe->fe_stat));
+		if (stat(name, &sb) == 0)
+			fs_fill(&fe->fe_stat, &sb);
+	}
+
+	fe->fe_state = FE_CACHED;
+	*fs = fe->fe_stat;
+	(void) pthread_mutex_unlock(&fs_lock);
+}
+
+/* make has (re)built path, so it must be looked at again */
+void
+filestat_invalidate(atom_t path)
+{
+	(void) pthread_mutex_lock(&fs_lock);
+	fs_ent(path)->fe_state = FE_STALE;
+	(void) pthread_mutex_unlock(&fs_lock);
+}
+
+/* Forget everything */
+void
+filestat_reset(void)
+{
+	(void) pthread_mutex_lock(&fs_lock);
+
+	for (size_t i = 0; i < fs_dirbuckets; i++) {
+		fs_dir_t *dr = fs_dirs[i];
+
+		while (dr != NULL) {
+			fs_dir_t *next = dr->dr_next;
+
+			for (size_t j = 0; j < dr->dr_nents; j++)
+				strfree(dr->dr_ents[j].de_name);
+			cfree(dr->dr_ents, dr->dr_alloc, sizeof (fs_dent_t));
+			umem_free(dr->dr_path, dr->dr_len + 1);
+			umem_free(dr, sizeof (*dr));
+			dr = next;
+		}
+	}
+	cfree(fs_dirs, fs_dirbuckets, sizeof (fs_dir_t *));
+	fs_dirs = NULL;
+	fs_ndirs = fs_dirbuckets = 0;
+
+	cfree(fs_ents, fs_entalloc, sizeof (fs_ent_t));
+	fs_ents = NULL;
+	fs_entalloc = 0;
+
+	(void) pthread_mutex_unlock(&fs_lock);
+}
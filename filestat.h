@@ -0,0 +1,42 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2018 Jason King
+ */
+
+
+#ifndef _FILESTAT_H
+#define	_FILESTAT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "atom.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct filestat {
+	boolean_t	fs_exists;
+	mode_t		fs_mode;
+	int64_t		fs_mtime;	/* nanoseconds since the epoch */
+} filestat_t;
+
+void	filestat_get(atom_t, filestat_t *);
+void	filestat_invalidate(atom_t);
+void	filestat_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FILESTAT_H */
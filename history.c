@@ -0,0 +1,265 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2018 Jason King
+ */
+
+
+/*
+ * The build history: how long (wall time, in nanoseconds) the recipes of
+ * each target took the last few times it was built, kept in a file from
+ * one run to the next so the scheduler can start the longest chains of
+ * work first.
+ *
+ * The file is text, so it is portable and can be inspected or edited:
+ *
+ *	MKHISTORY 1
+ *	<nanoseconds> <target>
+ *	...
+ *
+ * A file with a different header is ignored, as are lines that can't be
+ * parsed.  Each new time is averaged with the recorded one, so one
+ * unusually fast or slow build doesn't throw the estimate off entirely.
+ * Targets are kept even when a run doesn't build them, so building a
+ * different goal doesn't forget the others.
+ *
+ * Times are indexed by the atom of the target name.  A history is only
+ * used from one thread at a time.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/debug.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <umem.h>
+#include <unistd.h>
+
+#include "atom.h"
+#include "history.h"
+#include "util.h"
+
+#define	HISTORY_MAGIC	"MKHISTORY 1"
+#define	HISTORY_MIN	64U
+
+#ifndef MAX
+#define	MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+struct history {
+	uint64_t	*h_ns;		/* indexed by atom_t, 0 if unknown */
+	size_t		h_alloc;
+	size_t		h_n;		/* # of known times */
+	uint64_t	h_total;	/* sum of the known times */
+};
+
+static void
+history_set(history_t *h, atom_t name, uint64_t ns)
+{
+	VERIFY3U(name, !=, ATOM_NONE);
+
+	if (name >= h->h_alloc) {
+		size_t newn = MAX(h->h_alloc, HISTORY_MIN);
+
+		while (newn <= name)
+			newn *= 2;
+
+		h->h_ns = xrealloc(h->h_ns, h->h_alloc * sizeof (uint64_t),
+		    newn * sizeof (uint64_t));
+		h->h_alloc = newn;
+	}
+
+	if (h->h_ns[name] != 0) {
+		h->h_n--;
+		h->h_total -= h->h_ns[name];
+	}
+	if (ns != 0) {
+		h->h_n++;
+		h->h_total += ns;
+	}
+	h->h_ns[name] = ns;
+}
+
+/* Parse "<nanoseconds> <target>" */
+static boolean_t
+history_parse(history_t *h, char *line, size_t len)
+{
+	char *end = NULL;
+	uint64_t ns;
+
+	if (len > 0 && line[len - 1] == '\n')
+		line[--len] = '\0';
+
+	errno = 0;
+	ns = strtoull(line, &end, 10);
+	if (errno != 0 || end == line || ns == 0 || *end != ' ' ||
+	    end[1] == '\0')
+		return (B_FALSE);
+
+	end++;
+	history_set(h, atom_intern(end, len - (size_t)(end - line)), ns);
+	return (B_TRUE);
+}
+
+/*
+ * Load the history at path.  A missing or unusable file just gives an
+ * empty history, so this never returns NULL.
+ */
+history_t *
+history_load(const char *path)
+{
+	history_t *h = zalloc(sizeof (*h));
+	char *line = NULL;
+	size_t linesz = 0;
+	ssize_t len;
+	FILE *f = NULL;
+
+	if ((f = fopen(path, "rF")) == NULL) {
+		if (errno != ENOENT)
+			warn("%s", path);
+		return (h);
+	}
+
+	len = getline(&line, &linesz, f);
+	if (len != sizeof (HISTORY_MAGIC) ||
+	    strcmp(line, HISTORY_MAGIC "\n") != 0)
+		goto done;
+
+	while ((len = getline(&line, &linesz, f)) > 0)
+		(void) history_parse(h, line, (size_t)len);
+
+	if (ferror(f))
+		warn("%s", path);
+
+done:
+	free(line);
+	(void) fclose(f);
+	return (h);
+}
+
+/*
+ * Write h to path.  As with pcache_save(), it's written to a temporary
+ * file that is renamed into place, so an interrupted write never leaves a
+ * truncated history behind.
+ */
+boolean_t
+history_save(const history_t *h, const char *path)
+{
+	char *tmp = xprintf("%s.XXXXXX", path);
+	FILE *f = NULL;
+	mode_t mask;
+	int fd = -1;
+	boolean_t ok = B_FALSE;
+
+	if ((fd = mkstemp(tmp)) == -1) {
+		warn(_("Unable to create %s"), tmp);
+		goto done;
+	}
+
+	/* mkstemp() creates the file 0600, but the history is shared */
+	mask = umask(0);
+	(void) umask(mask);
+	if (fchmod(fd, 0666 & ~mask) == -1) {
+		warn("%s", tmp);
+		goto done;
+	}
+
+	if ((f = fdopen(fd, "w")) == NULL) {
+		warn(_("Unable to create %s"), tmp);
+		goto done;
+	}
+	fd = -1;
+
+	if (fprintf(f, "%s\n", HISTORY_MAGIC) < 0)
+		goto werr;
+
+	for (size_t i = 0; i < h->h_alloc; i++) {
+		if (h->h_ns[i] == 0)
+			continue;
+		if (fprintf(f, "%" PRIu64 " %s\n", h->h_ns[i],
+		    atom_name((atom_t)i)) < 0)
+			goto werr;
+	}
+
+	if (fclose(f) != 0) {
+		f = NULL;
+		goto werr;
+	}
+	f = NULL;
+
+	if (rename(tmp, path) == -1) {
+		warn(_("Unable to rename %s to %s"), tmp, path);
+		goto done;
+	}
+
+	ok = B_TRUE;
+	goto done;
+
+werr:
+	warn(_("Error writing %s"), tmp);
+
+done:
+	if (f != NULL)
+		(void) fclose(f);
+	if (fd != -1)
+		(void) close(fd);
+	if (!ok)
+		(void) unlink(tmp);
+	strfree(tmp);
+	return (ok);
+}
+
+void
+history_free(history_t *h)
+{
+	if (h == NULL)
+		return;
+
+	cfree(h->h_ns, h->h_alloc, sizeof (uint64_t));
+	umem_free(h, sizeof (*h));
+}
+
+/* How long name took to build, or 0 if it's not known */
+uint64_t
+history_get(const history_t *h, atom_t name)
+{
+	if (h == NULL || name >= h->h_alloc)
+		return (0);
+	return (h->h_ns[name]);
+}
+
+/* name just took ns to build */
+void
+history_record(history_t *h, atom_t name, uint64_t ns)
+{
+	uint64_t old = history_get(h, name);
+
+	if (old != 0)
+		ns = old / 2 + ns / 2;
+
+	/* 0 means unknown, so anything that fast rounds up */
+	history_set(h, name, MAX(ns, 1));
+}
+
+/* The mean of the known times, or 0 if there are none */
+uint64_t
+history_mean(const history_t *h)
+{
+	if (h == NULL || h->h_n == 0)
+		return (0);
+	return (h->h_total / h->h_n);
+}
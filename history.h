@@ -0,0 +1,41 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2018 Jason King
+ */
+
+
+#ifndef _HISTORY_H
+#define	_HISTORY_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "atom.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct history history_t;
+
+history_t	*history_load(const char *);
+boolean_t	history_save(const history_t *, const char *);
+void		history_free(history_t *);
+uint64_t	history_get(const history_t *, atom_t);
+void		history_record(history_t *, atom_t, uint64_t);
+uint64_t	history_mean(const history_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _HISTORY_H */
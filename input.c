@@ -15,11 +15,14 @@
 
 #include <err.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/avl.h>
 #include <sys/debug.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/queue.h>
@@ -28,6 +31,7 @@
 
 #include "input.h"
 #include "custr.h"
+#include "token.h"
 #include "util.h"
 
 /*
@@ -36,27 +40,66 @@
  * the contents, one could do:
  *	for (ptr = in->in_buf; ptr < in->in_bufend; ptr++) { ... }
  *
- * In addition, we keep pointers to the start of each line (in_line[linenum])
- * to facilitate either iteration by line, or for determining the position
- * of an offset into the file in terms of lines and columns.  We also store
- * the location of in_bufend in in_line[in_numlines] so consumers can obtain
- * the full range.
+ * In addition, we keep the offset of the start of each line
+ * (in_index.li_offsets[linenum]) to facilitate either iteration by line, or
+ * for determining the position of an offset into the file in terms of lines
+ * and columns.  We also store the offset of in_bufend in
+ * in_index.li_offsets[in_numlines] so consumers can obtain the full range.
+ *
+ * The contents are either mapped directly from the file (regular files), or
+ * read into an allocated buffer (pipes, ttys, etc).  in_backing records
+ * which, so the buffer can be released properly.  In either case, the
+ * contents are NOT guaranteed to be NUL terminated, so consumers must always
+ * use in_bufend (or the line offsets) to bound any scanning.
+ *
+ * Inputs loaded from regular files are also entered into input_cache, keyed
+ * by the device and inode of the file.  A subsequent input_new() of the same
+ * file (e.g. a common file included by many makefiles) returns the existing
+ * input_t (along with any token stream already produced for it) as long as
+ * the size and modification time of the file are unchanged.  Inputs are
+ * reference counted, and the cache holds a reference of its own on every
+ * input in it, so a cached input stays loaded after its last user calls
+ * input_free().  The cache's reference is dropped when the file is found to
+ * have changed, or when the cache is emptied with input_cache_reset().
  */
 
+typedef enum input_backing {
+	IB_HEAP,		/* in_buf was allocated, in_bufalloc bytes */
+	IB_MMAP,		/* in_buf is mapped, in_bufalloc bytes */
+} input_backing_t;
+
+struct line_index {
+	size_t	*li_offsets;
+	size_t	li_alloc;
+};
+
 LIST_HEAD(input_list, input);
 struct input {
 	LIST_ENTRY(input) in_link;
 	char		*in_filename;
 	const char	*in_buf;
 	const char	*in_bufend;	/* address just past end of buf */
-	size_t		in_bufalloc;	/* Amount allocated */
-	const char	**in_line;
+	size_t		in_bufalloc;	/* Amount allocated or mapped */
+	input_backing_t	in_backing;
+	struct line_index in_index;
 	size_t		in_numlines;
+	struct tok_array *in_toks[MS_NSTYLES];	/* cached token streams */
+	uint_t		in_refcnt;
+	avl_node_t	in_avl;		/* in input_cache if in_cached */
+	boolean_t	in_cached;
+	boolean_t	in_hassig;	/* in_dev ... in_mtime are valid */
+	dev_t		in_dev;
+	ino_t		in_ino;
+	off_t		in_size;
+	timespec_t	in_mtime;
 };
 
 typedef struct iter_item {
 	input_t		*item_in;
 	size_t		item_line;
+	input_t		**item_next;	/* read after item_in, at this depth */
+	size_t		item_nnext;
+	size_t		item_inext;	/* next entry of item_next to read */
 } iter_item_t;
 
 struct input_iter {
@@ -68,58 +111,279 @@ struct input_iter {
 	custr_t		*ii_line;
 };
 
-struct line_index {
-	size_t	*li_offsets;
-	size_t	li_alloc;
-};
+#ifndef MAX
+#define	MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
 
 #define	INPUT_BLOCK_SIZE	2048U
 #define	LINEPTR_CHUNK		128U
 #define	ITER_DEFAULT_DEPTH	8U
 
 static struct input_list inputs = LIST_HEAD_INITIALIZER(input);
+static avl_tree_t input_cache;
+static boolean_t input_cache_init;
+
+/*
+ * Inputs may be loaded by the include prefetch threads at the same time the
+ * parser is loading others.  input_lock protects the list of inputs, the
+ * input cache, and the reference count and token streams of every input.
+ * Everything else in an input_t is immutable once the input is returned
+ * from input_new() (or friends).
+ */
+static pthread_mutex_t input_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static boolean_t input_read(input_t *, FILE *);
+static boolean_t input_map(input_t *, int, const struct stat *, boolean_t *);
+static void index_input(input_t *);
+static void input_destroy(input_t *);
+
+static int
+input_cache_cmp(const void *a, const void *b)
+{
+	const input_t *l = a;
+	const input_t *r = b;
+
+	if (l->in_dev < r->in_dev)
+		return (-1);
+	if (l->in_dev > r->in_dev)
+		return (1);
+	if (l->in_ino < r->in_ino)
+		return (-1);
+	if (l->in_ino > r->in_ino)
+		return (1);
+	return (0);
+}
+
+static avl_tree_t *
+input_cache_tree(void)
+{
+	if (!input_cache_init) {
+		avl_create(&input_cache, input_cache_cmp, sizeof (input_t),
+		    offsetof(input_t, in_avl));
+		input_cache_init = B_TRUE;
+	}
+	return (&input_cache);
+}
+
+/*
+ * Remove in from the cache, and drop the reference the cache holds on it.
+ * Must be called with input_lock held.
+ */
+static void
+input_cache_drop(input_t *in)
+{
+	VERIFY(in->in_cached);
+	VERIFY3U(in->in_refcnt, >, 0);
+
+	in->in_cached = B_FALSE;
+	if (--in->in_refcnt > 0)
+		return;
+
+	if (in->in_link.le_prev != NULL)
+		LIST_REMOVE(in, in_link);
+	input_destroy(in);
+}
+
+/*
+ * Look for an up to date, previously loaded copy of the file described by sb.
+ * If a copy exists, but the file has since changed, the stale copy is
+ * removed from the cache (existing references to it remain valid).
+ */
+static input_t *
+input_cache_lookup(const struct stat *sb)
+{
+	avl_tree_t *tree = input_cache_tree();
+	input_t key = { 0 };
+	input_t *in = NULL;
+
+	if (!S_ISREG(sb->st_mode))
+		return (NULL);
+
+	key.in_dev = sb->st_dev;
+	key.in_ino = sb->st_ino;
+	if ((in = avl_find(tree, &key, NULL)) == NULL)
+		return (NULL);
+
+	if (in->in_size == sb->st_size &&
+	    in->in_mtime.tv_sec == sb->st_mtim.tv_sec &&
+	    in->in_mtime.tv_nsec == sb->st_mtim.tv_nsec)
+		return (in);
+
+	avl_remove(tree, in);
+	input_cache_drop(in);
+	return (NULL);
+}
+
+static void
+input_cache_add(input_t *in, const struct stat *sb)
+{
+	if (!S_ISREG(sb->st_mode))
+		return;
+
+	in->in_dev = sb->st_dev;
+	in->in_ino = sb->st_ino;
+	in->in_size = sb->st_size;
+	in->in_mtime = sb->st_mtim;
+	in->in_hassig = B_TRUE;
+
+	avl_add(input_cache_tree(), in);
+	in->in_cached = B_TRUE;
+	in->in_refcnt++;
+}
+
+/*
+ * Add a newly loaded input to the list of inputs and the input cache.  If
+ * another thread loaded the same file in the meantime, in is discarded, and
+ * a hold on the copy already in the cache is returned instead.
+ */
+static input_t *
+input_publish(input_t *in, const struct stat *sb)
+{
+	input_t *cur = NULL;
+
+	(void) pthread_mutex_lock(&input_lock);
+	if ((cur = input_cache_lookup(sb)) != NULL) {
+		cur->in_refcnt++;
+		(void) pthread_mutex_unlock(&input_lock);
+		input_free(in);
+		return (cur);
+	}
+
+	input_cache_add(in, sb);
+	LIST_INSERT_HEAD(&inputs, in, in_link);
+	(void) pthread_mutex_unlock(&input_lock);
+	return (in);
+}
+
+/* Look for a cached copy of the file described by sb, and hold it */
+static input_t *
+input_cache_hold(const struct stat *sb)
+{
+	input_t *in = NULL;
+
+	(void) pthread_mutex_lock(&input_lock);
+	if ((in = input_cache_lookup(sb)) != NULL)
+		in->in_refcnt++;
+	(void) pthread_mutex_unlock(&input_lock);
+	return (in);
+}
+
+static input_t *
+input_alloc(const char *filename)
+{
+	input_t *in = zalloc(sizeof (input_t));
+
+	in->in_filename = xstrdup(filename);
+	in->in_refcnt = 1;
+	return (in);
+}
 
 input_t *
 input_new(const char *filename)
 {
 	FILE *f = NULL;
-	input_t *in = zalloc(sizeof (input_t));
+	input_t *in = NULL;
+	struct stat sb = { 0 };
+	int fd = -1;
+	boolean_t mapped = B_FALSE;
+
+	/*
+	 * If the file is unchanged since it was last loaded, we can
+	 * reuse what we have without any further I/O.
+	 */
+	if (stat(filename, &sb) == 0 && (in = input_cache_hold(&sb)) != NULL)
+		return (in);
 
-	if ((f = fopen(filename, "rF")) == NULL) {
+	in = input_alloc(filename);
+
+	if ((fd = open(filename, O_RDONLY)) == -1) {
 		warn(_("Unable to open %s"), filename);
 		goto fail;
 	}
 
-	in->in_filename = xstrdup(filename);
-	if (!input_read(in, f))
+	if (fstat(fd, &sb) == -1) {
+		warn("%s", filename);
 		goto fail;
+	}
 
-	(void) fclose(f);
+	if (!input_map(in, fd, &sb, &mapped))
+		goto fail;
 
-	LIST_INSERT_HEAD(&inputs, in, in_link);
-	return (in);
+	if (mapped) {
+		index_input(in);
+		(void) close(fd);
+	} else {
+		/* Not a regular file, fall back to reading it */
+		if ((f = fdopen(fd, "rF")) == NULL) {
+			warn(_("Unable to open %s"), filename);
+			goto fail;
+		}
+		fd = -1;
+
+		if (!input_read(in, f))
+			goto fail;
+
+		(void) fclose(f);
+	}
+
+	return (input_publish(in, &sb));
 
 fail:
 	if (f != NULL)
 		(void) fclose(f);
+	if (fd != -1)
+		(void) close(fd);
 
 	input_free(in);
 	return (NULL);
 }
 
+/*
+ * Since input_fnew() is used for stdin and pipes (which can only be
+ * read once), inputs created by it are never cached.
+ */
 input_t *
 input_fnew(const char *filename, FILE *f)
 {
-	input_t *in = zalloc(sizeof (input_t));
+	input_t *in = input_alloc(filename);
+	struct stat sb = { 0 };
+	boolean_t mapped = B_FALSE;
 
-	in->in_filename = xstrdup(filename);
-	if (!input_read(in, f)) {
-		input_free(in);
-		return (NULL);
+	if (fstat(fileno(f), &sb) == -1) {
+		warn("%s", filename);
+		goto fail;
 	}
 
+	/*
+	 * If f has already been read from (e.g. stdin that's been partially
+	 * consumed), the file contents no longer match what is left in the
+	 * stream, so only try to map f if it is still positioned at the start.
+	 */
+	if (ftello(f) == 0 && !input_map(in, fileno(f), &sb, &mapped))
+		goto fail;
+
+	if (mapped)
+		index_input(in);
+	else if (!input_read(in, f))
+		goto fail;
+
+	(void) pthread_mutex_lock(&input_lock);
 	LIST_INSERT_HEAD(&inputs, in, in_link);
+	(void) pthread_mutex_unlock(&input_lock);
+	return (in);
+
+fail:
+	input_free(in);
+	return (NULL);
+}
+
+input_t *
+input_hold(input_t *in)
+{
+	(void) pthread_mutex_lock(&input_lock);
+	VERIFY3U(in->in_refcnt, >, 0);
+	in->in_refcnt++;
+	(void) pthread_mutex_unlock(&input_lock);
 	return (in);
 }
 
@@ -129,12 +393,168 @@ input_free(input_t *in)
 	if (in == NULL)
 		return;
 
+	(void) pthread_mutex_lock(&input_lock);
+	VERIFY3U(in->in_refcnt, >, 0);
+	if (--in->in_refcnt > 0) {
+		(void) pthread_mutex_unlock(&input_lock);
+		return;
+	}
+
+	/* The cache's own reference keeps a cached input from getting here */
+	VERIFY(!in->in_cached);
+	if (in->in_link.le_prev != NULL)
+		LIST_REMOVE(in, in_link);
+	(void) pthread_mutex_unlock(&input_lock);
+
+	input_destroy(in);
+}
+
+/*
+ * Empty the input cache.  Inputs that are still held elsewhere remain valid,
+ * the rest are released.
+ */
+void
+input_cache_reset(void)
+{
+	input_t *in = NULL;
+	void *cookie = NULL;
+
+	(void) pthread_mutex_lock(&input_lock);
+	if (input_cache_init) {
+		while ((in = avl_destroy_nodes(&input_cache, &cookie)) != NULL)
+			input_cache_drop(in);
+		avl_destroy(&input_cache);
+		input_cache_init = B_FALSE;
+	}
+	(void) pthread_mutex_unlock(&input_lock);
+}
+
+/* Release everything in an input that is no longer in the list or cache */
+static void
+input_destroy(input_t *in)
+{
+	for (size_t i = 0; i < MS_NSTYLES; i++)
+		tok_array_free(in->in_toks[i]);
 	strfree(in->in_filename);
-	umem_free((void *)in->in_buf, in->in_bufalloc);
-	umem_free((void *)in->in_line, (in->in_numlines + 1) * sizeof (char *));
+
+	switch (in->in_backing) {
+	case IB_HEAP:
+		umem_free((void *)in->in_buf, in->in_bufalloc);
+		break;
+	case IB_MMAP:
+		VERIFY0(munmap((void *)in->in_buf, in->in_bufalloc));
+		break;
+	}
+
+	/* A line index from input_import() is not ours to free */
+	if (in->in_index.li_alloc > 0) {
+		cfree(in->in_index.li_offsets, in->in_index.li_alloc,
+		    sizeof (size_t));
+	}
 	umem_free(in, sizeof (*in));
 }
 
+static boolean_t
+sig_matches(const input_sig_t *sig, const struct stat *sb)
+{
+	if (!S_ISREG(sb->st_mode) ||
+	    sig->is_dev != (uint64_t)sb->st_dev ||
+	    sig->is_ino != (uint64_t)sb->st_ino ||
+	    sig->is_size != (uint64_t)sb->st_size ||
+	    sig->is_mtime_sec != (int64_t)sb->st_mtim.tv_sec ||
+	    sig->is_mtime_nsec != (int64_t)sb->st_mtim.tv_nsec)
+		return (B_FALSE);
+	return (B_TRUE);
+}
+
+/*
+ * Load filename using a line index saved from an earlier run (e.g. in the
+ * precompiled makefile cache) instead of indexing its contents.  If the
+ * file no longer matches sig, NULL is returned.  offsets (numlines + 1
+ * entries) is used in place, and so must remain valid for the life of the
+ * returned input.
+ */
+input_t *
+input_import(const char *filename, const input_sig_t *sig,
+    const size_t *offsets, size_t numlines)
+{
+	input_t *in = NULL;
+	struct stat sb = { 0 };
+	int fd = -1;
+	boolean_t mapped = B_FALSE;
+
+	if (stat(filename, &sb) == -1 || !sig_matches(sig, &sb))
+		return (NULL);
+
+	if (offsets[numlines] != (size_t)sb.st_size)
+		return (NULL);
+
+	if ((in = input_cache_hold(&sb)) != NULL)
+		return (in);
+
+	in = input_alloc(filename);
+
+	if ((fd = open(filename, O_RDONLY)) == -1 || fstat(fd, &sb) == -1 ||
+	    !sig_matches(sig, &sb) || !input_map(in, fd, &sb, &mapped))
+		goto fail;
+
+	/* Can't map it, let the caller do things the normal way */
+	if (!mapped && sb.st_size > 0)
+		goto fail;
+
+	(void) close(fd);
+
+	in->in_index.li_offsets = (size_t *)offsets;
+	in->in_index.li_alloc = 0;
+	in->in_numlines = numlines;
+
+	return (input_publish(in, &sb));
+
+fail:
+	if (fd != -1)
+		(void) close(fd);
+	input_free(in);
+	return (NULL);
+}
+
+/*
+ * If sb describes a non-empty regular file, map the contents of fd.
+ * *mappedp is set to B_TRUE if the file was mapped.  If fd refers to
+ * something that cannot be mapped (a pipe, tty, etc), *mappedp is
+ * set to B_FALSE and the caller should fall back to input_read().  Returns
+ * B_FALSE on error.
+ *
+ * The mapping is private and read-only, so like make(1) always has, we
+ * assume makefiles are not truncated by something else while they're being
+ * read.
+ */
+static boolean_t
+input_map(input_t *in, int fd, const struct stat *sb, boolean_t *mappedp)
+{
+	void *buf = NULL;
+	size_t len = 0;
+
+	*mappedp = B_FALSE;
+
+	if (!S_ISREG(sb->st_mode) || sb->st_size == 0)
+		return (B_TRUE);
+
+	len = (size_t)sb->st_size;
+	buf = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf == MAP_FAILED) {
+		/* Some filesystems can't be mapped, so just read those */
+		return (B_TRUE);
+	}
+
+	in->in_buf = buf;
+	in->in_bufalloc = len;
+	in->in_bufend = in->in_buf + len;
+	in->in_backing = IB_MMAP;
+
+	*mappedp = B_TRUE;
+	return (B_TRUE);
+}
+
 /*
  * If f is a regular file, use the rounded up file size as a hint for
  * the initial size of the buffer, otherwise use INPUT_BLOCK_SIZE.
@@ -155,7 +575,7 @@ guess_size(const char *name, FILE *f, size_t *lenp)
 		goto done;
 
 	/* Round up to multiple of INPUT_BLOCK_SIZE */
-	len = (sb.st_size + INPUT_BLOCK_SIZE - 1) / INPUT_BLOCK_SIZE;
+	len = (sb.st_size + INPUT_BLOCK_SIZE) / INPUT_BLOCK_SIZE;
 	len *= INPUT_BLOCK_SIZE;
 
 done:
@@ -163,36 +583,113 @@ done:
 	return (zalloc(len));
 }
 
+/*
+ * Line indexing is done in a single pass over the input.  Where available,
+ * we compare NL_BLOCK bytes at a time against '\n' and walk the resulting
+ * bitmask, otherwise (and for any trailing partial block) we fall back to
+ * memchr().  Since the input is not NUL terminated (and may contain embedded
+ * NULs), every search is bounded by the length of the input.
+ */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define	NL_BLOCK	32U
+
+static inline uint32_t
+nl_mask(const char *p)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i *)p);
+	__m256i nl = _mm256_set1_epi8('\n');
+
+	return ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl)));
+}
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define	NL_BLOCK	16U
+
+static inline uint32_t
+nl_mask(const char *p)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+	__m128i nl = _mm_set1_epi8('\n');
+
+	return ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+}
+#endif
+
 static void
-index_input(input_t *in)
+li_grow(struct line_index *li)
 {
-	const char *p = NULL;
-	size_t lines = 0;
+	size_t newalloc = 0;
 
-	if (in->in_buf == in->in_bufend)
-		return;
+	if (umul_overflow(li->li_alloc, 2, &newalloc))
+		assfail("Overflow", __FILE__, __LINE__);
+
+	li->li_offsets = xrealloc(li->li_offsets,
+	    li->li_alloc * sizeof (size_t), newalloc * sizeof (size_t));
+	li->li_alloc = newalloc;
+}
+
+static inline void
+li_add(struct line_index *li, size_t *np, size_t off)
+{
+	if (*np == li->li_alloc)
+		li_grow(li);
+	li->li_offsets[(*np)++] = off;
+}
 
-	p = in->in_buf;
-	while (p != NULL && p < in->in_bufend) {
-		lines++;
-		if ((p = strchr(p, '\n')) != NULL)
-			p++;
+static void
+index_input(input_t *in)
+{
+	struct line_index *li = &in->in_index;
+	const char *buf = in->in_buf;
+	size_t len = (size_t)(in->in_bufend - in->in_buf);
+	size_t i = 0, n = 0;
+
+	/*
+	 * Start with a guess of one line per 32 bytes of input.  li_add()
+	 * will grow the index if that guess is too small.
+	 */
+	li->li_alloc = MAX(len / 32, LINEPTR_CHUNK);
+	li->li_offsets = xcalloc(li->li_alloc, sizeof (size_t));
+
+	if (len > 0)
+		li_add(li, &n, 0);
+
+#ifdef NL_BLOCK
+	for (; i + NL_BLOCK <= len; i += NL_BLOCK) {
+		uint32_t mask = nl_mask(buf + i);
+
+		while (mask != 0) {
+			size_t nl = i + __builtin_ctz(mask);
+
+			mask &= mask - 1;
+			if (nl + 1 < len)
+				li_add(li, &n, nl + 1);
+		}
 	}
+#endif
+
+	while (i < len) {
+		const char *p = memchr(buf + i, '\n', len - i);
 
-	in->in_line = xcalloc(lines + 1, sizeof (char *));
-	in->in_numlines = lines;
+		if (p == NULL)
+			break;
 
-	p = in->in_buf;
-	lines = 0;
-	while (p != NULL && p < in->in_bufend) {
-		in->in_line[lines++] = p;
-		if ((p = strchr(p, '\n')) != NULL)
-			p++;
+		i = (size_t)(p - buf) + 1;
+		if (i < len)
+			li_add(li, &n, i);
 	}
 
-	in->in_line[lines] = in->in_bufend;
+	/* Terminate the index with the end of the input */
+	in->in_numlines = n;
+	li_add(li, &n, len);
 }
 
+/*
+ * Read the contents of a stream that cannot be mapped.  The buffer is
+ * grown geometrically so that reading large inputs from a pipe is
+ * not quadratic.
+ */
 static boolean_t
 input_read(input_t *in, FILE *f)
 {
@@ -205,7 +702,8 @@ input_read(input_t *in, FILE *f)
 
 	while (!feof(f) && !ferror(f)) {
 		if (total + 1 > buflen) {
-			amt = buflen + INPUT_BLOCK_SIZE;
+			if (umul_overflow(buflen, 2, &amt))
+				assfail("Overflow", __FILE__, __LINE__);
 			buf = xrealloc(buf, buflen, amt);
 			buflen = amt;
 		}
@@ -224,7 +722,9 @@ input_read(input_t *in, FILE *f)
 	in->in_buf = buf;
 	in->in_bufalloc = buflen;
 	in->in_bufend = in->in_buf + total;
+	in->in_backing = IB_HEAP;
 	index_input(in);
+	return (B_TRUE);
 }
 
 size_t
@@ -236,8 +736,8 @@ input_numlines(const input_t *in)
 const char *
 input_line(const input_t *in, size_t linenum)
 {
-	if (linenum <= in->in_numlines)
-		return (in->in_line[linenum]);
+	if (linenum <= in->in_numlines && in->in_buf != NULL)
+		return (in->in_buf + in->in_index.li_offsets[linenum]);
 	return (NULL);
 }
 
@@ -247,23 +747,126 @@ input_name(const input_t *in)
 	return (in->in_filename);
 }
 
+/*
+ * Return the path (which the caller must strfree()) of the file named by the
+ * len bytes at path on an include line of in.  A relative path is taken
+ * relative to the current directory, except in the BSD style, where it is
+ * looked for in the directory of in first.
+ */
+char *
+input_include_path(const input_t *in, make_style_t style, const char *path,
+    size_t len)
+{
+	const char *name = (in != NULL) ? in->in_filename : NULL;
+	const char *slash = NULL;
+	char *p = NULL;
+
+	if (style == MS_BSD && len > 0 && path[0] != '/' && name != NULL &&
+	    (slash = strrchr(name, '/')) != NULL) {
+		p = xprintf("%.*s/%.*s", (int)(slash - name), name, (int)len,
+		    path);
+		if (access(p, F_OK) == 0)
+			return (p);
+		strfree(p);
+	}
+
+	return (xprintf("%.*s", (int)len, path));
+}
+
+/* Return the token stream of in for style, or NULL if there isn't one yet */
+struct tok_array *
+input_tokens(const input_t *in, make_style_t style)
+{
+	struct tok_array *ta = NULL;
+
+	VERIFY3U(style, <, MS_NSTYLES);
+
+	(void) pthread_mutex_lock(&input_lock);
+	ta = in->in_toks[style];
+	(void) pthread_mutex_unlock(&input_lock);
+	return (ta);
+}
+
+/*
+ * Get the signature of the file in was loaded from.  Returns B_FALSE if
+ * in was not loaded from a regular file (e.g. it was read from a pipe).
+ */
+boolean_t
+input_sig(const input_t *in, input_sig_t *sig)
+{
+	if (!in->in_hassig)
+		return (B_FALSE);
+
+	sig->is_dev = (uint64_t)in->in_dev;
+	sig->is_ino = (uint64_t)in->in_ino;
+	sig->is_size = (uint64_t)in->in_size;
+	sig->is_mtime_sec = (int64_t)in->in_mtime.tv_sec;
+	sig->is_mtime_nsec = (int64_t)in->in_mtime.tv_nsec;
+	return (B_TRUE);
+}
+
+/*
+ * Return the line index of in (in_numlines + 1 offsets), and set
+ * *numlinesp to the number of lines.
+ */
+const size_t *
+input_offsets(const input_t *in, size_t *numlinesp)
+{
+	*numlinesp = in->in_numlines;
+	return (in->in_index.li_offsets);
+}
+
+/*
+ * Save ta as the token stream of in for style.  The input takes ownership
+ * of ta.  If in already has a token stream for style (i.e. another thread
+ * tokenized in at the same time), ta is released instead.  Returns the
+ * token stream of in for style.  A token stream is never replaced once it
+ * is saved, so it remains valid until in is released.
+ */
+struct tok_array *
+input_set_tokens(input_t *in, make_style_t style, struct tok_array *ta)
+{
+	struct tok_array *dup = NULL;
+
+	VERIFY3U(style, <, MS_NSTYLES);
+
+	(void) pthread_mutex_lock(&input_lock);
+	if (in->in_toks[style] != NULL) {
+		dup = ta;
+		ta = in->in_toks[style];
+	} else {
+		in->in_toks[style] = ta;
+	}
+	(void) pthread_mutex_unlock(&input_lock);
+
+	tok_array_free(dup);
+	return (ta);
+}
+
 boolean_t
 input_pos(const input_t *in, const char *p, size_t *lp, size_t *cp)
 {
-	size_t i, line = 0, col = 0;
+	const size_t *offsets = in->in_index.li_offsets;
+	size_t off, lo, hi, line = 0, col = 0;
 
 	if (p == NULL || p < in->in_buf || p >= in->in_bufend)
 		return (B_FALSE);
 
-	for (i = 0; i < in->in_numlines; i++) {
-		if (in->in_line[i + 1] < p)
-			continue;
-
-		line = i;
-		break;
+	/* Find the last line that starts at or before p */
+	off = (size_t)(p - in->in_buf);
+	lo = 0;
+	hi = in->in_numlines;
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (offsets[mid] <= off)
+			lo = mid;
+		else
+			hi = mid;
 	}
+	line = lo;
 
-	col = (size_t)(p - in->in_line[line]);
+	col = off - offsets[line];
 
 	if (lp != NULL)
 		*lp = line;
@@ -290,46 +893,48 @@ iter_new(input_t *in, iter_cb_t cb, void *arg)
 	return (iter);
 }
 
+static void
+iter_item_fini(iter_item_t *item)
+{
+	input_free(item->item_in);
+	for (size_t i = item->item_inext; i < item->item_nnext; i++)
+		input_free(item->item_next[i]);
+	cfree(item->item_next, item->item_nnext, sizeof (input_t *));
+}
+
 void
 iter_free(input_iter_t *iter)
 {
 	if (iter == NULL)
 		return;
 
+	while (iter->ii_n > 0)
+		iter_item_fini(&iter->ii_items[--iter->ii_n]);
+
+	custr_free(iter->ii_line);
 	umem_free(iter->ii_items, iter->ii_alloc * sizeof (iter_item_t));
 	umem_free(iter, sizeof (*iter));
 }
 
-const char *
-iter_line(input_iter_t *iter)
+/*
+ * Return the item at the top of the iterator stack, popping any exhausted
+ * inputs first.  Returns NULL once every input has been exhausted.
+ */
+static iter_item_t *
+iter_top(input_iter_t *iter)
 {
 	iter_item_t *item = NULL;
-	input_t *in = NULL;
-	const char *p = NULL;
-
-	custr_reset(iter->ii_line);
 
 	while (iter->ii_n > 0) {
 		item = &iter->ii_items[iter->ii_n - 1];
-		in = item->item_in;
 
 		/* End of file, pop and try again */
-		if ((p = input_line(in, item->item_line++)) == NULL) {
+		if (item->item_line >= item->item_in->in_numlines) {
 			iter_pop(iter);
 			continue;
 		}
 
-		/* Copy line into iter->ii_line and return */
-		const char *end = input_line(in, item->item_line);
-		if (end == NULL)
-			end = in->in_bufend;
-
-		while (p < end) {
-			VERIFY0(custr_appendc(iter->ii_line, *p));
-			p++;
-		}
-
-		return (custr_cstr(iter->ii_line));
+		return (item);
 	}
 
 	ASSERT3U(iter->ii_n, ==, 0);
@@ -340,11 +945,115 @@ iter_line(input_iter_t *iter)
 	return (NULL);
 }
 
+/*
+ * Return the next line from the iterator as a span into the buffer of the
+ * input_t it came from.  *lenp is set to the length of the line, including
+ * the trailing newline (if present).  Since the span is not NUL terminated,
+ * consumers must only use the first *lenp bytes.  The span remains valid for
+ * as long as the input_t does.
+ */
+const char *
+iter_span(input_iter_t *iter, size_t *lenp)
+{
+	iter_item_t *item = NULL;
+	const char *p = NULL;
+	const char *end = NULL;
+
+	if ((item = iter_top(iter)) == NULL) {
+		*lenp = 0;
+		return (NULL);
+	}
+
+	p = input_line(item->item_in, item->item_line++);
+	end = input_line(item->item_in, item->item_line);
+
+	*lenp = (size_t)(end - p);
+	return (p);
+}
+
+/*
+ * Return the start of the current line of the iterator without advancing
+ * it, and set *endp to the end of the input the line is in.  This is used by
+ * consumers that scan the remainder of an input directly (e.g. the
+ * tokenizer), and who then use iter_seek() to report how far they got.
+ */
+const char *
+iter_cursor(input_iter_t *iter, const char **endp)
+{
+	iter_item_t *item = NULL;
+
+	if ((item = iter_top(iter)) == NULL)
+		return (NULL);
+
+	*endp = item->item_in->in_bufend;
+	return (input_line(item->item_in, item->item_line));
+}
+
+/*
+ * Set the current line of the iterator to the line containing p, which must
+ * be in the input at the top of the iterator.  If p is the end of the input,
+ * the input is considered exhausted and will be popped by the next
+ * iter_span(), iter_line(), or iter_cursor().
+ */
+void
+iter_seek(input_iter_t *iter, const char *p)
+{
+	iter_item_t *item = NULL;
+	input_t *in = NULL;
+
+	VERIFY3U(iter->ii_n, >, 0);
+	item = &iter->ii_items[iter->ii_n - 1];
+	in = item->item_in;
+
+	VERIFY3P(p, >=, in->in_buf);
+	VERIFY3P(p, <=, in->in_bufend);
+
+	if (p == in->in_bufend) {
+		item->item_line = in->in_numlines;
+		return;
+	}
+
+	VERIFY(input_pos(in, p, &item->item_line, NULL));
+}
+
+/*
+ * Like iter_span(), but returns a NUL-terminated copy of the line.  The
+ * copy is only valid until the next call to iter_line().
+ */
+const char *
+iter_line(input_iter_t *iter)
+{
+	const char *p = NULL;
+	size_t len = 0;
+
+	custr_reset(iter->ii_line);
+
+	if ((p = iter_span(iter, &len)) != NULL) {
+		VERIFY0(custr_append_range(iter->ii_line, p, len));
+		return (custr_cstr(iter->ii_line));
+	}
+
+	return (NULL);
+}
+
 void
 iter_push(input_iter_t *iter, input_t *in)
+{
+	iter_push_all(iter, &in, 1);
+}
+
+/*
+ * Push ins[0], and queue the rest of ins to be read in turn after it (as
+ * if each was pushed once the one before it was popped).  This is used for
+ * an include line that names several files.
+ */
+void
+iter_push_all(input_iter_t *iter, input_t *const *ins, size_t n)
 {
 	iter_item_t *item = NULL;
 
+	VERIFY3U(n, >, 0);
+
 	if (iter->ii_n + 1 >= iter->ii_alloc) {
 		size_t oldlen = iter->ii_alloc * sizeof (iter_item_t);
 		size_t newlen = oldlen +
@@ -354,9 +1063,20 @@ iter_push(input_iter_t *iter, input_t *in)
 		iter->ii_alloc += ITER_DEFAULT_DEPTH;
 	}
 
+	/*
+	 * The iterator holds each input while it's on the stack, so the caller
+	 * may release theirs once it's pushed (e.g. an included file).
+	 */
 	item = &iter->ii_items[iter->ii_n++];
-	item->item_in = in;
-	item->item_line = 0;
+	(void) memset(item, 0, sizeof (*item));
+	item->item_in = input_hold(ins[0]);
+
+	if (n > 1) {
+		item->item_next = xcalloc(n - 1, sizeof (input_t *));
+		item->item_nnext = n - 1;
+		for (size_t i = 1; i < n; i++)
+			item->item_next[i - 1] = input_hold(ins[i]);
+	}
 
 	if (iter->ii_evtcb != NULL)
 		iter->ii_evtcb(iter, IEVT_PUSH, iter->ii_arg);
@@ -365,13 +1085,29 @@ iter_push(input_iter_t *iter, input_t *in)
 void
 iter_pop(input_iter_t *iter)
 {
-	input_t *in = NULL;
+	iter_item_t *item = NULL;
 
 	if (iter->ii_evtcb != NULL)
 		iter->ii_evtcb(iter, IEVT_POP, iter->ii_arg);
 
-	if (iter->ii_n > 0)
-		in = iter->ii_items[--iter->ii_n].item_in;
+	if (iter->ii_n == 0)
+		return;
+
+	item = &iter->ii_items[iter->ii_n - 1];
+	if (item->item_inext == item->item_nnext) {
+		iter_item_fini(item);
+		iter->ii_n--;
+		return;
+	}
+
+	/* Move on to the next input queued by iter_push_all() */
+	input_free(item->item_in);
+	item->item_in = item->item_next[item->item_inext];
+	item->item_next[item->item_inext++] = NULL;
+	item->item_line = 0;
+
+	if (iter->ii_evtcb != NULL)
+		iter->ii_evtcb(iter, IEVT_PUSH, iter->ii_arg);
 }
 
 input_t *
@@ -16,8 +16,10 @@
 #ifndef _INPUT_H
 #define	_INPUT_H
 
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/types.h>
+#include "make.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -25,16 +27,51 @@ extern "C" {
 
 struct input;
 struct input_iter;
+struct tok_array;
 typedef struct input input_t;
 typedef struct input_iter input_iter_t;
 
+/*
+ * The identity and version of the file an input_t was loaded from.  If
+ * the signature of a file is unchanged, its contents are assumed to be as
+ * well.
+ */
+typedef struct input_sig {
+	uint64_t	is_dev;
+	uint64_t	is_ino;
+	uint64_t	is_size;
+	int64_t		is_mtime_sec;
+	int64_t		is_mtime_nsec;
+} input_sig_t;
+
+/*
+ * A line of an input, e.g. where a macro or target was defined.  A
+ * bookmark does not hold bm_input; inputs that have been parsed are kept
+ * for the rest of the run.
+ */
+typedef struct bookmark {
+	input_t		*bm_input;
+	size_t		bm_line;
+} bookmark_t;
+
 input_t		*input_new(const char *);
 input_t		*input_fnew(const char *, FILE *);
+input_t		*input_import(const char *, const input_sig_t *, const size_t *,
+    size_t);
+input_t		*input_hold(input_t *);
 void		input_free(input_t *);
+void		input_cache_reset(void);
 size_t		input_numlines(const input_t *);
 const char	*input_line(const input_t *, size_t);
 const char	*input_name(const input_t *);
+char		*input_include_path(const input_t *, make_style_t, const char *,
+    size_t);
 boolean_t	input_pos(const input_t *, const char *, size_t *, size_t *);
+struct tok_array *input_tokens(const input_t *, make_style_t);
+struct tok_array *input_set_tokens(input_t *, make_style_t,
+    struct tok_array *);
+boolean_t	input_sig(const input_t *, input_sig_t *);
+const size_t	*input_offsets(const input_t *, size_t *);
 
 /*
  * Iteration of input_t lines, with optional stacking of inputs (for handling
@@ -54,7 +91,11 @@ typedef void (*iter_cb_t)(input_iter_t *, iter_event_t, void *);
 input_iter_t	*iter_new(input_t *, iter_cb_t, void *);
 void		iter_free(input_iter_t *);
 const char	*iter_line(input_iter_t *);
+const char	*iter_span(input_iter_t *, size_t *);
+const char	*iter_cursor(input_iter_t *, const char **);
+void		iter_seek(input_iter_t *, const char *);
 void		iter_push(input_iter_t *, input_t *);
+void		iter_push_all(input_iter_t *, input_t *const *, size_t);
 void		iter_pop(input_iter_t *);
 input_t		*iter_input(const input_iter_t *);
 size_t		iter_lineno(const input_iter_t *);
@@ -0,0 +1,682 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2018 Jason King
+ */
+
+/*
+ * The macro table.
+ *
+ * Macro lookups are the hottest path when expanding recipes, so the table
+ * is built to take as few cache misses as possible.  Macros are keyed by
+ * the atom of their name, and the table is open addressed with linear
+ * probing.  Each slot is just the atom of the name (which doubles as the
+ * inline hash -- equal atoms mean equal names, so no string is ever
+ * compared) and the index of the macro_t, so eight slots share a cache
+ * line and a lookup is normally one miss in the slots, plus one for the
+ * macro_t itself.
+ *
+ * The macro_t's live in a separate slab of fixed size chunks, indexed by
+ * the order in which the macros were defined.  Chunks are never moved, so
+ * pointers to a macro_t remain valid as the table grows, and macro_iter()
+ * visits macros in definition order.
+ *
+ * Lookups by string (macro_value()) first find the atom for the name with
+ * atom_find(), which doesn't create atoms for undefined names.  Callers
+ * that look up the same name repeatedly should keep the atom and use
+ * macro_get().
+ *
+ * Every change to a macro gives it a new generation number (macro_t.gen),
+ * which is how var.c knows when a saved expansion is stale.  A macro that
+ * is referenced before it is defined still needs a generation (defining it
+ * later changes the expansion), so macro_ref() creates an empty
+ * placeholder for it.  Placeholders have neither a value nor any
+ * conditional values, and are otherwise treated as undefined.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/debug.h>
+#include <sys/types.h>
+#include <umem.h>
+
+#include "atom.h"
+#include "macro.h"
+#include "util.h"
+#include "var.h"
+
+#define	MACRO_SLAB	256U		/* macro_t's per slab chunk */
+#define	MACRO_MINSLOTS	256U		/* must be a power of 2 */
+#define	MACRO_DIR_MIN	8U
+
+#ifndef MAX
+#define	MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+typedef struct macro_slot {
+	atom_t		ms_name;	/* ATOM_NONE if empty */
+	uint32_t	ms_idx;
+} macro_slot_t;
+
+/* An open addressed table from an atom to an index */
+typedef struct macro_table {
+	macro_slot_t	*mt_slots;
+	size_t		mt_nslots;
+	size_t		mt_n;		/* # of entries */
+	uint_t		mt_shift;	/* 32 - log2(mt_nslots) */
+} macro_table_t;
+
+#define	MACRO_TABLE_NONE	UINT32_MAX
+
+static macro_table_t macro_tab;		/* name -> index in the slab */
+
+static macro_t **macro_slab;		/* chunk directory */
+static size_t macro_slaballoc;		/* # of entries in macro_slab */
+static size_t macro_n;			/* # of macros */
+static uint64_t macro_gen;		/* last generation handed out */
+static uint32_t macro_cond_seq;		/* last cond_macro_t.seq */
+
+static inline macro_t *
+macro_at(size_t idx)
+{
+	return (&macro_slab[idx / MACRO_SLAB][idx % MACRO_SLAB]);
+}
+
+/*
+ * Fibonacci hashing: atoms are allocated sequentially, so the multiply
+ * spreads them across the table, and the top bits are the best mixed.
+ */
+static inline size_t
+macro_hash(atom_t name, uint_t shift)
+{
+	return ((size_t)((name * 2654435769U) >> shift));
+}
+
+static void
+macro_slot_insert(macro_slot_t *slots, size_t nslots, uint_t shift,
+    atom_t name, uint32_t idx)
+{
+	size_t mask = nslots - 1;
+	size_t i = macro_hash(name, shift);
+
+	while (slots[i].ms_name != ATOM_NONE)
+		i = (i + 1) & mask;
+
+	slots[i].ms_name = name;
+	slots[i].ms_idx = idx;
+}
+
+/* Keep the table at most half full, so probe sequences stay short */
+static void
+macro_table_grow(macro_table_t *mt)
+{
+	macro_slot_t *slots = NULL;
+	size_t nslots;
+	uint_t shift;
+
+	if ((mt->mt_n + 1) * 2 <= mt->mt_nslots)
+		return;
+
+	if (mt->mt_nslots == 0) {
+		nslots = MACRO_MINSLOTS;
+		shift = 32;
+		for (size_t n = nslots; n > 1; n >>= 1)
+			shift--;
+	} else {
+		nslots = mt->mt_nslots * 2;
+		shift = mt->mt_shift - 1;
+	}
+
+	slots = xcalloc(nslots, sizeof (macro_slot_t));
+	for (size_t i = 0; i < mt->mt_nslots; i++) {
+		if (mt->mt_slots[i].ms_name != ATOM_NONE) {
+			macro_slot_insert(slots, nslots, shift,
+			    mt->mt_slots[i].ms_name, mt->mt_slots[i].ms_idx);
+		}
+	}
+
+	cfree(mt->mt_slots, mt->mt_nslots, sizeof (macro_slot_t));
+	mt->mt_slots = slots;
+	mt->mt_nslots = nslots;
+	mt->mt_shift = shift;
+}
+
+static void
+macro_table_add(macro_table_t *mt, atom_t name, uint32_t idx)
+{
+	macro_table_grow(mt);
+	macro_slot_insert(mt->mt_slots, mt->mt_nslots, mt->mt_shift, name,
+	    idx);
+	mt->mt_n++;
+}
+
+/* Returns MACRO_TABLE_NONE if name isn't in mt */
+static uint32_t
+macro_table_find(const macro_table_t *mt, atom_t name)
+{
+	size_t mask = mt->mt_nslots - 1;
+
+	if (mt->mt_nslots == 0 || name == ATOM_NONE)
+		return (MACRO_TABLE_NONE);
+
+	for (size_t i = macro_hash(name, mt->mt_shift);
+	    mt->mt_slots[i].ms_name != ATOM_NONE; i = (i + 1) & mask) {
+		if (mt->mt_slots[i].ms_name == name)
+			return (mt->mt_slots[i].ms_idx);
+	}
+
+	return (MACRO_TABLE_NONE);
+}
+
+static void
+macro_table_reset(macro_table_t *mt)
+{
+	cfree(mt->mt_slots, mt->mt_nslots, sizeof (macro_slot_t));
+	(void) memset(mt, 0, sizeof (*mt));
+}
+
+static macro_t *
+macro_alloc(atom_t name)
+{
+	macro_t *m = NULL;
+	size_t chunk = macro_n / MACRO_SLAB;
+
+	VERIFY3U(macro_n, <, UINT32_MAX);
+
+	if (chunk == macro_slaballoc) {
+		size_t newn = MAX(macro_slaballoc * 2, MACRO_DIR_MIN);
+
+		macro_slab = xrealloc(macro_slab,
+		    macro_slaballoc * sizeof (macro_t *),
+		    newn * sizeof (macro_t *));
+		macro_slaballoc = newn;
+	}
+	if (macro_n % MACRO_SLAB == 0)
+		macro_slab[chunk] = xcalloc(MACRO_SLAB, sizeof (macro_t));
+
+	m = macro_at(macro_n);
+	m->name = name;
+	m->gen = ++macro_gen;
+	macro_table_add(&macro_tab, name, (uint32_t)macro_n);
+	macro_n++;
+	return (m);
+}
+
+/*
+ * Return the macro called name, or NULL if it has never been defined
+ * (either globally or conditionally).
+ */
+macro_t *
+macro_get(atom_t name)
+{
+	uint32_t idx = macro_table_find(&macro_tab, name);
+
+	return ((idx != MACRO_TABLE_NONE) ? macro_at(idx) : NULL);
+}
+
+/*
+ * Return the macro called name, creating a placeholder if it has never
+ * been defined.  The result is never NULL, and remains valid (as the same
+ * macro) for the life of the process.
+ */
+macro_t *
+macro_ref(atom_t name)
+{
+	macro_t *m = macro_get(name);
+
+	VERIFY3U(name, !=, ATOM_NONE);
+	return ((m != NULL) ? m : macro_alloc(name));
+}
+
+static macro_t *
+macro_lookup_add(const char *name)
+{
+	return (macro_ref(atom_intern_str(name)));
+}
+
+/*
+ * Appended values.
+ *
+ * Lists like OBJS are often built up by thousands of += lines, so joining
+ * each one onto the value (copying the whole value every time) would be
+ * quadratic.  Instead, appended values are kept on a list of chunks
+ * (macro_t.app), and are only joined (with a space) onto the value when
+ * something needs it as a single string (see macro_val()).
+ */
+struct macro_chunk {
+	struct macro_chunk	*mc_next;
+	char			*mc_val;
+	size_t			mc_len;
+};
+
+static void
+macro_chunks_free(macro_t *m)
+{
+	macro_chunk_t *mc = m->app;
+
+	while (mc != NULL) {
+		macro_chunk_t *next = mc->mc_next;
+
+		strfree(mc->mc_val);
+		umem_free(mc, sizeof (*mc));
+		mc = next;
+	}
+
+	m->app = m->app_tail = NULL;
+	m->applen = 0;
+}
+
+/* Join the appended values of m onto its value */
+static void
+macro_flatten(macro_t *m)
+{
+	macro_chunk_t *mc = NULL;
+	size_t len = strlen(m->val);
+	size_t size;
+	char *val = NULL;
+	char *p = NULL;
+
+	if (m->app == NULL)
+		return;
+
+	/*
+	 * m->applen counts a space before every chunk, which the first one
+	 * doesn't get if the value is empty.  The result is sized exactly, so
+	 * it can later be freed with strfree().
+	 */
+	size = len + m->applen + 1;
+	if (len == 0)
+		size--;
+
+	p = val = zalloc(size);
+	(void) memcpy(p, m->val, len);
+	p += len;
+
+	for (mc = m->app; mc != NULL; mc = mc->mc_next) {
+		if (p > val)
+			*p++ = ' ';
+		(void) memcpy(p, mc->mc_val, mc->mc_len);
+		p += mc->mc_len;
+	}
+	*p = '\0';
+	VERIFY3U(p - val, ==, size - 1);
+
+	strfree(m->val);
+	m->val = val;
+	macro_chunks_free(m);
+}
+
+/*
+ * Return the value of m as a single string, or NULL if m has no (global)
+ * value.  The value is owned by m.
+ */
+const char *
+macro_val(macro_t *m)
+{
+	if (m->val != NULL)
+		macro_flatten(m);
+	return (m->val);
+}
+
+/* The value of m has changed, so anything derived from it is stale */
+static void
+macro_changed(macro_t *m)
+{
+	var_prog_free(m->prog);
+	m->prog = NULL;
+	var_memo_free(m->memo);
+	m->memo = NULL;
+	m->gen = ++macro_gen;
+}
+
+/* name = val */
+void
+macro_assign(const char *name, const char *val, bookmark_t where)
+{
+	macro_t *m = macro_lookup_add(name);
+
+	macro_chunks_free(m);
+	strfree(m->val);
+	m->val = xstrdup(val);
+	m->where = where;
+	macro_changed(m);
+}
+
+/* name += val */
+void
+macro_append(const char *name, const char *val, bookmark_t where)
+{
+	macro_t *m = macro_lookup_add(name);
+	macro_chunk_t *mc = NULL;
+
+	m->where = where;
+	macro_changed(m);
+
+	if (m->val == NULL) {
+		m->val = xstrdup(val);
+		return;
+	}
+	if (val[0] == '\0')
+		return;
+
+	mc = zalloc(sizeof (*mc));
+	mc->mc_val = xstrdup(val);
+	mc->mc_len = strlen(val);
+
+	if (m->app_tail != NULL)
+		m->app_tail->mc_next = mc;
+	else
+		m->app = mc;
+	m->app_tail = mc;
+	m->applen += mc->mc_len + 1;
+}
+
+/*
+ * The conditional index.
+ *
+ * Conditional values hang off the macro they set, so finding the ones that
+ * apply to a target would otherwise mean walking every conditional value
+ * of every macro that is expanded, which is slow when a macro like CFLAGS
+ * has hundreds of them.  Instead, the first time the conditional values of
+ * a target are needed (normally once parsing is done), those of every
+ * macro are indexed by target.  The environment of a target (macro_env_t)
+ * is an array of its overrides sorted by macro, and then in the order they
+ * were defined, so the overrides of a macro are found with a binary
+ * search.
+ *
+ * A target that is a pattern (e.g. %.o := CFLAGS += -g) can't be indexed
+ * ahead of time, so those overrides are kept on a list, and are merged
+ * into the environment of each target they match the first time it is
+ * looked up.  Adding a conditional value discards the whole index, and it
+ * is rebuilt on the next lookup.
+ */
+struct macro_env {
+	atom_t			me_target;
+	macro_override_t	*me_ovr;
+	size_t			me_n;
+	size_t			me_alloc;
+	boolean_t		me_ready;	/* patterns merged and sorted */
+};
+
+static macro_table_t menv_tab;		/* target -> index in menv_envs */
+static macro_env_t **menv_envs;
+static size_t menv_n;
+static size_t menv_alloc;
+static macro_override_t *menv_pats;	/* overrides of pattern targets */
+static size_t menv_npats;
+static size_t menv_patalloc;
+static boolean_t menv_valid;
+
+static void
+macro_ovr_add(macro_override_t **ovrp, size_t *np, size_t *allocp,
+    macro_t *m, cond_macro_t *cm)
+{
+	if (*np == *allocp) {
+		size_t newn = (*allocp == 0) ? 4 : *allocp * 2;
+
+		*ovrp = xrealloc(*ovrp, *allocp * sizeof (macro_override_t),
+		    newn * sizeof (macro_override_t));
+		*allocp = newn;
+	}
+
+	(*ovrp)[*np].mo_macro = m;
+	(*ovrp)[*np].mo_cond = cm;
+	(*np)++;
+}
+
+static int
+macro_ovr_cmp(const void *a, const void *b)
+{
+	const macro_override_t *l = a;
+	const macro_override_t *r = b;
+
+	if ((uintptr_t)l->mo_macro < (uintptr_t)r->mo_macro)
+		return (-1);
+	if ((uintptr_t)l->mo_macro > (uintptr_t)r->mo_macro)
+		return (1);
+	if (l->mo_cond->seq < r->mo_cond->seq)
+		return (-1);
+	if (l->mo_cond->seq > r->mo_cond->seq)
+		return (1);
+	return (0);
+}
+
+static macro_env_t *
+macro_env_lookup_add(atom_t target)
+{
+	uint32_t idx = macro_table_find(&menv_tab, target);
+	macro_env_t *env = NULL;
+
+	if (idx != MACRO_TABLE_NONE)
+		return (menv_envs[idx]);
+
+	if (menv_n == menv_alloc) {
+		size_t newn = (menv_alloc == 0) ? 64 : menv_alloc * 2;
+
+		menv_envs = xrealloc(menv_envs,
+		    menv_alloc * sizeof (macro_env_t *),
+		    newn * sizeof (macro_env_t *));
+		menv_alloc = newn;
+	}
+
+	env = zalloc(sizeof (*env));
+	env->me_target = target;
+	menv_envs[menv_n] = env;
+	macro_table_add(&menv_tab, target, (uint32_t)menv_n);
+	menv_n++;
+	return (env);
+}
+
+static void
+macro_env_discard(void)
+{
+	if (!menv_valid)
+		return;
+
+	for (size_t i = 0; i < menv_n; i++) {
+		macro_env_t *env = menv_envs[i];
+
+		cfree(env->me_ovr, env->me_alloc, sizeof (macro_override_t));
+		umem_free(env, sizeof (*env));
+	}
+	cfree(menv_envs, menv_alloc, sizeof (macro_env_t *));
+	cfree(menv_pats, menv_patalloc, sizeof (macro_override_t));
+	macro_table_reset(&menv_tab);
+
+	menv_envs = NULL;
+	menv_n = menv_alloc = 0;
+	menv_pats = NULL;
+	menv_npats = menv_patalloc = 0;
+	menv_valid = B_FALSE;
+}
+
+static void
+macro_env_build(void)
+{
+	for (size_t i = 0; i < macro_n; i++) {
+		macro_t *m = macro_at(i);
+
+		for (cond_macro_t *cm = m->cond; cm != NULL; cm = cm->next) {
+			macro_env_t *env = NULL;
+
+			if (strchr(atom_name(cm->target), '%') != NULL) {
+				macro_ovr_add(&menv_pats, &menv_npats,
+				    &menv_patalloc, m, cm);
+				continue;
+			}
+
+			env = macro_env_lookup_add(cm->target);
+			macro_ovr_add(&env->me_ovr, &env->me_n,
+			    &env->me_alloc, m, cm);
+		}
+	}
+	menv_valid = B_TRUE;
+}
+
+/* Does name match pat, which contains a '%' that matches any stem? */
+static boolean_t
+macro_pattern_match(atom_t pat, atom_t name)
+{
+	const char *p = atom_name(pat);
+	const char *pct = strchr(p, '%');
+	const char *s = atom_name(name);
+	size_t plen = atom_len(pat);
+	size_t slen = atom_len(name);
+	size_t pre = (size_t)(pct - p);
+	size_t suf = plen - pre - 1;
+
+	if (slen < pre + suf)
+		return (B_FALSE);
+	if (memcmp(s, p, pre) != 0 || memcmp(s + slen - suf, pct + 1, suf) != 0)
+		return (B_FALSE);
+	return (B_TRUE);
+}
+
+/*
+ * Return the conditional values that apply to target, or NULL if there are
+ * none.  The result is valid until the next conditional value is defined.
+ */
+const macro_env_t *
+macro_env(atom_t target)
+{
+	uint32_t idx;
+	macro_env_t *env = NULL;
+
+	if (!menv_valid)
+		macro_env_build();
+
+	if ((idx = macro_table_find(&menv_tab, target)) != MACRO_TABLE_NONE)
+		env = menv_envs[idx];
+	else if (menv_npats > 0)
+		env = macro_env_lookup_add(target);
+	else
+		return (NULL);
+
+	if (env->me_ready)
+		return ((env->me_n > 0) ? env : NULL);
+
+	for (size_t i = 0; i < menv_npats; i++) {
+		macro_override_t *mo = &menv_pats[i];
+
+		if (macro_pattern_match(mo->mo_cond->target, target)) {
+			macro_ovr_add(&env->me_ovr, &env->me_n,
+			    &env->me_alloc, mo->mo_macro, mo->mo_cond);
+		}
+	}
+	if (env->me_n > 1) {
+		qsort(env->me_ovr, env->me_n, sizeof (macro_override_t),
+		    macro_ovr_cmp);
+	}
+	env->me_ready = B_TRUE;
+
+	return ((env->me_n > 0) ? env : NULL);
+}
+
+/*
+ * Return the overrides of m in env, in the order they were defined, and
+ * set *np to how many there are.
+ */
+const macro_override_t *
+macro_env_find(const macro_env_t *env, const macro_t *m, size_t *np)
+{
+	size_t lo = 0, hi, end;
+
+	*np = 0;
+	if (env == NULL)
+		return (NULL);
+
+	/* Find the first override of m */
+	hi = env->me_n;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if ((uintptr_t)env->me_ovr[mid].mo_macro < (uintptr_t)m)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (end = lo; end < env->me_n && env->me_ovr[end].mo_macro == m;
+	    end++)
+		;
+
+	*np = end - lo;
+	return ((*np > 0) ? &env->me_ovr[lo] : NULL);
+}
+
+static void
+macro_cond_add(const char *target, const char *name, const char *val,
+    bookmark_t where, boolean_t assign)
+{
+	macro_t *m = macro_lookup_add(name);
+	cond_macro_t *cm = zalloc(sizeof (*cm));
+	cond_macro_t **cmp = NULL;
+
+	cm->target = atom_intern_str(target);
+	cm->val = xstrdup(val);
+	cm->where = where;
+	cm->assign = assign;
+	cm->seq = ++macro_cond_seq;
+
+	/* Keep them in the order they're defined, so they apply in order */
+	for (cmp = &m->cond; *cmp != NULL; cmp = &(*cmp)->next)
+		;
+	*cmp = cm;
+	macro_changed(m);
+	macro_env_discard();
+}
+
+/* target := name = val */
+void
+macro_cond_assign(const char *target, const char *name, const char *val,
+    bookmark_t where)
+{
+	macro_cond_add(target, name, val, where, B_TRUE);
+}
+
+/* target := name += val */
+void
+macro_cond_append(const char *target, const char *name, const char *val,
+    bookmark_t where)
+{
+	macro_cond_add(target, name, val, where, B_FALSE);
+}
+
+/*
+ * Return the global value of name, or NULL if it has not been assigned a
+ * value.  The value is owned by the macro table.
+ */
+char *
+macro_value(const char *name)
+{
+	macro_t *m = macro_get(atom_find(name, strlen(name)));
+
+	return ((m != NULL) ? (char *)macro_val(m) : NULL);
+}
+
+/*
+ * Call cb for each macro in the order they were first defined, until cb
+ * returns B_FALSE.  Placeholders (see macro_ref()) are skipped.
+ */
+void
+macro_iter(boolean_t (*cb)(macro_t *, void *), void *arg)
+{
+	for (size_t i = 0; i < macro_n; i++) {
+		macro_t *m = macro_at(i);
+
+		if (m->val == NULL && m->cond == NULL)
+			continue;
+		if (!cb(m, arg))
+			return;
+	}
+}
@@ -16,7 +16,10 @@
 #ifndef _MACRO_H
 #define	_MACRO_H
 
+#include <stdint.h>
 #include <sys/types.h>
+#include "atom.h"
+#include "input.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -24,26 +27,51 @@ extern "C" {
 
 typedef struct cond_macro {
 	struct cond_macro *next;
-	char *target;
+	atom_t target;
 	char *val;
+	struct var_prog *prog;	/* val, compiled (see var.c) */
 	bookmark_t where;
 	boolean_t assign;
+	uint32_t seq;		/* order of definition */
 } cond_macro_t;
 
+struct var_prog;
+struct var_memo;
+typedef struct macro_chunk macro_chunk_t;
+
 typedef struct macro {
-	char *name;
-	char *val;
+	atom_t name;
+	char *val;		/* use macro_val() */
+	macro_chunk_t *app;	/* appended to val (see macro.c) */
+	macro_chunk_t *app_tail;
+	size_t applen;
+	struct var_prog *prog;	/* val, compiled (see var.c) */
 	cond_macro_t *cond;
-	bookmark_t where;	
+	bookmark_t where;
+	uint64_t gen;		/* bumped on every change */
+	struct var_memo *memo;	/* saved expansions (see var.c) */
 } macro_t;
 
+/* A conditional value of a macro that applies to a given target */
+typedef struct macro_override {
+	macro_t *mo_macro;
+	cond_macro_t *mo_cond;
+} macro_override_t;
+
+typedef struct macro_env macro_env_t;
+
 void macro_assign(const char *, const char *, bookmark_t);
 void macro_append(const char *, const char *, bookmark_t);
 void macro_cond_assign(const char *, const char *, const char *, bookmark_t);
 void macro_cond_append(const char *, const char *, const char *, bookmark_t);
 char *macro_value(const char *);
+const char *macro_val(macro_t *);
+macro_t *macro_get(atom_t);
+macro_t *macro_ref(atom_t);
 void macro_iter(boolean_t (*)(macro_t *, void *), void *);
-
+const macro_env_t *macro_env(atom_t);
+const macro_override_t *macro_env_find(const macro_env_t *, const macro_t *,
+    size_t *);
 
 #ifdef __cplusplus
 }
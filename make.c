@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/debug.h>
 #include <umem.h>
 
@@ -9,6 +10,9 @@
 #include "input.h"
 #include "make.h"
 #include "parse.h"
+#include "pcache.h"
+#include "prefetch.h"
+#include "target.h"
 #include "token.h"
 #include "util.h"
 
@@ -45,34 +49,105 @@ nofail_cb(void)
 }
 #endif
 
-void tok_parse(make_t *mk, input_t *);
+static void
+dump_tokens(make_t *mk, input_t *in)
+{
+	tokenizer_t *tk = NULL;
+	token_t t = { 0 };
+
+	if ((mk->mk_debug_flags & MDF_TOKEN) == 0)
+		return;
+
+	tk = tokenizer_new(mk, in, NULL, NULL);
+	while (tok_next(tk, &t))
+		tok_print(&t, mk->mk_debug);
+	tokenizer_free(tk);
+}
 
 int
 main(int argc, char **argv)
 {
 	input_t *in = NULL;
+	input_t **ins = NULL;
+	target_graph_t *tg = NULL;
+	uint32_t *order = NULL;
+	const char *image = NULL;
+	size_t nins = 0;
+	long ncpu;
+	int c;
 	make_t mk = {
 		.mk_debug = stderr,
-		.mk_debug_flags = MDF_PARSE,
+		.mk_debug_flags = MDF_PARSE | MDF_TOKEN,
 		.mk_style = MS_SYSV,
 	};
 
 	umem_nofail_callback(nofail_cb);
 
-	if (argc < 2) {
+	while ((c = getopt(argc, argv, "P:")) != -1) {
+		switch (c) {
+		case 'P':
+			image = optarg;
+			break;
+		default:
+			(void) fprintf(stderr,
+			    _("Usage: %s [-P image] [makefile...]\n"), argv[0]);
+			return (2);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1) {
 		in = input_fnew("(stdin)", stdin);
 		parse_input(&mk, in);
 		input_free(in);
 	}
 
-	for (size_t i = 1; i < argc; i++) {
-		in = input_new(argv[i]);
+	/*
+	 * With -P, the makefiles are loaded from the precompiled image if it
+	 * is current.  Any that aren't in it are loaded as usual, and the
+	 * image is (re)written afterwards for next time.
+	 */
+	if (image != NULL)
+		(void) pcache_load(image);
+
+	/*
+	 * Start loading every makefile (and anything they include) in the
+	 * background while the first is parsed.
+	 */
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (argc > 0 && ncpu > 1 && prefetch_init(&mk, (uint_t)ncpu)) {
+		for (size_t i = 0; i < argc; i++)
+			prefetch(argv[i]);
+	}
+
+	ins = xcalloc(argc + 1, sizeof (input_t *));
+	for (size_t i = 0; i < argc; i++) {
+		if ((in = prefetch_input(argv[i])) == NULL)
+			continue;
 
 		parse_input(&mk, in);
-		printf("-------\n");
-		tokenize(&mk, in);
-		input_free(in);
+		(void) fprintf(mk.mk_debug, "-------\n");
+		dump_tokens(&mk, in);
+		ins[nins++] = in;
 	}
 
+	if (image != NULL)
+		(void) pcache_save(image, ins, nins);
+	prefetch_fini();
+
+	/* Parsing is done, so the graph can't change from here on */
+	tg = target_graph_freeze();
+	order = xcalloc(tg->tg_n + 1, sizeof (uint32_t));
+	if (!target_graph_order(tg, order))
+		warnx(_("The dependency graph contains a cycle"));
+	cfree(order, tg->tg_n + 1, sizeof (uint32_t));
+	target_graph_free(tg);
+
+	for (size_t i = 0; i < nins; i++)
+		input_free(ins[i]);
+	cfree(ins, argc + 1, sizeof (input_t *));
+	input_cache_reset();
+
 	return (0);
 }
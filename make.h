@@ -25,17 +25,30 @@ extern "C" {
 /* The maximum amount variables can nest, e.g. $($($(...))) */
 #define	VAR_NEST_MAX	16U
 
+/*
+ * The supported styles of make.  This is an X-macro so that code which
+ * needs a separate instance of something for each style (e.g. the tokenizer)
+ * can generate them from this list.  Each style is a distinct value, NOT a
+ * bit flag.
+ */
+#define	MAKE_STYLES(X)		\
+	X(MS_ILLUMOS, illumos)	\
+	X(MS_SYSV, sysv)	\
+	X(MS_POSIX, posix)	\
+	X(MS_BSD, bsd)		\
+	X(MS_GNU, gnu)
+
+#define	MAKE_STYLE_ENUM(style, name)	style,
 typedef enum make_style {
-	MS_ILLUMOS,
-	MS_SYSV,
-	MS_POSIX,
-	MS_BSD,
-	MS_GNU
+	MAKE_STYLES(MAKE_STYLE_ENUM)
+	MS_NSTYLES
 } make_style_t;
+#undef MAKE_STYLE_ENUM
 
 typedef enum make_debug_flags {
 	MDF_NONE	= 0,
 	MDF_PARSE	= (1U << 1),
+	MDF_TOKEN	= (1U << 2),
 } make_debug_flags_t;
 
 typedef struct make {
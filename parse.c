@@ -22,6 +22,7 @@
 #include "input.h"
 #include "make.h"
 #include "parse.h"
+#include "token.h"
 #include "util.h"
 #include "var.h"
 
@@ -81,57 +82,74 @@ iter_cb(input_iter_t *iter, iter_event_t evt, void *arg)
  *	line1 \
  *	line2
  * Would return as one logical line "line 1 \\\nline2"
+ *
+ * The logical line is returned as a span of *lenp bytes (not including the
+ * trailing newline), and is NOT NUL terminated.  When the logical line
+ * is a single physical line (by far the most common case), the span points
+ * directly into the input buffer.  Only when a line is continued is it
+ * assembled into line, in which case the span points into line.
  */
 
+/* Does s end with an unescaped backslash? */
 static boolean_t
-get_logical_line(make_t *mk, input_iter_t *iter, custr_t *line)
+ends_escaped(const char *s, size_t len)
 {
-	const char *s = NULL;
-	size_t slen = 0;
-	boolean_t litnext = B_FALSE;
-	char c;
+	size_t nbs = 0;
 
-	custr_reset(line);
+	for (; len > 0 && s[len - 1] == '\\'; len--)
+		nbs++;
+
+	return ((nbs & 1) ? B_TRUE : B_FALSE);
+}
+
+static const char *
+get_logical_line(make_t *mk, input_iter_t *iter, custr_t *line, size_t *lenp)
+{
+	const char *s = NULL;
+	size_t slen = 0, len = 0;
 
-again:
-	s = iter_line(iter);
-	if (s == NULL)
-		return (B_FALSE);
+	if ((s = iter_span(iter, &slen)) == NULL)
+		return (NULL);
 
-	slen = strlen(s);
+	len = (slen > 0 && s[slen - 1] == '\n') ? slen - 1 : slen;
+	if (!ends_escaped(s, len)) {
+		*lenp = len;
+		return (s);
+	}
 
-	for (; *s != '\0'; s++) {
-		c = *s;
+	/*
+	 * The line is continued.  Since the input is already indexed by line,
+	 * we know where each physical line ends, so each one is appended
+	 * as a single run -- in its entirety (including the escaped newline)
+	 * if it is continued, or without its newline if it ends the logical
+	 * line.
+	 */
+	custr_reset(line);
+	for (;;) {
+		/* The last line of the input cannot be continued */
+		if (len == slen)
+			goto eof;
 
-		if (litnext) {
-			VERIFY0(custr_appendc(line, c));
-			litnext = B_FALSE;
+		VERIFY0(custr_append_range(line, s, slen));
 
-			if (c == '\n')
-				goto again;
-			continue;
-		}
+		if ((s = iter_span(iter, &slen)) == NULL)
+			goto eof;
 
-		switch (c) {
-		case '\n':
-			goto done;
-		case '\\':
-			litnext = B_TRUE;
+		len = (slen > 0 && s[slen - 1] == '\n') ? slen - 1 : slen;
+		if (!ends_escaped(s, len))
 			break;
-		}
-
-		VERIFY0(custr_appendc(line, c));
 	}
 
-done:
-	if (litnext) {
-		/* XXX: Make this nicer */
-		(void) fprintf(stderr,
-		    "File cannot end with continuation character\n");
-		return (B_FALSE);
-	}
+	VERIFY0(custr_append_range(line, s, len));
 
-	return (B_TRUE);
+	*lenp = custr_len(line);
+	return (custr_cstr(line));
+
+eof:
+	/* XXX: Make this nicer */
+	(void) fprintf(stderr,
+	    "File cannot end with continuation character\n");
+	return (NULL);
 }
 
 boolean_t
@@ -144,16 +162,22 @@ parse_input(make_t *mk, input_t *in_start)
 	size_t len = 0;
 	size_t linenum = 0;
 	boolean_t recipe = B_FALSE;
+	tok_incl_t incl = { .tl_mk = mk };
 
 	VERIFY0(custr_alloc(&line, cu_memops));
 
 	iter = iter_new(in_start, iter_cb, mk);
-	while (get_logical_line(mk, iter, line)) {
-		s = custr_cstr(line);
-		len = custr_len(line);
+	while ((s = get_logical_line(mk, iter, line, &len)) != NULL) {
+		pdbg(mk, "'%.*s'\n", (int)len, s);
 
-		pdbg(mk, "'%s'\n", s);
+		/* The iterator is already past the line, so just push */
+		if (tok_include_line(mk, iter_input(iter), s, len,
+		    tok_incl_add, &incl))
+			tok_incl_push(&incl, iter);
 	}
 
+	tok_incl_fini(&incl);
+	iter_free(iter);
+	custr_free(line);
 	return (B_TRUE);
 }
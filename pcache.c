@@ -0,0 +1,425 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2018 Jason King
+ */
+
+/*
+ * The precompiled makefile cache.
+ *
+ * Loading a large tree of makefiles spends much of its time reading and
+ * indexing the same unchanged files on every run.  pcache_save() writes
+ * the line index of a set of inputs, along with the signature (device,
+ * inode, size and mtime) of the file each came from, to a single image.
+ * pcache_load() maps the image, and if the signature of every file still
+ * matches, imports the saved line indexes in place (no copying or
+ * scanning) and adds the inputs to the input cache.  A later input_new()
+ * of any of those files is then satisfied by the cache with nothing more
+ * than a stat() and a map of the file.  If any file has changed (or the
+ * image is from a different version), the image is ignored in its
+ * entirety.  When a run reads a file that did not come from the image,
+ * pcache_save() rewrites the image to include it, so an image that loads
+ * is not assumed to cover every makefile named on later command lines.
+ *
+ * Token streams are not saved.  The parser works from the lines of an
+ * input rather than its tokens, so saved tokens would never be read, and
+ * producing them just to save them would cost a full tokenize() of every
+ * makefile on the run that writes the image.
+ *
+ * The image is in native byte order and layout, and is only meant to be
+ * reused on the same machine.  It looks like:
+ *
+ *	pc_header_t
+ *	pc_input_t	[ph_ninputs]
+ *	data		name and line offsets of each input
+ *
+ * Everything in the data section is aligned to PC_ALIGN, and every offset
+ * is checked before it is used, so a truncated or corrupt image is
+ * rejected instead of being trusted.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/debug.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <umem.h>
+#include <unistd.h>
+
+#include "input.h"
+#include "pcache.h"
+#include "util.h"
+
+#define	PC_MAGIC	"MKPCACHE"
+#define	PC_VERSION	1
+#define	PC_ALIGN	8
+#define	PC_ROUNDUP(x)	(((x) + PC_ALIGN - 1) & ~((uint64_t)PC_ALIGN - 1))
+
+#ifndef MAX
+#define	MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+typedef struct pc_header {
+	char		ph_magic[8];
+	uint32_t	ph_version;
+	uint32_t	ph_sizet;	/* sizeof (size_t) */
+	uint64_t	ph_size;	/* size of the image */
+	uint64_t	ph_ninputs;
+} pc_header_t;
+
+typedef struct pc_input {
+	input_sig_t	pi_sig;
+	uint64_t	pi_name;	/* offset of NUL terminated name */
+	uint64_t	pi_namelen;	/* not including the NUL */
+	uint64_t	pi_lines;	/* offset of pi_numlines + 1 offsets */
+	uint64_t	pi_numlines;
+} pc_input_t;
+
+/*
+ * Once inputs are imported from an image, they refer to it directly, so
+ * an image (and the hold on its inputs) is kept until exit.
+ */
+static input_t **pc_inputs;
+static size_t pc_ninputs;
+
+/* Is the range [off, off + len) within an image of size bytes? */
+static boolean_t
+pc_inrange(uint64_t off, uint64_t len, uint64_t size)
+{
+	return (off <= size && len <= size - off);
+}
+
+static boolean_t
+pc_check_input(const pc_input_t *pi, const char *base, uint64_t size)
+{
+	const size_t *offsets = NULL;
+	size_t nlines;
+
+	if (pi->pi_name % PC_ALIGN != 0 || pi->pi_lines % PC_ALIGN != 0)
+		return (B_FALSE);
+
+	if (!pc_inrange(pi->pi_name, pi->pi_namelen + 1, size) ||
+	    base[pi->pi_name + pi->pi_namelen] != '\0')
+		return (B_FALSE);
+
+	if (pi->pi_numlines >= size / sizeof (size_t) ||
+	    !pc_inrange(pi->pi_lines, (pi->pi_numlines + 1) * sizeof (size_t),
+	    size))
+		return (B_FALSE);
+
+	/* The offsets must be ascending for input_pos() to work */
+	nlines = (size_t)pi->pi_numlines;
+	offsets = (const size_t *)(base + pi->pi_lines);
+	if (offsets[0] != 0)
+		return (B_FALSE);
+	for (size_t i = 0; i < nlines; i++) {
+		if (offsets[i] > offsets[i + 1])
+			return (B_FALSE);
+	}
+
+	return (B_TRUE);
+}
+
+/*
+ * Check that every file in the image is unchanged, before anything is
+ * imported.
+ */
+static boolean_t
+pc_check_sigs(const pc_input_t *pi, size_t n, const char *base)
+{
+	for (size_t i = 0; i < n; i++) {
+		const input_sig_t *sig = &pi[i].pi_sig;
+		struct stat sb = { 0 };
+
+		if (stat(base + pi[i].pi_name, &sb) == -1 ||
+		    sig->is_dev != (uint64_t)sb.st_dev ||
+		    sig->is_ino != (uint64_t)sb.st_ino ||
+		    sig->is_size != (uint64_t)sb.st_size ||
+		    sig->is_mtime_sec != (int64_t)sb.st_mtim.tv_sec ||
+		    sig->is_mtime_nsec != (int64_t)sb.st_mtim.tv_nsec)
+			return (B_FALSE);
+	}
+	return (B_TRUE);
+}
+
+/*
+ * Load the image at path, and add the inputs in it to the input cache.
+ * Returns B_FALSE if the image doesn't exist, is not valid, or is out of
+ * date, in which case nothing is loaded.
+ */
+boolean_t
+pcache_load(const char *path)
+{
+	struct stat sb = { 0 };
+	const pc_header_t *ph = NULL;
+	const pc_input_t *pi = NULL;
+	const char *base = NULL;
+	input_t **ins = NULL;
+	void *addr = MAP_FAILED;
+	uint64_t size;
+	size_t n = 0;
+	int fd = -1;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		if (errno != ENOENT)
+			warn("%s", path);
+		return (B_FALSE);
+	}
+
+	if (fstat(fd, &sb) == -1) {
+		warn("%s", path);
+		goto fail;
+	}
+
+	if (!S_ISREG(sb.st_mode) || (size_t)sb.st_size < sizeof (*ph))
+		goto fail;
+
+	size = (uint64_t)sb.st_size;
+	addr = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED) {
+		warn("%s", path);
+		goto fail;
+	}
+	(void) close(fd);
+	fd = -1;
+
+	base = addr;
+	ph = addr;
+	pi = (const pc_input_t *)(ph + 1);
+
+	if (memcmp(ph->ph_magic, PC_MAGIC, sizeof (ph->ph_magic)) != 0 ||
+	    ph->ph_version != PC_VERSION ||
+	    ph->ph_sizet != sizeof (size_t) ||
+	    ph->ph_size != size ||
+	    ph->ph_ninputs > size / sizeof (pc_input_t) ||
+	    !pc_inrange(sizeof (*ph), ph->ph_ninputs * sizeof (pc_input_t),
+	    size))
+		goto fail;
+
+	n = (size_t)ph->ph_ninputs;
+	for (size_t i = 0; i < n; i++) {
+		if (!pc_check_input(&pi[i], base, size))
+			goto fail;
+	}
+
+	if (!pc_check_sigs(pi, n, base))
+		goto fail;
+
+	ins = xcalloc(MAX(n, 1), sizeof (input_t *));
+	for (size_t i = 0; i < n; i++) {
+		const size_t *offsets =
+		    (const size_t *)(base + pi[i].pi_lines);
+
+		/*
+		 * If a file changed since pc_check_sigs(), just skip it; it
+		 * will be read the normal way when it is needed.
+		 */
+		ins[i] = input_import(base + pi[i].pi_name, &pi[i].pi_sig,
+		    offsets, (size_t)pi[i].pi_numlines);
+	}
+
+	pc_inputs = ins;
+	pc_ninputs = n;
+	return (B_TRUE);
+
+fail:
+	if (addr != MAP_FAILED)
+		(void) munmap(addr, (size_t)size);
+	if (fd != -1)
+		(void) close(fd);
+	return (B_FALSE);
+}
+
+static boolean_t
+pc_write(FILE *f, const void *buf, size_t len, uint64_t *offp)
+{
+	static const char zero[PC_ALIGN];
+	uint64_t pad = PC_ROUNDUP(len) - len;
+
+	if (len > 0 && fwrite(buf, len, 1, f) != 1)
+		return (B_FALSE);
+	if (pad > 0 && fwrite(zero, (size_t)pad, 1, f) != 1)
+		return (B_FALSE);
+
+	*offp += len + pad;
+	return (B_TRUE);
+}
+
+/* Was in imported from the image loaded by pcache_load()? */
+static boolean_t
+pc_loaded(const input_t *in)
+{
+	for (size_t i = 0; i < pc_ninputs; i++) {
+		if (pc_inputs[i] == in)
+			return (B_TRUE);
+	}
+	return (B_FALSE);
+}
+
+/*
+ * Add in to the nsave inputs (and their entries) being laid out in save and
+ * pi, unless it is already there, or was not loaded from a regular file (so
+ * cannot be validated later).
+ */
+static size_t
+pc_layout(input_t *in, input_t **save, pc_input_t *pi, size_t nsave)
+{
+	pc_input_t *p = &pi[nsave];
+	size_t numlines;
+
+	for (size_t i = 0; i < nsave; i++) {
+		if (save[i] == in)
+			return (nsave);
+	}
+
+	if (!input_sig(in, &p->pi_sig))
+		return (nsave);
+	(void) input_offsets(in, &numlines);
+
+	p->pi_namelen = strlen(input_name(in));
+	p->pi_numlines = numlines;
+	save[nsave++] = in;
+	return (nsave);
+}
+
+/*
+ * Write the line indexes of the n inputs in ins to the image at path.  If
+ * every one of them came from the image that pcache_load() loaded, the
+ * image is already current and is left alone.  Otherwise the inputs of the
+ * loaded image (if any) are written along with ins, so files used by other
+ * runs are kept.  Inputs that were not loaded from a regular file are left
+ * out.  The image is written to a temporary file first and renamed into
+ * place, so a concurrent pcache_load() never sees a partially written
+ * image.
+ */
+boolean_t
+pcache_save(const char *path, input_t *const *ins, size_t n)
+{
+	pc_header_t ph = { 0 };
+	pc_input_t *pi = NULL;
+	input_t **save = NULL;
+	char *tmp = NULL;
+	FILE *f = NULL;
+	uint64_t off = 0;
+	size_t nmax = n + pc_ninputs;
+	size_t nsave = 0;
+	mode_t mask;
+	int fd = -1;
+	boolean_t ok = B_FALSE;
+
+	for (nsave = 0; nsave < n; nsave++) {
+		if (!pc_loaded(ins[nsave]))
+			break;
+	}
+	if (pc_inputs != NULL && nsave == n)
+		return (B_TRUE);
+
+	pi = xcalloc(MAX(nmax, 1), sizeof (*pi));
+	save = xcalloc(MAX(nmax, 1), sizeof (input_t *));
+
+	/* Lay out the image */
+	off = PC_ROUNDUP(sizeof (ph));
+	nsave = 0;
+	for (size_t i = 0; i < n; i++)
+		nsave = pc_layout(ins[i], save, pi, nsave);
+	for (size_t i = 0; i < pc_ninputs; i++) {
+		if (pc_inputs[i] != NULL)
+			nsave = pc_layout(pc_inputs[i], save, pi, nsave);
+	}
+
+	off += PC_ROUNDUP(nsave * sizeof (pc_input_t));
+	for (size_t i = 0; i < nsave; i++) {
+		pi[i].pi_name = off;
+		off += PC_ROUNDUP(pi[i].pi_namelen + 1);
+		pi[i].pi_lines = off;
+		off += PC_ROUNDUP((pi[i].pi_numlines + 1) * sizeof (size_t));
+	}
+
+	(void) memcpy(ph.ph_magic, PC_MAGIC, sizeof (ph.ph_magic));
+	ph.ph_version = PC_VERSION;
+	ph.ph_sizet = sizeof (size_t);
+	ph.ph_size = off;
+	ph.ph_ninputs = nsave;
+
+	tmp = xprintf("%s.XXXXXX", path);
+	if ((fd = mkstemp(tmp)) == -1) {
+		warn(_("Unable to create %s"), tmp);
+		goto done;
+	}
+
+	/* mkstemp() creates the file 0600, but anyone may use the image */
+	mask = umask(0);
+	(void) umask(mask);
+	if (fchmod(fd, 0666 & ~mask) == -1) {
+		warn("%s", tmp);
+		goto done;
+	}
+	if ((f = fdopen(fd, "w")) == NULL) {
+		warn(_("Unable to create %s"), tmp);
+		goto done;
+	}
+	fd = -1;
+
+	off = 0;
+	if (!pc_write(f, &ph, sizeof (ph), &off) ||
+	    !pc_write(f, pi, nsave * sizeof (pc_input_t), &off))
+		goto werr;
+
+	for (size_t i = 0; i < nsave; i++) {
+		const size_t *offsets = NULL;
+		size_t numlines;
+
+		offsets = input_offsets(save[i], &numlines);
+
+		VERIFY3U(off, ==, pi[i].pi_name);
+		if (!pc_write(f, input_name(save[i]), pi[i].pi_namelen + 1,
+		    &off) ||
+		    !pc_write(f, offsets, (numlines + 1) * sizeof (size_t),
+		    &off))
+			goto werr;
+	}
+
+	if (fclose(f) != 0) {
+		f = NULL;
+		goto werr;
+	}
+	f = NULL;
+
+	if (rename(tmp, path) == -1) {
+		warn(_("Unable to rename %s to %s"), tmp, path);
+		goto done;
+	}
+
+	ok = B_TRUE;
+	goto done;
+
+werr:
+	warn(_("Error writing %s"), tmp);
+
+done:
+	if (f != NULL)
+		(void) fclose(f);
+	if (fd != -1)
+		(void) close(fd);
+	if (!ok && tmp != NULL)
+		(void) unlink(tmp);
+	strfree(tmp);
+	cfree(save, MAX(nmax, 1), sizeof (input_t *));
+	cfree(pi, MAX(nmax, 1), sizeof (*pi));
+	return (ok);
+}
@@ -0,0 +1,34 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2018 Jason King
+ */
+
+#ifndef _PCACHE_H
+#define	_PCACHE_H
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct input;
+
+boolean_t	pcache_load(const char *);
+boolean_t	pcache_save(const char *, struct input *const *, size_t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _PCACHE_H */
@@ -0,0 +1,292 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2018 Jason King
+ */
+
+/*
+ * Include prefetching.
+ *
+ * The parser reads a tree of makefiles strictly in order: a file is only
+ * loaded once the include line naming it is reached.  When the makefiles are
+ * on a slow (e.g. NFS) filesystem, most of that time is spent waiting on I/O.
+ * To hide it, a small pool of threads loads included files ahead of the
+ * parser.
+ *
+ * prefetch() queues a path to be loaded.  A worker takes it off the queue,
+ * loads it with input_new(), and then looks through it (with
+ * tok_includes(), which skips everything but include lines) for includes
+ * of a literal path (one without any macro references), and prefetches
+ * those in turn.  The workers don't tokenize or parse anything.  Paths are
+ * resolved with tok_include_path(), the same as when the parser and
+ * tokenizer reach the include line (see tok_incl_add()), which prefetch
+ * the path too in case no worker has seen it yet.  They then take the file
+ * with prefetch_input(), which returns the already loaded input_t (waiting
+ * for the worker if it is still loading it).
+ *
+ * Prefetching is purely an optimization.  A path that fails to load is
+ * simply loaded again by prefetch_input() so the usual error is reported,
+ * and a path that was never prefetched is loaded on demand.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/avl.h>
+#include <sys/debug.h>
+#include <sys/queue.h>
+#include <sys/types.h>
+#include <umem.h>
+#include <unistd.h>
+
+#include "input.h"
+#include "make.h"
+#include "prefetch.h"
+#include "token.h"
+#include "util.h"
+
+typedef enum pf_state {
+	PF_QUEUED,
+	PF_LOADING,
+	PF_DONE,
+} pf_state_t;
+
+typedef struct pf_entry {
+	avl_node_t		pf_avl;		/* in pf_paths */
+	STAILQ_ENTRY(pf_entry)	pf_link;	/* in pf_queue if PF_QUEUED */
+	char			*pf_path;
+	input_t			*pf_in;		/* NULL if load failed */
+	pf_state_t		pf_state;
+} pf_entry_t;
+
+/*
+ * pf_lock protects everything here.  It is never held while calling into
+ * input.c or token.c.
+ */
+static pthread_mutex_t pf_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pf_work_cv = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pf_done_cv = PTHREAD_COND_INITIALIZER;
+static STAILQ_HEAD(, pf_entry) pf_queue = STAILQ_HEAD_INITIALIZER(pf_queue);
+static avl_tree_t pf_paths;
+static pthread_t pf_threads[PREFETCH_MAX_THREADS];
+static uint_t pf_nthreads;
+static boolean_t pf_active;
+static boolean_t pf_exiting;
+static make_t *pf_mk;
+
+static int
+pf_cmp(const void *a, const void *b)
+{
+	const pf_entry_t *l = a;
+	const pf_entry_t *r = b;
+	int ret = strcmp(l->pf_path, r->pf_path);
+
+	if (ret < 0)
+		return (-1);
+	if (ret > 0)
+		return (1);
+	return (0);
+}
+
+static void
+pf_include(const token_t *t, void *arg __unused)
+{
+	char *path = NULL;
+
+	if ((path = tok_include_path(pf_mk, t)) != NULL) {
+		prefetch(path);
+		strfree(path);
+	}
+}
+
+static void
+pf_load(pf_entry_t *pf)
+{
+	input_t *in = NULL;
+
+	/*
+	 * Don't complain about files that can't be read here.  If the parser
+	 * actually needs it, prefetch_input() will try again and report
+	 * the error then.
+	 */
+	if (access(pf->pf_path, R_OK) == 0 &&
+	    (in = input_new(pf->pf_path)) != NULL)
+		tok_includes(pf_mk, in, pf_include, NULL);
+
+	(void) pthread_mutex_lock(&pf_lock);
+	pf->pf_in = in;
+	pf->pf_state = PF_DONE;
+	(void) pthread_cond_broadcast(&pf_done_cv);
+	(void) pthread_mutex_unlock(&pf_lock);
+}
+
+static void *
+pf_worker(void *arg __unused)
+{
+	pf_entry_t *pf = NULL;
+
+	(void) pthread_mutex_lock(&pf_lock);
+	for (;;) {
+		while (!pf_exiting && STAILQ_EMPTY(&pf_queue))
+			(void) pthread_cond_wait(&pf_work_cv, &pf_lock);
+		if (pf_exiting)
+			break;
+
+		pf = STAILQ_FIRST(&pf_queue);
+		STAILQ_REMOVE_HEAD(&pf_queue, pf_link);
+		pf->pf_state = PF_LOADING;
+
+		(void) pthread_mutex_unlock(&pf_lock);
+		pf_load(pf);
+		(void) pthread_mutex_lock(&pf_lock);
+	}
+	(void) pthread_mutex_unlock(&pf_lock);
+	return (NULL);
+}
+
+/*
+ * Start nthreads (at most PREFETCH_MAX_THREADS) prefetch threads.  Returns
+ * B_FALSE if no threads could be started, in which case prefetch() does
+ * nothing, and prefetch_input() is the same as input_new().
+ */
+boolean_t
+prefetch_init(make_t *mk, uint_t nthreads)
+{
+	VERIFY(!pf_active);
+
+	if (nthreads > PREFETCH_MAX_THREADS)
+		nthreads = PREFETCH_MAX_THREADS;
+
+	avl_create(&pf_paths, pf_cmp, sizeof (pf_entry_t),
+	    offsetof(pf_entry_t, pf_avl));
+	pf_mk = mk;
+	pf_exiting = B_FALSE;
+
+	for (pf_nthreads = 0; pf_nthreads < nthreads; pf_nthreads++) {
+		if (pthread_create(&pf_threads[pf_nthreads], NULL, pf_worker,
+		    NULL) != 0)
+			break;
+	}
+
+	if (pf_nthreads == 0) {
+		avl_destroy(&pf_paths);
+		return (B_FALSE);
+	}
+
+	pf_active = B_TRUE;
+	return (B_TRUE);
+}
+
+/*
+ * Stop the prefetch threads, and release every prefetched input that
+ * was not used.
+ */
+void
+prefetch_fini(void)
+{
+	pf_entry_t *pf = NULL;
+	void *cookie = NULL;
+
+	if (!pf_active)
+		return;
+
+	(void) pthread_mutex_lock(&pf_lock);
+	pf_exiting = B_TRUE;
+	(void) pthread_cond_broadcast(&pf_work_cv);
+	(void) pthread_mutex_unlock(&pf_lock);
+
+	for (uint_t i = 0; i < pf_nthreads; i++)
+		(void) pthread_join(pf_threads[i], NULL);
+
+	STAILQ_INIT(&pf_queue);
+	while ((pf = avl_destroy_nodes(&pf_paths, &cookie)) != NULL) {
+		input_free(pf->pf_in);
+		strfree(pf->pf_path);
+		umem_free(pf, sizeof (*pf));
+	}
+	avl_destroy(&pf_paths);
+
+	pf_nthreads = 0;
+	pf_active = B_FALSE;
+}
+
+/*
+ * Queue path to be loaded by a prefetch thread.  Paths that
+ * have already been prefetched are ignored.
+ */
+void
+prefetch(const char *path)
+{
+	pf_entry_t key = { .pf_path = (char *)path };
+	pf_entry_t *pf = NULL;
+	avl_index_t where;
+
+	if (!pf_active)
+		return;
+
+	(void) pthread_mutex_lock(&pf_lock);
+	if (avl_find(&pf_paths, &key, &where) != NULL) {
+		(void) pthread_mutex_unlock(&pf_lock);
+		return;
+	}
+
+	pf = zalloc(sizeof (*pf));
+	pf->pf_path = xstrdup(path);
+	pf->pf_state = PF_QUEUED;
+	avl_insert(&pf_paths, pf, where);
+	STAILQ_INSERT_TAIL(&pf_queue, pf, pf_link);
+
+	(void) pthread_cond_signal(&pf_work_cv);
+	(void) pthread_mutex_unlock(&pf_lock);
+}
+
+/*
+ * Return the input for path, using the prefetched copy if there is one.
+ * The caller must input_free() the returned input.
+ */
+input_t *
+prefetch_input(const char *path)
+{
+	pf_entry_t key = { .pf_path = (char *)path };
+	pf_entry_t *pf = NULL;
+	input_t *in = NULL;
+
+	if (!pf_active)
+		return (input_new(path));
+
+	(void) pthread_mutex_lock(&pf_lock);
+	if ((pf = avl_find(&pf_paths, &key, NULL)) == NULL) {
+		(void) pthread_mutex_unlock(&pf_lock);
+		return (input_new(path));
+	}
+
+	/* The workers haven't gotten to it yet, so just load it ourselves */
+	if (pf->pf_state == PF_QUEUED) {
+		STAILQ_REMOVE(&pf_queue, pf, pf_entry, pf_link);
+		pf->pf_state = PF_LOADING;
+		(void) pthread_mutex_unlock(&pf_lock);
+		pf_load(pf);
+		(void) pthread_mutex_lock(&pf_lock);
+	}
+
+	while (pf->pf_state != PF_DONE)
+		(void) pthread_cond_wait(&pf_done_cv, &pf_lock);
+	in = pf->pf_in;
+	(void) pthread_mutex_unlock(&pf_lock);
+
+	/* Try again so whatever went wrong is reported */
+	if (in == NULL)
+		return (input_new(path));
+
+	return (input_hold(in));
+}
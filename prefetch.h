@@ -0,0 +1,39 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2018 Jason King
+ */
+
+#ifndef _PREFETCH_H
+#define	_PREFETCH_H
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct input;
+struct make;
+
+#define	PREFETCH_MAX_THREADS	8
+
+boolean_t	prefetch_init(struct make *, uint_t);
+void		prefetch_fini(void);
+void		prefetch(const char *);
+struct input	*prefetch_input(const char *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _PREFETCH_H */
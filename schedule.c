@@ -0,0 +1,1035 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2018 Jason King
+ */
+
+/*
+ * The job scheduler.
+ *
+ * sched_run() builds a set of goal targets (and everything they depend on)
+ * from the frozen dependency graph, running up to so_jobs builds at once.
+ * At high -j, a single queue of ready targets (and its lock) is touched by
+ * every worker for every target, so instead each worker has its own deque
+ * of ready targets.  A worker pushes the targets it makes ready onto the
+ * bottom of its own deque and pops from there (so it tends to continue
+ * down the same part of the graph), and only when its deque is empty does
+ * it steal from the top of another worker's deque.  The deques are the
+ * lock-free ones described by Chase and Lev ("Dynamic Circular
+ * Work-Stealing Deque", SPAA 2005).
+ *
+ * Each target has a count of the unfinished targets it waits for, which is
+ * decremented atomically as each of those finishes; whoever takes it to
+ * zero queues the target.  A worker with nothing to do (after a few rounds
+ * of trying to steal) sleeps until more work is queued.
+ *
+ * The special targets that constrain the order are turned into more
+ * edges before anything is run:
+ *
+ *	.WAIT		In a dependency list (e.g. all: a b .WAIT c), the
+ *			dependencies after a .WAIT are not started until
+ *			those before it are finished (their own dependencies
+ *			aren't held back).  Each .WAIT becomes a barrier
+ *			node (that doesn't build anything) between the two
+ *			groups, so the number of edges is linear in the size
+ *			of the groups.
+ *	.ORDER		The dependencies of each .ORDER line are built in
+ *			the order given, if they're built at all (.ORDER
+ *			doesn't cause anything to be built).
+ *	.NOTPARALLEL	With no dependencies, only one target is built at a
+ *			time.  Otherwise (as with .NO_PARALLEL), none of its
+ *			dependencies are built at the same time as another.
+ *
+ * When more targets are ready than there are jobs, which ones go first
+ * matters: a long chain of work that is started late stretches out the
+ * end of the build.  Each node's priority is the length of the longest
+ * (critical) path from it to the end of the build, with each target
+ * weighed by how long it took last time (from so_history).  A target with
+ * no history counts as the mean of those that have one, so with no history
+ * at all the priority is just the number of targets on the longest chain
+ * that waits for it.  Each worker has a deque for each of SCHED_NPRIO
+ * priority levels, and takes from the highest level that has anything
+ * queued (in its own deque, if it can), and targets made ready together
+ * are pushed so the most important (ties going to the one with the most
+ * dependents) is taken first.
+ *
+ * If a target fails, anything that depends on it is skipped.  Without
+ * so_keep_going, no new builds are started either.
+ */
+
+#include <err.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/debug.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <umem.h>
+
+#include "atom.h"
+#include "history.h"
+#include "schedule.h"
+#include "target.h"
+#include "util.h"
+
+#define	SCHED_NONE	UINT32_MAX		/* nothing to do */
+#define	SCHED_ABORT	(UINT32_MAX - 1)	/* lost a race, try again */
+#define	SCHED_DEQUE_MIN	64U			/* must be a power of 2 */
+#define	SCHED_SPINS	64U		/* steal attempts before sleeping */
+#define	SCHED_NPRIO	16U		/* priority levels */
+
+#ifndef MAX
+#define	MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+/* s_flags */
+#define	SF_BUILD	0x01	/* in the set to build */
+#define	SF_SPECIAL	0x02	/* .WAIT, etc., never built */
+#define	SF_BARRIER	0x04	/* a .WAIT barrier */
+#define	SF_SERIAL	0x08	/* never build with another SF_SERIAL node */
+#define	SF_SKIP		0x10	/* something it depends on failed */
+
+typedef struct sched_array {
+	struct sched_array	*sa_prev;	/* previous (smaller) array */
+	size_t			sa_size;	/* power of 2 */
+	uint32_t		*sa_items;
+} sched_array_t;
+
+typedef struct sched_deque {
+	int64_t		sd_top;		/* next to steal */
+	int64_t		sd_bottom;	/* next free slot */
+	sched_array_t	*sd_array;
+} sched_deque_t;
+
+struct sched;
+
+/* A node made ready, to be sorted by priority */
+typedef struct sched_cand {
+	uint64_t	sc_prio;
+	uint32_t	sc_nsucc;
+	uint32_t	sc_id;
+} sched_cand_t;
+
+typedef struct sched_worker {
+	sched_deque_t	sw_deques[SCHED_NPRIO];
+	sched_cand_t	*sw_ready;	/* room for the most successors */
+	struct sched	*sw_sched;
+	pthread_t	sw_thread;
+	uint32_t	sw_rand;
+	boolean_t	sw_started;
+	char		sw_pad[64];	/* keep deques on separate lines */
+} sched_worker_t;
+
+typedef struct sched_edge {
+	uint32_t	se_from;
+	uint32_t	se_to;
+} sched_edge_t;
+
+typedef struct sched {
+	const target_graph_t	*s_tg;
+	const sched_opts_t	*s_opts;
+	size_t			s_n;		/* targets + barriers */
+	uint8_t			*s_flags;
+	uint32_t		*s_pending;	/* unfinished predecessors */
+	uint32_t		*s_succ_off;	/* s_n + 1 entries */
+	uint32_t		*s_succ;
+	size_t			s_nsucc;
+	size_t			s_maxsucc;	/* most successors of a node */
+	uint64_t		*s_prio;	/* critical path length */
+	uint8_t			*s_level;	/* priority level */
+	uint64_t		*s_time;	/* build times, or NULL */
+	uint32_t		s_queued[SCHED_NPRIO];	/* at each level */
+	sched_edge_t		*s_extra;	/* from .WAIT and .ORDER */
+	size_t			s_nextra;
+	size_t			s_extraalloc;
+	sched_worker_t		*s_workers;
+	uint_t			s_nworkers;
+	uint32_t		s_remaining;	/* nodes yet to finish */
+	uint64_t		s_epoch;	/* bumped when work is queued */
+	uint32_t		s_nsleep;	/* # of sleeping workers */
+	boolean_t		s_stop;		/* no more work to do */
+	boolean_t		s_failed;
+	pthread_mutex_t		s_lock;		/* for sleeping */
+	pthread_cond_t		s_cv;
+	pthread_mutex_t		s_serial_lock;	/* for SF_SERIAL */
+} sched_t;
+
+static void
+sched_deque_init(sched_deque_t *sd)
+{
+	sched_array_t *sa = zalloc(sizeof (*sa));
+
+	sa->sa_size = SCHED_DEQUE_MIN;
+	sa->sa_items = xcalloc(sa->sa_size, sizeof (uint32_t));
+	sd->sd_array = sa;
+	sd->sd_top = sd->sd_bottom = 0;
+}
+
+static void
+sched_deque_fini(sched_deque_t *sd)
+{
+	sched_array_t *sa = sd->sd_array;
+
+	while (sa != NULL) {
+		sched_array_t *prev = sa->sa_prev;
+
+		cfree(sa->sa_items, sa->sa_size, sizeof (uint32_t));
+		umem_free(sa, sizeof (*sa));
+		sa = prev;
+	}
+}
+
+/*
+ * Replace the (full) array of sd with one twice the size.  Thieves may
+ * still be reading the old array, so it's kept until the deque is freed.
+ */
+static sched_array_t *
+sched_deque_grow(sched_deque_t *sd, sched_array_t *old, int64_t t, int64_t b)
+{
+	sched_array_t *sa = zalloc(sizeof (*sa));
+
+	sa->sa_size = old->sa_size * 2;
+	sa->sa_items = xcalloc(sa->sa_size, sizeof (uint32_t));
+	sa->sa_prev = old;
+
+	for (int64_t i = t; i < b; i++) {
+		sa->sa_items[i & (sa->sa_size - 1)] =
+		    old->sa_items[i & (old->sa_size - 1)];
+	}
+
+	__atomic_store_n(&sd->sd_array, sa, __ATOMIC_RELEASE);
+	return (sa);
+}
+
+/* Only the owner of sd may push */
+static void
+sched_push(sched_deque_t *sd, uint32_t id)
+{
+	int64_t b = __atomic_load_n(&sd->sd_bottom, __ATOMIC_RELAXED);
+	int64_t t = __atomic_load_n(&sd->sd_top, __ATOMIC_ACQUIRE);
+	sched_array_t *sa = __atomic_load_n(&sd->sd_array, __ATOMIC_RELAXED);
+
+	if (b - t >= (int64_t)sa->sa_size)
+		sa = sched_deque_grow(sd, sa, t, b);
+
+	__atomic_store_n(&sa->sa_items[b & (sa->sa_size - 1)], id,
+	    __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&sd->sd_bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+/* Only the owner of sd may pop */
+static uint32_t
+sched_pop(sched_deque_t *sd)
+{
+	int64_t b = __atomic_load_n(&sd->sd_bottom, __ATOMIC_RELAXED) - 1;
+	sched_array_t *sa = __atomic_load_n(&sd->sd_array, __ATOMIC_RELAXED);
+	uint32_t id;
+	int64_t t;
+
+	__atomic_store_n(&sd->sd_bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&sd->sd_top, __ATOMIC_RELAXED);
+
+	if (t > b) {
+		__atomic_store_n(&sd->sd_bottom, b + 1, __ATOMIC_RELAXED);
+		return (SCHED_NONE);
+	}
+
+	id = __atomic_load_n(&sa->sa_items[b & (sa->sa_size - 1)],
+	    __ATOMIC_RELAXED);
+	if (t == b) {
+		/* The last one, so race any thieves for it */
+		if (!__atomic_compare_exchange_n(&sd->sd_top, &t, t + 1,
+		    B_FALSE, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			id = SCHED_NONE;
+		__atomic_store_n(&sd->sd_bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return (id);
+}
+
+static uint32_t
+sched_steal(sched_deque_t *sd)
+{
+	int64_t t = __atomic_load_n(&sd->sd_top, __ATOMIC_ACQUIRE);
+	sched_array_t *sa = NULL;
+	uint32_t id;
+	int64_t b;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&sd->sd_bottom, __ATOMIC_ACQUIRE);
+	if (t >= b)
+		return (SCHED_NONE);
+
+	sa = __atomic_load_n(&sd->sd_array, __ATOMIC_ACQUIRE);
+	id = __atomic_load_n(&sa->sa_items[t & (sa->sa_size - 1)],
+	    __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&sd->sd_top, &t, t + 1, B_FALSE,
+	    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return (SCHED_ABORT);
+	return (id);
+}
+
+static boolean_t
+sched_stopped(sched_t *s)
+{
+	return (__atomic_load_n(&s->s_stop, __ATOMIC_ACQUIRE));
+}
+
+static void
+sched_stop(sched_t *s)
+{
+	__atomic_store_n(&s->s_stop, B_TRUE, __ATOMIC_RELEASE);
+	(void) pthread_mutex_lock(&s->s_lock);
+	(void) pthread_cond_broadcast(&s->s_cv);
+	(void) pthread_mutex_unlock(&s->s_lock);
+}
+
+/* Is sd empty?  Only exact for the owner of sd. */
+static boolean_t
+sched_empty(sched_deque_t *sd)
+{
+	return ((__atomic_load_n(&sd->sd_top, __ATOMIC_RELAXED) >=
+	    __atomic_load_n(&sd->sd_bottom, __ATOMIC_RELAXED)) ?
+	    B_TRUE : B_FALSE);
+}
+
+/* id can now be built */
+static void
+sched_ready(sched_worker_t *sw, uint32_t id)
+{
+	sched_t *s = sw->sw_sched;
+	uint8_t level = s->s_level[id];
+
+	/* Counted first, so s_queued is never less than what's queued */
+	(void) __atomic_add_fetch(&s->s_queued[level], 1, __ATOMIC_SEQ_CST);
+	sched_push(&sw->sw_deques[level], id);
+
+	/*
+	 * A worker going to sleep increments s_nsleep and then checks that
+	 * s_epoch hasn't changed, and we do the opposite, so either it sees
+	 * the new work, or we see it and wake it.
+	 */
+	(void) __atomic_add_fetch(&s->s_epoch, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&s->s_nsleep, __ATOMIC_SEQ_CST) > 0) {
+		(void) pthread_mutex_lock(&s->s_lock);
+		(void) pthread_cond_signal(&s->s_cv);
+		(void) pthread_mutex_unlock(&s->s_lock);
+	}
+}
+
+/*
+ * Steal from the deques at level of the other workers, starting from a
+ * random one.
+ */
+static uint32_t
+sched_steal_any(sched_worker_t *sw, uint_t level, boolean_t *racep)
+{
+	sched_t *s = sw->sw_sched;
+	uint_t start;
+
+	sw->sw_rand ^= sw->sw_rand << 13;
+	sw->sw_rand ^= sw->sw_rand >> 17;
+	sw->sw_rand ^= sw->sw_rand << 5;
+	start = sw->sw_rand % s->s_nworkers;
+
+	for (uint_t i = 0; i < s->s_nworkers; i++) {
+		sched_worker_t *victim = &s->s_workers[(start + i) %
+		    s->s_nworkers];
+		uint32_t id;
+
+		if (victim == sw)
+			continue;
+
+		id = sched_steal(&victim->sw_deques[level]);
+		if (id == SCHED_ABORT) {
+			*racep = B_TRUE;
+			continue;
+		}
+		if (id != SCHED_NONE)
+			return (id);
+	}
+
+	return (SCHED_NONE);
+}
+
+/* Take a node from the highest level that has any, or SCHED_NONE */
+static uint32_t
+sched_take(sched_worker_t *sw, boolean_t *racep)
+{
+	sched_t *s = sw->sw_sched;
+
+	for (uint_t level = SCHED_NPRIO; level-- > 0; ) {
+		sched_deque_t *sd = &sw->sw_deques[level];
+		uint32_t id = SCHED_NONE;
+
+		if (__atomic_load_n(&s->s_queued[level], __ATOMIC_SEQ_CST) == 0)
+			continue;
+
+		if (!sched_empty(sd))
+			id = sched_pop(sd);
+		if (id == SCHED_NONE)
+			id = sched_steal_any(sw, level, racep);
+		if (id != SCHED_NONE) {
+			(void) __atomic_sub_fetch(&s->s_queued[level], 1,
+			    __ATOMIC_SEQ_CST);
+			return (id);
+		}
+	}
+
+	return (SCHED_NONE);
+}
+
+/* Return the next node for sw to run, or SCHED_NONE when it should exit */
+static uint32_t
+sched_next(sched_worker_t *sw)
+{
+	sched_t *s = sw->sw_sched;
+	uint32_t id;
+
+	for (;;) {
+		uint64_t epoch = __atomic_load_n(&s->s_epoch, __ATOMIC_SEQ_CST);
+		boolean_t race = B_FALSE;
+
+		for (uint_t spin = 0; spin < SCHED_SPINS; spin++) {
+			if (sched_stopped(s))
+				return (SCHED_NONE);
+			if ((id = sched_take(sw, &race)) != SCHED_NONE)
+				return (id);
+			(void) sched_yield();
+		}
+
+		/* Lost a race with another thief, so there may be more */
+		if (race)
+			continue;
+
+		(void) pthread_mutex_lock(&s->s_lock);
+		(void) __atomic_add_fetch(&s->s_nsleep, 1, __ATOMIC_SEQ_CST);
+		while (!sched_stopped(s) &&
+		    __atomic_load_n(&s->s_epoch, __ATOMIC_SEQ_CST) == epoch)
+			(void) pthread_cond_wait(&s->s_cv, &s->s_lock);
+		(void) __atomic_sub_fetch(&s->s_nsleep, 1, __ATOMIC_SEQ_CST);
+		(void) pthread_mutex_unlock(&s->s_lock);
+	}
+}
+
+static void
+sched_cand(const sched_t *s, sched_cand_t *sc, uint32_t id)
+{
+	sc->sc_prio = s->s_prio[id];
+	sc->sc_nsucc = s->s_succ_off[id + 1] - s->s_succ_off[id];
+	sc->sc_id = id;
+}
+
+/*
+ * Sort in increasing importance, since the last pushed is the first
+ * popped.  Ties go to the node that comes first in the makefile.
+ */
+static int
+sched_cand_cmp(const void *a, const void *b)
+{
+	const sched_cand_t *l = a;
+	const sched_cand_t *r = b;
+
+	if (l->sc_prio != r->sc_prio)
+		return ((l->sc_prio < r->sc_prio) ? -1 : 1);
+	if (l->sc_nsucc != r->sc_nsucc)
+		return ((l->sc_nsucc < r->sc_nsucc) ? -1 : 1);
+	if (l->sc_id != r->sc_id)
+		return ((l->sc_id > r->sc_id) ? -1 : 1);
+	return (0);
+}
+
+/*
+ * id is finished.  If it failed (or was skipped), so is everything that
+ * waits for it.
+ */
+static void
+sched_finish(sched_worker_t *sw, uint32_t id, boolean_t ok)
+{
+	sched_t *s = sw->sw_sched;
+	size_t nready = 0;
+
+	for (uint32_t k = s->s_succ_off[id]; k < s->s_succ_off[id + 1]; k++) {
+		uint32_t succ = s->s_succ[k];
+
+		if (!ok) {
+			(void) __atomic_fetch_or(&s->s_flags[succ], SF_SKIP,
+			    __ATOMIC_RELAXED);
+		}
+		if (__atomic_sub_fetch(&s->s_pending[succ], 1,
+		    __ATOMIC_ACQ_REL) == 0)
+			sched_cand(s, &sw->sw_ready[nready++], succ);
+	}
+
+	if (nready > 1) {
+		qsort(sw->sw_ready, nready, sizeof (sched_cand_t),
+		    sched_cand_cmp);
+	}
+	for (size_t i = 0; i < nready; i++)
+		sched_ready(sw, sw->sw_ready[i].sc_id);
+
+	if (__atomic_sub_fetch(&s->s_remaining, 1, __ATOMIC_ACQ_REL) == 0)
+		sched_stop(s);
+}
+
+static void
+sched_exec(sched_worker_t *sw, uint32_t id)
+{
+	sched_t *s = sw->sw_sched;
+	uint8_t flags = __atomic_load_n(&s->s_flags[id], __ATOMIC_ACQUIRE);
+	boolean_t ok = B_TRUE;
+
+	if ((flags & SF_SKIP) != 0) {
+		ok = B_FALSE;
+	} else if ((flags & SF_BARRIER) == 0) {
+		target_t *t = s->s_tg->tg_targets[id];
+		hrtime_t start;
+
+		if ((flags & SF_SERIAL) != 0)
+			(void) pthread_mutex_lock(&s->s_serial_lock);
+		start = gethrtime();
+		ok = s->s_opts->so_build(t, s->s_opts->so_arg);
+		if (ok && s->s_time != NULL)
+			s->s_time[id] = MAX(gethrtime() - start, 1);
+		if ((flags & SF_SERIAL) != 0)
+			(void) pthread_mutex_unlock(&s->s_serial_lock);
+
+		if (!ok) {
+			__atomic_store_n(&s->s_failed, B_TRUE,
+			    __ATOMIC_RELAXED);
+			if (!s->s_opts->so_keep_going) {
+				sched_stop(s);
+				return;
+			}
+		}
+	}
+
+	sched_finish(sw, id, ok);
+}
+
+static void *
+sched_worker(void *arg)
+{
+	sched_worker_t *sw = arg;
+	uint32_t id;
+
+	while ((id = sched_next(sw)) != SCHED_NONE)
+		sched_exec(sw, id);
+	return (NULL);
+}
+
+/* The id of the special target name, or SCHED_NONE if it isn't used */
+static uint32_t
+sched_special(sched_t *s, const char *name)
+{
+	target_t *t = target_get(atom_find(name, strlen(name)));
+
+	if (t == NULL || t->id >= s->s_tg->tg_n ||
+	    s->s_tg->tg_targets[t->id] != t)
+		return (SCHED_NONE);
+
+	s->s_flags[t->id] |= SF_SPECIAL;
+	return (t->id);
+}
+
+static void
+sched_edge_add(sched_t *s, uint32_t from, uint32_t to)
+{
+	if (s->s_nextra == s->s_extraalloc) {
+		size_t newn = (s->s_extraalloc == 0) ?
+		    64 : s->s_extraalloc * 2;
+
+		s->s_extra = xrealloc(s->s_extra,
+		    s->s_extraalloc * sizeof (sched_edge_t),
+		    newn * sizeof (sched_edge_t));
+		s->s_extraalloc = newn;
+	}
+
+	s->s_extra[s->s_nextra].se_from = from;
+	s->s_extra[s->s_nextra].se_to = to;
+	s->s_nextra++;
+}
+
+/* Mark the goals, and everything they depend on, to be built */
+static void
+sched_mark(sched_t *s, const uint32_t *goals, size_t ngoals)
+{
+	const target_graph_t *tg = s->s_tg;
+	uint32_t *stack = NULL;
+	size_t depth = 0;
+
+	if (ngoals == 0) {
+		for (size_t i = 0; i < tg->tg_n; i++) {
+			if ((s->s_flags[i] & SF_SPECIAL) == 0)
+				s->s_flags[i] |= SF_BUILD;
+		}
+		return;
+	}
+
+	/* Each target is pushed at most once */
+	stack = xcalloc(tg->tg_n + 1, sizeof (uint32_t));
+	for (size_t i = 0; i < ngoals; i++) {
+		uint32_t id = goals[i];
+
+		if ((s->s_flags[id] & (SF_BUILD | SF_SPECIAL)) != 0)
+			continue;
+		s->s_flags[id] |= SF_BUILD;
+		stack[depth++] = id;
+	}
+
+	while (depth > 0) {
+		uint32_t id = stack[--depth];
+
+		for (uint32_t k = tg->tg_deps_off[id];
+		    k < tg->tg_deps_off[id + 1]; k++) {
+			uint32_t dep = tg->tg_deps[k];
+
+			if ((s->s_flags[dep] & (SF_BUILD | SF_SPECIAL)) != 0)
+				continue;
+			s->s_flags[dep] |= SF_BUILD;
+			stack[depth++] = dep;
+		}
+	}
+
+	cfree(stack, tg->tg_n + 1, sizeof (uint32_t));
+}
+
+/* The number of .WAITs (w is the id of .WAIT) in targets being built */
+static size_t
+sched_nwaits(const sched_t *s, uint32_t w)
+{
+	const target_graph_t *tg = s->s_tg;
+	size_t n = 0;
+
+	if (w == SCHED_NONE)
+		return (0);
+
+	for (uint32_t k = tg->tg_rdeps_off[w]; k < tg->tg_rdeps_off[w + 1];
+	    k++) {
+		const target_t *t = tg->tg_targets[tg->tg_rdeps[k]];
+
+		if ((s->s_flags[t->id] & SF_BUILD) == 0)
+			continue;
+
+		for (size_t i = 0; i < t->ndeps; i++) {
+			if (t->deps[i]->target->id == w)
+				n++;
+		}
+	}
+	return (n);
+}
+
+/*
+ * Add a barrier for each .WAIT in the dependencies of the targets being
+ * built.  Barriers are numbered from tg_n.
+ */
+static void
+sched_waits(sched_t *s, uint32_t w)
+{
+	const target_graph_t *tg = s->s_tg;
+	uint32_t next = (uint32_t)tg->tg_n;
+	uint32_t *group = NULL;
+	size_t ngroup = 0, nalloc = 0;
+
+	if (w == SCHED_NONE)
+		return;
+
+	for (uint32_t k = tg->tg_rdeps_off[w]; k < tg->tg_rdeps_off[w + 1];
+	    k++) {
+		const target_t *t = tg->tg_targets[tg->tg_rdeps[k]];
+		uint32_t barrier = SCHED_NONE;
+
+		if ((s->s_flags[t->id] & SF_BUILD) == 0)
+			continue;
+
+		if (nalloc < t->ndeps) {
+			group = xrealloc(group, nalloc * sizeof (uint32_t),
+			    t->ndeps * sizeof (uint32_t));
+			nalloc = t->ndeps;
+		}
+		ngroup = 0;
+
+		for (size_t i = 0; i < t->ndeps; i++) {
+			uint32_t dep = t->deps[i]->target->id;
+
+			if (dep != w) {
+				if ((s->s_flags[dep] & SF_SPECIAL) != 0)
+					continue;
+				if (barrier != SCHED_NONE)
+					sched_edge_add(s, barrier, dep);
+				group[ngroup++] = dep;
+				continue;
+			}
+
+			s->s_flags[next] = SF_BUILD | SF_BARRIER;
+			for (size_t j = 0; j < ngroup; j++)
+				sched_edge_add(s, group[j], next);
+			if (ngroup == 0 && barrier != SCHED_NONE)
+				sched_edge_add(s, barrier, next);
+
+			barrier = next++;
+			ngroup = 0;
+		}
+	}
+
+	cfree(group, nalloc, sizeof (uint32_t));
+	VERIFY3U(next, ==, s->s_n);
+}
+
+/*
+ * Chain the targets of each .ORDER line that are being built.  All .ORDER
+ * lines are dependencies of the same target, so the lines are told apart
+ * by where each dependency came from.
+ */
+static void
+sched_order(sched_t *s, uint32_t o)
+{
+	const target_t *t = NULL;
+	uint32_t prev = SCHED_NONE;
+
+	if (o == SCHED_NONE)
+		return;
+
+	t = s->s_tg->tg_targets[o];
+	for (size_t i = 0; i < t->ndeps; i++) {
+		const dependency_t *d = t->deps[i];
+		uint32_t id = d->target->id;
+
+		if (i > 0 && (d->src.bm_input != t->deps[i - 1]->src.bm_input ||
+		    d->src.bm_line != t->deps[i - 1]->src.bm_line))
+			prev = SCHED_NONE;
+
+		if ((s->s_flags[id] & (SF_BUILD | SF_SPECIAL)) != SF_BUILD)
+			continue;
+		if (prev != SCHED_NONE)
+			sched_edge_add(s, prev, id);
+		prev = id;
+	}
+}
+
+/*
+ * Build the successors of every node being built: the targets that depend
+ * on it, plus the extra edges.  s_pending counts the predecessors.
+ */
+static void
+sched_edges(sched_t *s)
+{
+	const target_graph_t *tg = s->s_tg;
+	uint32_t *next = NULL;
+
+	s->s_succ_off = xcalloc(s->s_n + 1, sizeof (uint32_t));
+	s->s_pending = xcalloc(s->s_n + 1, sizeof (uint32_t));
+
+	for (size_t i = 0; i < tg->tg_n; i++) {
+		if ((s->s_flags[i] & SF_BUILD) == 0)
+			continue;
+
+		for (uint32_t k = tg->tg_rdeps_off[i];
+		    k < tg->tg_rdeps_off[i + 1]; k++) {
+			uint32_t r = tg->tg_rdeps[k];
+
+			if ((s->s_flags[r] & SF_BUILD) == 0)
+				continue;
+			s->s_succ_off[i + 1]++;
+			s->s_pending[r]++;
+		}
+	}
+	for (size_t i = 0; i < s->s_nextra; i++) {
+		s->s_succ_off[s->s_extra[i].se_from + 1]++;
+		s->s_pending[s->s_extra[i].se_to]++;
+	}
+	for (size_t i = 0; i < s->s_n; i++)
+		s->s_succ_off[i + 1] += s->s_succ_off[i];
+
+	s->s_nsucc = s->s_succ_off[s->s_n];
+	s->s_succ = xcalloc(s->s_nsucc + 1, sizeof (uint32_t));
+	next = xcalloc(s->s_n + 1, sizeof (uint32_t));
+	(void) memcpy(next, s->s_succ_off, s->s_n * sizeof (uint32_t));
+
+	for (size_t i = 0; i < tg->tg_n; i++) {
+		if ((s->s_flags[i] & SF_BUILD) == 0)
+			continue;
+
+		for (uint32_t k = tg->tg_rdeps_off[i];
+		    k < tg->tg_rdeps_off[i + 1]; k++) {
+			uint32_t r = tg->tg_rdeps[k];
+
+			if ((s->s_flags[r] & SF_BUILD) != 0)
+				s->s_succ[next[i]++] = r;
+		}
+	}
+	for (size_t i = 0; i < s->s_nextra; i++) {
+		uint32_t from = s->s_extra[i].se_from;
+
+		s->s_succ[next[from]++] = s->s_extra[i].se_to;
+	}
+
+	cfree(next, s->s_n + 1, sizeof (uint32_t));
+}
+
+/*
+ * Make sure everything can be built, i.e. there are no cycles (the .WAIT
+ * and .ORDER edges can add them even if the dependencies don't have any).
+ * Sets *nbuildp to the number of nodes to build, and fills queue (which
+ * must have room for s_n nodes) with them in an order they can be built.
+ */
+static boolean_t
+sched_check(sched_t *s, uint32_t *queue, size_t *nbuildp)
+{
+	uint32_t *pending = xcalloc(s->s_n + 1, sizeof (uint32_t));
+	size_t head = 0, tail = 0, nbuild = 0;
+
+	(void) memcpy(pending, s->s_pending, s->s_n * sizeof (uint32_t));
+	for (size_t i = 0; i < s->s_n; i++) {
+		if ((s->s_flags[i] & SF_BUILD) == 0)
+			continue;
+		nbuild++;
+		if (pending[i] == 0)
+			queue[tail++] = (uint32_t)i;
+	}
+
+	while (head < tail) {
+		uint32_t id = queue[head++];
+
+		for (uint32_t k = s->s_succ_off[id]; k < s->s_succ_off[id + 1];
+		    k++) {
+			if (--pending[s->s_succ[k]] == 0)
+				queue[tail++] = s->s_succ[k];
+		}
+	}
+
+	cfree(pending, s->s_n + 1, sizeof (uint32_t));
+
+	*nbuildp = nbuild;
+	return ((tail == nbuild) ? B_TRUE : B_FALSE);
+}
+
+/*
+ * Work out the priority of each of the n nodes in order (as filled in by
+ * sched_check()), from the last to the first, so the successors of each
+ * node are done before it.
+ */
+static void
+sched_prio(sched_t *s, const uint32_t *order, size_t n)
+{
+	const target_graph_t *tg = s->s_tg;
+	const history_t *h = s->s_opts->so_history;
+	uint64_t unknown = MAX(history_mean(h), 1);
+	uint64_t max = 0;
+
+	s->s_prio = xcalloc(s->s_n + 1, sizeof (uint64_t));
+	s->s_level = xcalloc(s->s_n + 1, sizeof (uint8_t));
+
+	for (size_t i = n; i-- > 0; ) {
+		uint32_t id = order[i];
+		uint64_t longest = 0, weight = 0;
+
+		for (uint32_t k = s->s_succ_off[id]; k < s->s_succ_off[id + 1];
+		    k++)
+			longest = MAX(longest, s->s_prio[s->s_succ[k]]);
+
+		if ((s->s_flags[id] & SF_BARRIER) == 0) {
+			weight = history_get(h, tg->tg_targets[id]->name);
+			if (weight == 0)
+				weight = unknown;
+		}
+
+		s->s_prio[id] = longest + weight;
+		s->s_maxsucc = MAX(s->s_maxsucc,
+		    s->s_succ_off[id + 1] - s->s_succ_off[id]);
+		max = MAX(max, s->s_prio[id]);
+	}
+
+	/* The levels divide 0..max evenly */
+	for (size_t i = 0; i < n; i++) {
+		uint32_t id = order[i];
+
+		s->s_level[id] =
+		    (uint8_t)(s->s_prio[id] * SCHED_NPRIO / (max + 1));
+	}
+}
+
+/* Add the times of what was built to the history */
+static void
+sched_record(sched_t *s)
+{
+	const target_graph_t *tg = s->s_tg;
+
+	if (s->s_time == NULL)
+		return;
+
+	for (size_t i = 0; i < tg->tg_n; i++) {
+		if (s->s_time[i] != 0) {
+			history_record(s->s_opts->so_history,
+			    tg->tg_targets[i]->name, s->s_time[i]);
+		}
+	}
+}
+
+static void
+sched_fini(sched_t *s)
+{
+	if (s->s_workers != NULL) {
+		for (uint_t i = 0; i < s->s_nworkers; i++) {
+			sched_worker_t *sw = &s->s_workers[i];
+
+			for (uint_t l = 0; l < SCHED_NPRIO; l++)
+				sched_deque_fini(&sw->sw_deques[l]);
+			cfree(sw->sw_ready, s->s_maxsucc + 1,
+			    sizeof (sched_cand_t));
+		}
+		cfree(s->s_workers, s->s_nworkers, sizeof (sched_worker_t));
+	}
+
+	cfree(s->s_flags, s->s_n + 1, sizeof (uint8_t));
+	cfree(s->s_pending, s->s_n + 1, sizeof (uint32_t));
+	cfree(s->s_succ_off, s->s_n + 1, sizeof (uint32_t));
+	cfree(s->s_succ, s->s_nsucc + 1, sizeof (uint32_t));
+	cfree(s->s_prio, s->s_n + 1, sizeof (uint64_t));
+	cfree(s->s_level, s->s_n + 1, sizeof (uint8_t));
+	cfree(s->s_time, s->s_tg->tg_n + 1, sizeof (uint64_t));
+	cfree(s->s_extra, s->s_extraalloc, sizeof (sched_edge_t));
+	(void) pthread_mutex_destroy(&s->s_lock);
+	(void) pthread_cond_destroy(&s->s_cv);
+	(void) pthread_mutex_destroy(&s->s_serial_lock);
+}
+
+/*
+ * Build the ngoals targets (by id) in goals, or every target in tg if
+ * ngoals is 0.  Returns B_FALSE if anything failed to build, or the
+ * targets can't be built in any order.
+ */
+boolean_t
+sched_run(const target_graph_t *tg, const uint32_t *goals, size_t ngoals,
+    const sched_opts_t *opts)
+{
+	sched_t s = {
+		.s_tg = tg,
+		.s_opts = opts,
+		.s_lock = PTHREAD_MUTEX_INITIALIZER,
+		.s_cv = PTHREAD_COND_INITIALIZER,
+		.s_serial_lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+	uint32_t wait, order, notpar, nopar;
+	uint32_t *queue = NULL;
+	sched_cand_t *ready = NULL;
+	uint_t jobs = opts->so_jobs;
+	size_t nwaits = 0, nbuild, nready = 0;
+	boolean_t ok;
+
+	/* The barriers for .WAIT are numbered after the targets */
+	s.s_flags = xcalloc(tg->tg_n + 1, sizeof (uint8_t));
+	s.s_n = tg->tg_n;
+	wait = sched_special(&s, ".WAIT");
+	order = sched_special(&s, ".ORDER");
+	notpar = sched_special(&s, ".NOTPARALLEL");
+	nopar = sched_special(&s, ".NO_PARALLEL");
+
+	sched_mark(&s, goals, ngoals);
+
+	if ((nwaits = sched_nwaits(&s, wait)) > 0) {
+		s.s_flags = xrealloc(s.s_flags,
+		    (tg->tg_n + 1) * sizeof (uint8_t),
+		    (tg->tg_n + nwaits + 1) * sizeof (uint8_t));
+		s.s_n = tg->tg_n + nwaits;
+	}
+
+	sched_waits(&s, wait);
+	sched_order(&s, order);
+
+	for (size_t i = 0; i < 2; i++) {
+		uint32_t np = (i == 0) ? notpar : nopar;
+		size_t n;
+		const uint32_t *deps = NULL;
+
+		if (np == SCHED_NONE)
+			continue;
+
+		deps = target_graph_deps(tg, np, &n);
+		if (n == 0)
+			jobs = 1;
+		for (size_t k = 0; k < n; k++)
+			s.s_flags[deps[k]] |= SF_SERIAL;
+	}
+
+	sched_edges(&s);
+	queue = xcalloc(s.s_n + 1, sizeof (uint32_t));
+	if (!sched_check(&s, queue, &nbuild)) {
+		warnx(_("Dependency cycle detected"));
+		cfree(queue, s.s_n + 1, sizeof (uint32_t));
+		sched_fini(&s);
+		return (B_FALSE);
+	}
+	if (nbuild == 0) {
+		cfree(queue, s.s_n + 1, sizeof (uint32_t));
+		sched_fini(&s);
+		return (B_TRUE);
+	}
+	s.s_remaining = (uint32_t)nbuild;
+
+	sched_prio(&s, queue, nbuild);
+	cfree(queue, s.s_n + 1, sizeof (uint32_t));
+	if (opts->so_history != NULL)
+		s.s_time = xcalloc(tg->tg_n + 1, sizeof (uint64_t));
+
+	if (jobs == 0)
+		jobs = 1;
+	if (jobs > SCHED_MAX_JOBS)
+		jobs = SCHED_MAX_JOBS;
+
+	s.s_nworkers = jobs;
+	s.s_workers = xcalloc(jobs, sizeof (sched_worker_t));
+	for (uint_t i = 0; i < jobs; i++) {
+		s.s_workers[i].sw_sched = &s;
+		s.s_workers[i].sw_rand = 2463534242U + i;
+		s.s_workers[i].sw_ready = xcalloc(s.s_maxsucc + 1,
+		    sizeof (sched_cand_t));
+		for (uint_t l = 0; l < SCHED_NPRIO; l++)
+			sched_deque_init(&s.s_workers[i].sw_deques[l]);
+	}
+
+	/*
+	 * Hand out what can be built right away, least important first (so
+	 * the most important are popped first).
+	 */
+	ready = xcalloc(nbuild, sizeof (sched_cand_t));
+	for (size_t i = 0; i < s.s_n; i++) {
+		if ((s.s_flags[i] & SF_BUILD) != 0 && s.s_pending[i] == 0)
+			sched_cand(&s, &ready[nready++], (uint32_t)i);
+	}
+	qsort(ready, nready, sizeof (sched_cand_t), sched_cand_cmp);
+	for (size_t i = 0; i < nready; i++)
+		sched_ready(&s.s_workers[i % jobs], ready[i].sc_id);
+	cfree(ready, nbuild, sizeof (sched_cand_t));
+
+	/* The calling thread is worker 0 */
+	for (uint_t i = 1; i < jobs; i++) {
+		sched_worker_t *sw = &s.s_workers[i];
+
+		if (pthread_create(&sw->sw_thread, NULL, sched_worker, sw) == 0)
+			sw->sw_started = B_TRUE;
+	}
+	(void) sched_worker(&s.s_workers[0]);
+
+	for (uint_t i = 1; i < jobs; i++) {
+		if (s.s_workers[i].sw_started)
+			(void) pthread_join(s.s_workers[i].sw_thread, NULL);
+	}
+
+	ok = (!s.s_failed && s.s_remaining == 0) ? B_TRUE : B_FALSE;
+	sched_record(&s);
+	sched_fini(&s);
+	return (ok);
+}
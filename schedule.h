@@ -0,0 +1,48 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2018 Jason King
+ */
+
+#ifndef _SCHEDULE_H
+#define	_SCHEDULE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "history.h"
+#include "target.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define	SCHED_MAX_JOBS	1024U
+
+/* Build (i.e. run the commands of) a target.  Returns B_FALSE on failure. */
+typedef boolean_t (*sched_build_f)(target_t *, void *);
+
+typedef struct sched_opts {
+	uint_t		so_jobs;	/* -j */
+	boolean_t	so_keep_going;	/* -k */
+	sched_build_f	so_build;
+	void		*so_arg;
+	history_t	*so_history;	/* build times, or NULL */
+} sched_opts_t;
+
+boolean_t sched_run(const target_graph_t *, const uint32_t *, size_t,
+    const sched_opts_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SCHEDULE_H */
@@ -0,0 +1,317 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2018 Jason King
+ */
+
+/*
+ * Targets and the dependency graph.
+ *
+ * While parsing, targets are created as they're named, and each keeps the
+ * list of its dependencies and commands in the order they're given (with
+ * where each came from, for error messages).  Targets are indexed by the
+ * atom of their name: atoms are small sequential integers, so the index is
+ * just an array.
+ *
+ * Once parsing is done, nothing adds targets or dependencies, and
+ * everything that follows (cycle detection, scheduling) only walks the
+ * graph, often many times.  Chasing the pointers of a large graph (several
+ * hundred thousand edges) is mostly cache misses, so target_graph_freeze()
+ * numbers the targets densely (target_t.id), and copies the edges into
+ * compressed sparse row form: for each direction, one array of every edge
+ * (as target ids), grouped by target, and an array of where each target's
+ * group starts.  Duplicate dependencies are dropped.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/debug.h>
+#include <sys/types.h>
+#include <umem.h>
+
+#include "atom.h"
+#include "target.h"
+#include "util.h"
+
+#define	TARGET_MIN	64U
+
+#ifndef MAX
+#define	MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+static target_t **target_by_atom;	/* indexed by atom_t */
+static size_t target_atomalloc;
+static target_t **target_list;		/* in the order they were created */
+static size_t target_n;
+static size_t target_alloc;
+
+/*
+ * The deps and cmds arrays of a target grow by doubling (from 4), so their
+ * allocated size follows from the count.
+ */
+static size_t
+target_arr_size(size_t n)
+{
+	size_t size = 4;
+
+	while (size < n)
+		size *= 2;
+	return (size);
+}
+
+/*
+ * Return the target named name, or NULL if no such target has been
+ * created.
+ */
+target_t *
+target_get(atom_t name)
+{
+	if (name == ATOM_NONE || name >= target_atomalloc)
+		return (NULL);
+	return (target_by_atom[name]);
+}
+
+target_t *
+target_lookup_add(atom_t name, bookmark_t src)
+{
+	target_t *t = target_get(name);
+
+	if (t != NULL)
+		return (t);
+
+	VERIFY3U(name, !=, ATOM_NONE);
+	VERIFY3U(target_n, <, UINT32_MAX);
+
+	if (name >= target_atomalloc) {
+		size_t newn = MAX(target_atomalloc, TARGET_MIN);
+
+		while (newn <= name)
+			newn *= 2;
+
+		target_by_atom = xrealloc(target_by_atom,
+		    target_atomalloc * sizeof (target_t *),
+		    newn * sizeof (target_t *));
+		target_atomalloc = newn;
+	}
+
+	if (target_n == target_alloc) {
+		size_t newn = MAX(target_alloc * 2, TARGET_MIN);
+
+		target_list = xrealloc(target_list,
+		    target_alloc * sizeof (target_t *),
+		    newn * sizeof (target_t *));
+		target_alloc = newn;
+	}
+
+	t = zalloc(sizeof (*t));
+	t->name = name;
+	t->src = src;
+
+	target_by_atom[name] = t;
+	target_list[target_n++] = t;
+	return (t);
+}
+
+/* t depends on dep */
+void
+target_dep_add(target_t *t, target_t *dep, bookmark_t src)
+{
+	dependency_t *d = zalloc(sizeof (*d));
+
+	d->target = dep;
+	d->src = src;
+
+	if (t->ndeps == 0 || t->ndeps == target_arr_size(t->ndeps)) {
+		t->deps = xrealloc(t->deps, t->ndeps * sizeof (dependency_t *),
+		    target_arr_size(t->ndeps + 1) * sizeof (dependency_t *));
+	}
+	t->deps[t->ndeps++] = d;
+}
+
+void
+target_cmd_add(target_t *t, const char *cmd, bookmark_t src)
+{
+	cmd_t *c = zalloc(sizeof (*c));
+
+	c->cmd = xstrdup(cmd);
+	c->src = src;
+
+	if (t->ncmds == 0 || t->ncmds == target_arr_size(t->ncmds)) {
+		t->cmds = xrealloc(t->cmds, t->ncmds * sizeof (cmd_t *),
+		    target_arr_size(t->ncmds + 1) * sizeof (cmd_t *));
+	}
+	t->cmds[t->ncmds++] = c;
+}
+
+size_t
+target_count(void)
+{
+	return (target_n);
+}
+
+/*
+ * Count the distinct dependencies of each target.  seen[j] is the last
+ * target found to depend on j, so a repeated dependency is only counted
+ * once.
+ */
+static size_t
+target_graph_count(target_graph_t *tg, uint32_t *seen)
+{
+	size_t nedges = 0;
+
+	for (size_t i = 0; i < tg->tg_n; i++) {
+		const target_t *t = tg->tg_targets[i];
+
+		for (size_t k = 0; k < t->ndeps; k++) {
+			uint32_t j = t->deps[k]->target->id;
+
+			if (seen[j] == i)
+				continue;
+			seen[j] = (uint32_t)i;
+
+			tg->tg_deps_off[i + 1]++;
+			tg->tg_rdeps_off[j + 1]++;
+			nedges++;
+		}
+	}
+
+	/* Turn the counts into offsets */
+	for (size_t i = 0; i < tg->tg_n; i++) {
+		tg->tg_deps_off[i + 1] += tg->tg_deps_off[i];
+		tg->tg_rdeps_off[i + 1] += tg->tg_rdeps_off[i];
+	}
+
+	return (nedges);
+}
+
+/*
+ * Build the frozen form of the dependency graph.  Targets are numbered in
+ * the order they were created.  The graph refers to the targets, but
+ * doesn't own them.
+ */
+target_graph_t *
+target_graph_freeze(void)
+{
+	target_graph_t *tg = zalloc(sizeof (*tg));
+	uint32_t *seen = NULL;
+	uint32_t *next = NULL;
+
+	tg->tg_n = target_n;
+	tg->tg_targets = xcalloc(target_n + 1, sizeof (target_t *));
+	tg->tg_deps_off = xcalloc(target_n + 1, sizeof (uint32_t));
+	tg->tg_rdeps_off = xcalloc(target_n + 1, sizeof (uint32_t));
+
+	for (size_t i = 0; i < target_n; i++) {
+		tg->tg_targets[i] = target_list[i];
+		target_list[i]->id = (uint32_t)i;
+	}
+
+	seen = xcalloc(target_n + 1, sizeof (uint32_t));
+	(void) memset(seen, 0xff, (target_n + 1) * sizeof (uint32_t));
+
+	tg->tg_nedges = target_graph_count(tg, seen);
+	VERIFY3U(tg->tg_nedges, <, UINT32_MAX);
+	tg->tg_deps = xcalloc(tg->tg_nedges + 1, sizeof (uint32_t));
+	tg->tg_rdeps = xcalloc(tg->tg_nedges + 1, sizeof (uint32_t));
+
+	/* Where the next dependent of each target goes in tg_rdeps */
+	next = xcalloc(target_n + 1, sizeof (uint32_t));
+	(void) memcpy(next, tg->tg_rdeps_off,
+	    (target_n + 1) * sizeof (uint32_t));
+	(void) memset(seen, 0xff, (target_n + 1) * sizeof (uint32_t));
+
+	for (size_t i = 0; i < tg->tg_n; i++) {
+		const target_t *t = tg->tg_targets[i];
+		uint32_t out = tg->tg_deps_off[i];
+
+		for (size_t k = 0; k < t->ndeps; k++) {
+			uint32_t j = t->deps[k]->target->id;
+
+			if (seen[j] == i)
+				continue;
+			seen[j] = (uint32_t)i;
+
+			tg->tg_deps[out++] = j;
+			tg->tg_rdeps[next[j]++] = (uint32_t)i;
+		}
+		VERIFY3U(out, ==, tg->tg_deps_off[i + 1]);
+	}
+
+	cfree(next, target_n + 1, sizeof (uint32_t));
+	cfree(seen, target_n + 1, sizeof (uint32_t));
+	return (tg);
+}
+
+void
+target_graph_free(target_graph_t *tg)
+{
+	if (tg == NULL)
+		return;
+
+	cfree(tg->tg_targets, tg->tg_n + 1, sizeof (target_t *));
+	cfree(tg->tg_deps_off, tg->tg_n + 1, sizeof (uint32_t));
+	cfree(tg->tg_rdeps_off, tg->tg_n + 1, sizeof (uint32_t));
+	cfree(tg->tg_deps, tg->tg_nedges + 1, sizeof (uint32_t));
+	cfree(tg->tg_rdeps, tg->tg_nedges + 1, sizeof (uint32_t));
+	umem_free(tg, sizeof (*tg));
+}
+
+/* The dependencies of target id, and their number in *np */
+const uint32_t *
+target_graph_deps(const target_graph_t *tg, uint32_t id, size_t *np)
+{
+	*np = tg->tg_deps_off[id + 1] - tg->tg_deps_off[id];
+	return (&tg->tg_deps[tg->tg_deps_off[id]]);
+}
+
+/* The targets that depend on target id, and their number in *np */
+const uint32_t *
+target_graph_rdeps(const target_graph_t *tg, uint32_t id, size_t *np)
+{
+	*np = tg->tg_rdeps_off[id + 1] - tg->tg_rdeps_off[id];
+	return (&tg->tg_rdeps[tg->tg_rdeps_off[id]]);
+}
+
+/*
+ * Fill order (which must have room for tg_n ids) with the targets of tg
+ * ordered so that every target comes after all of its dependencies.
+ * Returns B_FALSE if the graph has a cycle, in which case the targets on
+ * (or depending on) a cycle are left out of order.
+ */
+boolean_t
+target_graph_order(const target_graph_t *tg, uint32_t *order)
+{
+	uint32_t *ndeps = xcalloc(tg->tg_n + 1, sizeof (uint32_t));
+	size_t head = 0, tail = 0;
+
+	/* order doubles as the queue of targets that are ready */
+	for (size_t i = 0; i < tg->tg_n; i++) {
+		ndeps[i] = tg->tg_deps_off[i + 1] - tg->tg_deps_off[i];
+		if (ndeps[i] == 0)
+			order[tail++] = (uint32_t)i;
+	}
+
+	while (head < tail) {
+		uint32_t id = order[head++];
+
+		for (uint32_t k = tg->tg_rdeps_off[id];
+		    k < tg->tg_rdeps_off[id + 1]; k++) {
+			uint32_t r = tg->tg_rdeps[k];
+
+			if (--ndeps[r] == 0)
+				order[tail++] = r;
+		}
+	}
+
+	cfree(ndeps, tg->tg_n + 1, sizeof (uint32_t));
+	return ((tail == tg->tg_n) ? B_TRUE : B_FALSE);
+}
@@ -16,7 +16,9 @@
 #ifndef _TARGET_H
 #define	_TARGET_H
 
+#include <stdint.h>
 #include <sys/types.h>
+#include "atom.h"
 #include "input.h"
 
 #ifdef __cplusplus
@@ -25,7 +27,7 @@ extern "C" {
 
 struct target;
 struct dependency;
-struct cmd;
+struct command;
 
 typedef struct dependency {
 	struct target *target;
@@ -34,10 +36,13 @@ typedef struct dependency {
 
 typedef struct target {
 	bookmark_t src;
-	char *name;
+	atom_t name;
 	struct dependency **deps;
-	struct cmd **cmds;
+	size_t ndeps;
+	struct command **cmds;
+	size_t ncmds;
 	boolean_t phony;
+	uint32_t id;		/* in the frozen graph */
 } target_t;
 
 typedef struct command {
@@ -45,6 +50,35 @@ typedef struct command {
 	bookmark_t src;
 } cmd_t;
 
+/*
+ * The dependency graph, frozen into compressed sparse row (CSR) form.
+ * Targets are numbered 0..tg_n-1 (target_t.id), and the dependencies of
+ * target i are tg_deps[tg_deps_off[i] .. tg_deps_off[i + 1] - 1] (and
+ * likewise for the targets that depend on it, in tg_rdeps).
+ */
+typedef struct target_graph {
+	size_t		tg_n;
+	size_t		tg_nedges;
+	target_t	**tg_targets;	/* by id */
+	uint32_t	*tg_deps_off;	/* tg_n + 1 entries */
+	uint32_t	*tg_deps;
+	uint32_t	*tg_rdeps_off;	/* tg_n + 1 entries */
+	uint32_t	*tg_rdeps;
+} target_graph_t;
+
+target_t *target_get(atom_t);
+target_t *target_lookup_add(atom_t, bookmark_t);
+void target_dep_add(target_t *, target_t *, bookmark_t);
+void target_cmd_add(target_t *, const char *, bookmark_t);
+size_t target_count(void);
+
+target_graph_t *target_graph_freeze(void);
+void target_graph_free(target_graph_t *);
+boolean_t target_graph_order(const target_graph_t *, uint32_t *);
+const uint32_t *target_graph_deps(const target_graph_t *, uint32_t, size_t *);
+const uint32_t *target_graph_rdeps(const target_graph_t *, uint32_t,
+    size_t *);
+
 #ifdef __cplusplus
 }
 #endif
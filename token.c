@@ -13,19 +13,38 @@
  * Copyright 2018 Jason King
  */
 #include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/debug.h>
 #include <sys/types.h>
 #include <umem.h>
+#include <unistd.h>
 
 #include "custr.h"
 #include "input.h"
 #include "make.h"
+#include "prefetch.h"
 #include "token.h"
 #include "util.h"
 
 #define	ARRAY_SIZE(x) (sizeof (x) / sizeof (x[0]))
+#ifndef MAX
+#define	MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+/*
+ * The body of the tokenizer is instantiated once per make style, and must be
+ * inlined into each instance for the style specific code to be resolved at
+ * compile time (regardless of the optimization level).
+ */
+#ifdef __GNUC__
+#define	TOK_INLINE	inline __attribute__((always_inline))
+#else
+#define	TOK_INLINE	inline
+#endif
 
 enum tok_flags {
 	TF_NONE		= 0,
@@ -66,7 +85,7 @@ static struct tok_word {
 	{ ".endif",	TOK_ENDIF,		TF_BSD },
 	{ ".include",	TOK_INCLUDE,		TF_BSD },
 	{ ".-include",	TOK_INCLUDE,		TF_BSD },
-	{ "include",	TOK_INCLUDE,		TF_SYSV|TF_GNU },
+	{ "include",	TOK_INCLUDE,		TF_ILLUMOS|TF_SYSV|TF_GNU },
 	{ "-include",	TOK_INCLUDE,		TF_GNU },
 	{ "define",	TOK_DEFINE,		TF_GNU },
 	{ "endef",	TOK_ENDDEF,		TF_GNU },
@@ -76,95 +95,374 @@ static struct tok_word {
 	{ "endif",	TOK_ENDIF,		TF_GNU },
 };
 
-static const char sep_nl[] = "\n";
-static const char tgt_sep_sysv[] = " \t\n+=:";
+/*
+ * The keywords valid for each make style are placed into a small hash
+ * table (one per style), so recognizing a keyword at the start of a line
+ * is a single probe instead of a scan of twtbl.  KW_HASH() is a perfect
+ * hash for every style's subset of twtbl (which is checked when the tables
+ * are built).  If a new keyword collides with an existing one, different
+ * multipliers will need to be chosen.  Every keyword is at least 3
+ * characters long, so the characters used by KW_HASH() always exist.
+ */
+#define	KW_HASH_SIZE	64U
+#define	KW_MINLEN	3U
+#define	KW_HASH(s, len) \
+	(((len) + 5U * (uchar_t)(s)[1] + 9U * (uchar_t)(s)[(len) - 2]) & \
+	(KW_HASH_SIZE - 1))
+
+typedef struct kw_table {
+	const struct tok_word	*kt_slots[KW_HASH_SIZE];
+	size_t			kt_maxlen;
+} kw_table_t;
+
+/*
+ * The keyword tables for every style are built together on first use.
+ * Files may be tokenized from multiple threads (see prefetch.c), so this is
+ * done via pthread_once().
+ */
+static kw_table_t kw_tables[MS_NSTYLES];
+static pthread_once_t kw_tables_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Character classes used when scanning spans of input.  Each separator set
+ * used by the tokenizer is a bit in a class table, so testing if a character
+ * ends a span is a single table lookup (instead of e.g. strchr(sep, c)).
+ * Where the sets differ between make styles, each style has its own table
+ * (see tok_styles below).
+ */
+#define	CC_NL		(1U << 0)	/* \n (end of recipe, comment) */
+#define	CC_TGT		(1U << 1)	/* end of target or macro name */
+#define	CC_WORD		(1U << 2)	/* " \t\n" (end of a word) */
+#define	CC_WS		(1U << 3)	/* " \t" (whitespace) */
+#define	CC_SEP		(1U << 4)	/* separator (is_separator()) */
+
+#define	CCLASS_COMMON						\
+	['\n'] =	CC_NL | CC_TGT | CC_WORD | CC_SEP,		\
+	[' '] =		CC_TGT | CC_WORD | CC_WS | CC_SEP,	\
+	['\t'] =	CC_TGT | CC_WORD | CC_WS | CC_SEP,		\
+	['+'] =		CC_TGT | CC_SEP,			\
+	['='] =		CC_TGT | CC_SEP,			\
+	[':'] =		CC_TGT | CC_SEP,			\
+	['$'] =		CC_SEP,					\
+	[';'] =		CC_SEP
 
+#define	IS_CLASS(cc, c, cls) (((cc)[(uchar_t)(c)] & (cls)) != 0)
+
+/*
+ * Everything about the tokenizer that varies by make style.  Rather than
+ * testing the make style as each character is classified, the tokenizer is
+ * instantiated once per style (see TOK_SCAN_DEFINE below) with a constant
+ * tok_style_t, so the compiler can resolve all of the style specific
+ * behavior when building each instance.  The instance to use is then
+ * selected once, when a tokenizer is created.
+ */
+typedef struct tok_style {
+	make_style_t	ts_style;
+	enum tok_flags	ts_flags;	/* which keywords are valid */
+	uint8_t		ts_cclass[256];
+} tok_style_t;
+
+static const tok_style_t tok_styles[MS_NSTYLES] = {
+	[MS_ILLUMOS] = {
+		.ts_style = MS_ILLUMOS,
+		.ts_flags = TF_ILLUMOS,
+		.ts_cclass = { CCLASS_COMMON },
+	},
+	[MS_SYSV] = {
+		.ts_style = MS_SYSV,
+		.ts_flags = TF_SYSV,
+		.ts_cclass = { CCLASS_COMMON },
+	},
+	[MS_POSIX] = {
+		.ts_style = MS_POSIX,
+		.ts_flags = TF_POSIX,
+		.ts_cclass = { CCLASS_COMMON },
+	},
+	[MS_BSD] = {
+		.ts_style = MS_BSD,
+		.ts_flags = TF_BSD,
+		.ts_cclass = {
+			CCLASS_COMMON,
+			['!'] =	CC_TGT | CC_SEP,
+			['?'] =	CC_TGT | CC_SEP,
+		},
+	},
+	[MS_GNU] = {
+		.ts_style = MS_GNU,
+		.ts_flags = TF_GNU,
+		.ts_cclass = {
+			CCLASS_COMMON,
+			['?'] =	CC_TGT | CC_SEP,
+			['|'] =	CC_TGT | CC_SEP,
+		},
+	},
+};
+
+/*
+ * Recipes and comments are the bulk of most makefiles, and only end at a
+ * newline.  For those, we can skip ahead through the input SCAN_BLOCK bytes
+ * at a time looking for the next newline or backslash (which may escape a
+ * newline).
+ */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define	SCAN_BLOCK	32U
+
+static inline uint32_t
+nl_bs_mask(const char *p)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i *)p);
+	__m256i nl = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'));
+	__m256i bs = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'));
+
+	return ((uint32_t)_mm256_movemask_epi8(_mm256_or_si256(nl, bs)));
+}
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define	SCAN_BLOCK	16U
+
+static inline uint32_t
+nl_bs_mask(const char *p)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+	__m128i nl = _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'));
+	__m128i bs = _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'));
+
+	return ((uint32_t)_mm_movemask_epi8(_mm_or_si128(nl, bs)));
+}
+#endif
+
+/* Return the first newline or backslash in [p, end), or end if none */
+static inline const char *
+skip_to_nl(const char *p, const char *end)
+{
+#ifdef SCAN_BLOCK
+	while ((size_t)(end - p) >= SCAN_BLOCK) {
+		uint32_t mask = nl_bs_mask(p);
+
+		if (mask != 0)
+			return (p + __builtin_ctz(mask));
+		p += SCAN_BLOCK;
+	}
+#endif
+	for (; p < end; p++) {
+		if (*p == '\n' || *p == '\\')
+			break;
+	}
+	return (p);
+}
+
+/*
+ * The tokens of an input.  Since the tokens depend on the make style in
+ * effect when they were produced, an input keeps a separate token stream
+ * for each style (see input_tokens()).
+ *
+ * Rather than an array of token_t's, the tokens are stored as parallel
+ * arrays (columns) of their fields, with positions stored as 32-bit offsets
+ * relative to the start of ta_src.  As tok_val always immediately follows
+ * the leading whitespace of a token, only the offset of the whitespace is
+ * kept.  This is 13 bytes per token instead of the 48 of a token_t, and
+ * keeps scans of a single field (e.g. looking for the next TOK_NL) dense.
+ * tok_get() reconstitutes a token_t from the columns.
+ *
+ * The columns are split into fixed size chunks of TOKEN_CHUNK tokens.  Once
+ * allocated, a chunk never moves, so appending a token never copies any
+ * existing tokens (only the much smaller ta_chunks directory of chunk
+ * pointers is grown, geometrically), and token N is always found in
+ * ta_chunks[N / TOKEN_CHUNK].
+ */
 #define	TOKEN_CHUNK	1024U
-typedef struct tok_array {
-	token_t	*ta_tokens;
-	size_t	ta_n;
-	size_t	ta_alloc;
-} tok_array_t;
+#define	TOKEN_DIR_MIN	8U
+
+struct tok_chunk {
+	uint32_t	tc_off[TOKEN_CHUNK];	/* offset of leading ws */
+	uint32_t	tc_wslen[TOKEN_CHUNK];	/* length of leading ws */
+	uint32_t	tc_len[TOKEN_CHUNK];	/* length of value */
+	uint8_t		tc_type[TOKEN_CHUNK];	/* token_type_t */
+};
+
+struct tok_array {
+	struct input	*ta_src;
+	tok_chunk_t	**ta_chunks;
+	size_t		ta_nchunks;	/* # of chunks allocated */
+	size_t		ta_diralloc;	/* # of entries in ta_chunks */
+	size_t		ta_n;		/* # of tokens */
+};
+
+static tok_chunk_t *
+tok_chunk_append(tok_array_t *ta)
+{
+	if (ta->ta_nchunks == ta->ta_diralloc) {
+		size_t newn = MAX(ta->ta_diralloc * 2, TOKEN_DIR_MIN);
+
+		ta->ta_chunks = xrealloc(ta->ta_chunks,
+		    ta->ta_diralloc * sizeof (tok_chunk_t *),
+		    newn * sizeof (tok_chunk_t *));
+		ta->ta_diralloc = newn;
+	}
+
+	ta->ta_chunks[ta->ta_nchunks] = zalloc(sizeof (tok_chunk_t));
+	return (ta->ta_chunks[ta->ta_nchunks++]);
+}
 
 static void
-tok_reserve(tok_array_t *ta, size_t n)
+tok_append(tok_array_t *ta, const token_t *t)
 {
-	if (ta->ta_n + n < ta->ta_alloc)
-		return;
+	const char *base = input_line(ta->ta_src, 0);
+	tok_chunk_t *tc = NULL;
+	size_t i = ta->ta_n % TOKEN_CHUNK;
 
-	size_t oldlen = ta->ta_alloc * sizeof (token_t);
-	size_t newlen = (ta->ta_alloc + TOKEN_CHUNK) * sizeof (token_t);
+	ASSERT3P(t->tok_src, ==, ta->ta_src);
+	ASSERT3P(t->tok_ws + t->tok_wslen, ==, t->tok_val);
 
-	ta->ta_tokens = xrealloc(ta->ta_tokens, oldlen, newlen);
-	ta->ta_alloc += TOKEN_CHUNK;
+	if (ta->ta_n == ta->ta_nchunks * TOKEN_CHUNK)
+		tc = tok_chunk_append(ta);
+	else
+		tc = ta->ta_chunks[ta->ta_n / TOKEN_CHUNK];
+
+	tc->tc_off[i] = (uint32_t)(t->tok_ws - base);
+	tc->tc_wslen[i] = (uint32_t)t->tok_wslen;
+	tc->tc_len[i] = (uint32_t)t->tok_len;
+	tc->tc_type[i] = (uint8_t)t->tok_type;
+	ta->ta_n++;
 }
 
-static token_t *
-tok_next(tok_array_t *ta)
+static void
+tok_chunk_get(const tok_array_t *ta, const tok_chunk_t *tc, size_t i,
+    token_t *t)
 {
-	tok_reserve(ta, 1);
-	return (&ta->ta_tokens[ta->ta_n++]);
+	t->tok_src = ta->ta_src;
+	t->tok_ws = input_line(ta->ta_src, 0) + tc->tc_off[i];
+	t->tok_wslen = tc->tc_wslen[i];
+	t->tok_val = t->tok_ws + t->tok_wslen;
+	t->tok_len = tc->tc_len[i];
+	t->tok_type = tc->tc_type[i];
 }
 
-static boolean_t
-is_separator(const make_t *mk, int c)
+/*
+ * Fill in t with token number idx of ta.  Returns B_FALSE if idx is past
+ * the end of ta.
+ */
+boolean_t
+tok_get(const tok_array_t *ta, size_t idx, token_t *t)
 {
-	switch (c) {
-	case '\n':
-	case '\t':
-	case ' ':
-	case ':':
-	case '+':
-	case '=':
-	case '$':
-	case ';':
-		return (B_TRUE);
-	case '!':
-		if (mk->mk_style & MS_BSD)
-			return (B_TRUE);
-		return (B_FALSE);
-	case '?':
-		if (mk->mk_style & (MS_BSD|MS_GNU))
-			return (B_TRUE);
-		return (B_FALSE);
-	case '|':
-		if (mk->mk_style & (MS_GNU))
-			return (B_TRUE);
+	if (idx >= ta->ta_n)
 		return (B_FALSE);
+
+	tok_chunk_get(ta, ta->ta_chunks[idx / TOKEN_CHUNK], idx % TOKEN_CHUNK,
+	    t);
+	return (B_TRUE);
+}
+
+/*
+ * Sequential iteration of the tokens of a tok_array_t.  This walks the
+ * chunks directly, so it is the preferred way to visit every token.
+ */
+void
+tok_iter_init(tok_iter_t *ti, const tok_array_t *ta)
+{
+	ti->ti_ta = ta;
+	ti->ti_chunk = 0;
+	ti->ti_idx = 0;
+}
+
+boolean_t
+tok_iter_next(tok_iter_t *ti, token_t *t)
+{
+	const tok_array_t *ta = ti->ti_ta;
+	size_t remain = ta->ta_n - ti->ti_chunk * TOKEN_CHUNK;
+
+	if (ti->ti_idx == TOKEN_CHUNK) {
+		ti->ti_chunk++;
+		ti->ti_idx = 0;
+		remain -= TOKEN_CHUNK;
 	}
-	return (B_FALSE);
+
+	if (ti->ti_chunk >= ta->ta_nchunks || ti->ti_idx >= remain)
+		return (B_FALSE);
+
+	tok_chunk_get(ta, ta->ta_chunks[ti->ti_chunk], ti->ti_idx++, t);
+	return (B_TRUE);
 }
 
-static boolean_t
-parse_start_of_line(const char **p, const char *end, token_t *t)
+token_type_t
+tok_type(const tok_array_t *ta, size_t idx)
+{
+	VERIFY3U(idx, <, ta->ta_n);
+	return (ta->ta_chunks[idx / TOKEN_CHUNK]->tc_type[idx % TOKEN_CHUNK]);
+}
+
+static inline boolean_t
+is_separator(const tok_style_t *ts, int c)
+{
+	return (IS_CLASS(ts->ts_cclass, c, CC_SEP));
+}
+
+static void
+kw_table_build(make_style_t style)
 {
-	size_t plen = (size_t)(end - *p);
+	kw_table_t *kt = &kw_tables[style];
 
 	for (size_t i = 0; i < ARRAY_SIZE(twtbl); i++) {
-		struct tok_word *tw = &twtbl[i];
+		const struct tok_word *tw = &twtbl[i];
 		size_t len = strlen(tw->tw_str);
+		size_t h;
 
-		if (len > plen)
+		if ((tw->tw_flags & tok_styles[style].ts_flags) == 0)
 			continue;
 
-		if (strncmp(*p, tw->tw_str, len) != 0)
-			continue;
+		VERIFY3U(len, >=, KW_MINLEN);
+		h = KW_HASH(tw->tw_str, len);
 
-		/*
-		 * Is keyword (e.g. '.if') followed by space or tab?
-		 * Used to distinguish '.if' vs. '.ifdef', etc.
-		 */
-		if ((*p + len > end) || ((*p)[len] != ' ' && (*p)[len] != '\t'))
-			continue;
+		/* Collision -- KW_HASH() needs to be adjusted */
+		VERIFY3P(kt->kt_slots[h], ==, NULL);
+
+		kt->kt_slots[h] = tw;
+		if (len > kt->kt_maxlen)
+			kt->kt_maxlen = len;
+	}
+}
 
-		t->tok_val = *p;
-		t->tok_len = len;
-		t->tok_type = tw->tw_type;
-		*p += len;
-		return (B_TRUE);
+static void
+kw_tables_init(void)
+{
+	for (make_style_t style = 0; style < MS_NSTYLES; style++)
+		kw_table_build(style);
+}
+
+static inline boolean_t
+parse_start_of_line(const kw_table_t *kt, const char **p, const char *end,
+    token_t *t)
+{
+	const struct tok_word *tw = NULL;
+	const char *s = *p;
+	size_t len = 0;
+
+	/*
+	 * A keyword must be followed by whitespace (or the end of the line).
+	 * This is used to distinguish '.if' vs. '.ifdef', etc.
+	 */
+	while (s + len < end && len <= kt->kt_maxlen) {
+		char c = s[len];
+
+		if (c == ' ' || c == '\t' || c == '\n')
+			break;
+		len++;
 	}
 
-	return (B_FALSE);
+	if (len < KW_MINLEN || len > kt->kt_maxlen)
+		return (B_FALSE);
+
+	tw = kt->kt_slots[KW_HASH(s, len)];
+	if (tw == NULL || tw->tw_str[len] != '\0' ||
+	    strncmp(s, tw->tw_str, len) != 0)
+		return (B_FALSE);
+
+	t->tok_val = *p;
+	t->tok_len = len;
+	t->tok_type = tw->tw_type;
+	*p += len;
+	return (B_TRUE);
 }
 
 static boolean_t
@@ -230,24 +528,35 @@ done:
 	return (B_TRUE);
 }
 
-static void
-parse_span(const char **pp, const char *end, const char *sep, token_t *t)
+/*
+ * Scan a span of input up to (but not including) the first unescaped
+ * character in any of the character classes in cls.
+ */
+static inline void
+parse_span(const char **pp, const char *end, const uint8_t *cc, uint_t cls,
+    token_t *t)
 {
-	const char *p = NULL;
-	boolean_t litnext = B_FALSE;
+	const char *p = *pp;
 
-	for (t->tok_val = p = *pp; p < end; p++) {
-		if (litnext) {
-			litnext = B_FALSE;
-			continue;
-		}
+	t->tok_val = p;
+
+	if (cls == CC_NL) {
+		while ((p = skip_to_nl(p, end)) < end && *p == '\\')
+			p = (p + 2 < end) ? p + 2 : end;
+		goto done;
+	}
+
+	for (; p < end; p++) {
 		if (*p == '\\') {
-			litnext = B_TRUE;
+			if (++p == end)
+				break;
 			continue;
 		}
-		if (strchr(sep, *p) != NULL)
+		if (IS_CLASS(cc, *p, cls))
 			break;
 	}
+
+done:
 	t->tok_len = (size_t)(p - t->tok_val);
 	*pp = p;
 }
@@ -261,7 +570,7 @@ parse_comment(const char **pp, const char *end, token_t *t)
 		return (B_FALSE);
 
 	t->tok_type = TOK_COMMENT;
-	parse_span(pp, end, sep_nl, t);
+	parse_span(pp, end, NULL, CC_NL, t);
 	return (B_TRUE);
 }
 
@@ -269,11 +578,12 @@ static void
 parse_recipe(const char **pp, const char *end, token_t *t)
 {
 	t->tok_type = TOK_RECIPE;
-	parse_span(pp, end, sep_nl, t);
+	parse_span(pp, end, NULL, CC_NL, t);
 }
 
-static void
-absorb_whitespace(const char **pp, const char *end, token_t *t)
+static inline void
+absorb_whitespace(const char **pp, const char *end, const uint8_t *cc,
+    token_t *t)
 {
 	const char *p;
 
@@ -282,7 +592,7 @@ absorb_whitespace(const char **pp, const char *end, token_t *t)
 			p++;
 			continue;
 		}
-		if (*p != ' ' && *p != '\t')
+		if (!IS_CLASS(cc, *p, CC_WS))
 			break;
 	}
 	t->tok_wslen = (size_t)(p - t->tok_ws);
@@ -290,152 +600,615 @@ absorb_whitespace(const char **pp, const char *end, token_t *t)
 	*pp = p;
 }
 
-static void tok_print(token_t *);
+void
+tok_array_free(tok_array_t *ta)
+{
+	if (ta == NULL)
+		return;
+
+	for (size_t i = 0; i < ta->ta_nchunks; i++)
+		umem_free(ta->ta_chunks[i], sizeof (tok_chunk_t));
+	cfree(ta->ta_chunks, ta->ta_diralloc, sizeof (tok_chunk_t *));
+	umem_free(ta, sizeof (*ta));
+}
 
-#define	START_OF_LINE(tp) ((tp) == NULL || (tp)->tok_type == TOK_NL)
-boolean_t
+size_t
+tok_array_len(const tok_array_t *ta)
+{
+	return (ta->ta_n);
+}
+
+static boolean_t tokenize_input(make_t *, input_t *, tok_array_t *);
+
+/*
+ * Return the tokens for in.  The tokens are saved with in, so an input that
+ * is used multiple times (e.g. an included file) is only tokenized once for
+ * each make style.  The returned tok_array_t is owned by in, and remains
+ * valid for as long as in does.
+ */
+tok_array_t *
 tokenize(make_t *mk, input_t *in)
 {
-	const char *p = input_line(in, 0);
-	const char *end = input_line(in, input_numlines(in));
-	token_t *t = NULL, *tprev = NULL;
-	tok_array_t ta = { 0 };
+	tok_array_t *ta = NULL;
+	size_t len;
 
-	while (p < end) {
-		tprev = t;
+	if ((ta = input_tokens(in, mk->mk_style)) != NULL)
+		return (ta);
 
-		t = tok_next(&ta);
-		t->tok_src = in;
+	/* Offsets into the input are kept as 32-bit values */
+	len = (size_t)(input_line(in, input_numlines(in)) - input_line(in, 0));
+	if (len > UINT32_MAX) {
+		(void) fprintf(stderr, _("%s: file is too large\n"),
+		    input_name(in));
+		return (NULL);
+	}
 
-		if (tprev != NULL)
-			tok_print(tprev);
+	ta = zalloc(sizeof (*ta));
+	ta->ta_src = in;
 
-		if (START_OF_LINE(tprev)) {
-			if (*p == '\t') {
-				t->tok_ws = p++;
-				t->tok_wslen = 1;
-				t->tok_val = p;
-				parse_recipe(&p, end, t);
-				continue;
-			}
+	if (!tokenize_input(mk, in, ta)) {
+		tok_array_free(ta);
+		return (NULL);
+	}
 
-			absorb_whitespace(&p, end, t);
-			if (p == end)
-				break;
+	return (input_set_tokens(in, mk->mk_style, ta));
+}
 
-			if (parse_start_of_line(&p, end, t))
-				continue;
-			if (parse_variable(&p, end, t, 0))
-				continue;
-			if (parse_comment(&p, end, t))
-				continue;
+/*
+ * Scan the next token from *pp into t.  sol indicates if *pp is at the start
+ * of a line.  Returns 1 if a token was found, 0 if only whitespace remained
+ * before end, or -1 on error.
+ */
+static TOK_INLINE int
+tok_scan(const tok_style_t *ts, const char **pp, const char *end,
+    boolean_t sol, token_t *t)
+{
+	const uint8_t *cc = ts->ts_cclass;
+	const kw_table_t *kt = &kw_tables[ts->ts_style];
+	const char *p = *pp;
 
-			t->tok_type = TOK_STRING;
-			parse_span(&p, end, tgt_sep_sysv, t);
-			continue;
+	(void) memset(t, 0, sizeof (*t));
+
+	if (sol) {
+		if (*p == '\t') {
+			t->tok_ws = p++;
+			t->tok_wslen = 1;
+			t->tok_val = p;
+			parse_recipe(&p, end, t);
+			goto done;
 		}
 
-		absorb_whitespace(&p, end, t);
-		t->tok_val = p;
+		absorb_whitespace(&p, end, cc, t);
+		if (p == end)
+			return (0);
 
-		switch (*p) {
-		case '#':
-			VERIFY(parse_comment(&p, end, t));
-			continue;
-		case '$':
-			if (!parse_variable(&p, end, t, 0))
-				return (B_FALSE);
-			continue;
-		case ':':
-			if (p + 1 < end) {
-				if (p[1] == ':') {
-					t->tok_type = TOK_COLONCOLON;
-					t->tok_len = 2;
-					p += 2;
-					continue;
-				} else if (p[1] == '=') {
-					t->tok_type = TOK_COLONEQ;
-					t->tok_len = 2;
-					p += 2;
-					continue;
-				}
-			}
-			t->tok_type = TOK_COLON;
-			t->tok_len = 1;
-			p += 1;
-			continue;
-		case '+':
-			if ((p + 1 < end) && p[1] == '=') {
-				t->tok_type = TOK_PLUSEQ;
-				t->tok_len = 2;
-				p += 2;
-				continue;
-			}
-			t->tok_type = TOK_PLUS;
-			t->tok_len = 1;
-			p++;
-			continue;
-		case ';':
-			t->tok_type = TOK_SEMICOLON;
-			t->tok_len = 1;
-			p++;
-			continue;
-		case '|':
-			if ((p + 1 < end) && p[1] == '|') {
-				t->tok_type = TOK_OR;
+		if (parse_start_of_line(kt, &p, end, t))
+			goto done;
+		if (parse_variable(&p, end, t, 0))
+			goto done;
+		if (parse_comment(&p, end, t))
+			goto done;
+
+		t->tok_type = TOK_STRING;
+		parse_span(&p, end, cc, CC_TGT, t);
+		goto done;
+	}
+
+	absorb_whitespace(&p, end, cc, t);
+	if (p == end)
+		return (0);
+	t->tok_val = p;
+
+	switch (*p) {
+	case '#':
+		VERIFY(parse_comment(&p, end, t));
+		goto done;
+	case '$':
+		if (!parse_variable(&p, end, t, 0))
+			return (-1);
+		goto done;
+	case ':':
+		if (p + 1 < end) {
+			if (p[1] == ':') {
+				t->tok_type = TOK_COLONCOLON;
 				t->tok_len = 2;
 				p += 2;
-				continue;
-			}
-			t->tok_type = TOK_PIPE;
-			t->tok_len = 1;
-			p++;
-			continue;
-		case '=':
-			if ((p + 1 < end) && p[1] == '=') {
-				t->tok_type = TOK_EQUALSEQUALS;
+				goto done;
+			} else if (p[1] == '=') {
+				t->tok_type = TOK_COLONEQ;
 				t->tok_len = 2;
 				p += 2;
-				continue;
+				goto done;
 			}
-			t->tok_type = TOK_EQUALS;
-			t->tok_len = 1;
-			p++;
-			continue;
-		case '?':
-			if (p + 1 == end || p[1] != '=')
-				break;
-			t->tok_type = TOK_QUESEQ;
+		}
+		t->tok_type = TOK_COLON;
+		t->tok_len = 1;
+		p += 1;
+		goto done;
+	case '+':
+		if ((p + 1 < end) && p[1] == '=') {
+			t->tok_type = TOK_PLUSEQ;
 			t->tok_len = 2;
 			p += 2;
-			continue;
-		case '&':
-			if (p + 1 == end || p[1] != '&')
-				break;
-			t->tok_type = TOK_AND;
+			goto done;
+		}
+		t->tok_type = TOK_PLUS;
+		t->tok_len = 1;
+		p++;
+		goto done;
+	case ';':
+		t->tok_type = TOK_SEMICOLON;
+		t->tok_len = 1;
+		p++;
+		goto done;
+	case '|':
+		if ((p + 1 < end) && p[1] == '|') {
+			t->tok_type = TOK_OR;
 			t->tok_len = 2;
 			p += 2;
-			continue;
-		case '\n':
+			goto done;
+		}
+		t->tok_type = TOK_PIPE;
+		t->tok_len = 1;
+		p++;
+		goto done;
+	case '=':
+		if ((p + 1 < end) && p[1] == '=') {
+			t->tok_type = TOK_EQUALSEQUALS;
+			t->tok_len = 2;
+			p += 2;
+			goto done;
+		}
+		t->tok_type = TOK_EQUALS;
+		t->tok_len = 1;
+		p++;
+		goto done;
+	case '!':
+		/* Only a separator (e.g. '!=', 'tgt ! dep') for some styles */
+		if (!is_separator(ts, '!'))
+			break;
+		if ((p + 1 < end) && p[1] == '=') {
+			t->tok_type = TOK_BANGEQ;
+			t->tok_len = 2;
+			p += 2;
+			goto done;
+		}
+		t->tok_type = TOK_BANG;
+		t->tok_len = 1;
+		p++;
+		goto done;
+	case '?':
+		if (p + 1 == end || p[1] != '=')
+			break;
+		t->tok_type = TOK_QUESEQ;
+		t->tok_len = 2;
+		p += 2;
+		goto done;
+	case '&':
+		if (p + 1 == end || p[1] != '&')
+			break;
+		t->tok_type = TOK_AND;
+		t->tok_len = 2;
+		p += 2;
+		goto done;
+	case '\n':
+		p++;
+		while (p < end) {
+			if (*p != '\n')
+				break;
 			p++;
-			while (p < end) {
-				if (*p != '\n')
-					break;
-				p++;
-			}
+		}
+
+		t->tok_type = TOK_NL;
+		if (t->tok_ws != t->tok_val)
+			t->tok_wslen = (size_t)(t->tok_val - t->tok_ws);
+		t->tok_len = (size_t)(p - t->tok_val);
+		goto done;
+	}
+
+	t->tok_type = TOK_STRING;
+	parse_span(&p, end, cc, CC_WORD, t);
+
+done:
+	*pp = p;
+	return (1);
+}
 
-			t->tok_type = TOK_NL;
-			if (t->tok_ws != t->tok_val)
-				t->tok_wslen = (size_t)(t->tok_val - t->tok_ws);
-			t->tok_len = (size_t)(p - t->tok_val);
+/*
+ * Instantiate tok_scan() once for each make style.  Since each instance
+ * passes a constant tok_style_t, the style specific checks in tok_scan()
+ * (and everything it inlines) are resolved at compile time.
+ */
+typedef int (*tok_scan_fn_t)(const char **, const char *, boolean_t,
+    token_t *);
+
+#define	TOK_SCAN_DEFINE(style, name)					\
+static int								\
+tok_scan_##name(const char **pp, const char *end, boolean_t sol,	\
+    token_t *t)								\
+{									\
+	return (tok_scan(&tok_styles[style], pp, end, sol, t));		\
+}
+MAKE_STYLES(TOK_SCAN_DEFINE)
+#undef TOK_SCAN_DEFINE
+
+#define	TOK_SCAN_ENTRY(style, name)	[style] = tok_scan_##name,
+static const tok_scan_fn_t tok_scan_fns[MS_NSTYLES] = {
+	MAKE_STYLES(TOK_SCAN_ENTRY)
+};
+#undef TOK_SCAN_ENTRY
+
+/* Select the tokenizer instance for style */
+static tok_scan_fn_t
+tok_scan_select(make_style_t style)
+{
+	VERIFY3U(style, <, MS_NSTYLES);
+
+	/* Build the keyword tables now, instead of on each use */
+	VERIFY0(pthread_once(&kw_tables_once, kw_tables_init));
+	return (tok_scan_fns[style]);
+}
+
+static boolean_t
+tokenize_input(make_t *mk, input_t *in, tok_array_t *ta)
+{
+	tok_scan_fn_t scan = tok_scan_select(mk->mk_style);
+	const char *p = input_line(in, 0);
+	const char *end = input_line(in, input_numlines(in));
+	token_t t = { 0 };
+	boolean_t sol = B_TRUE;
+	int ret;
+
+	while (p < end) {
+		if ((ret = scan(&p, end, sol, &t)) < 0)
+			return (B_FALSE);
+		if (ret == 0)
+			break;
+
+		t.tok_src = in;
+		tok_append(ta, &t);
+		sol = (t.tok_type == TOK_NL) ? B_TRUE : B_FALSE;
+	}
+
+	return (B_TRUE);
+}
+
+/*
+ * If the len bytes at s (a logical line of in) are an include line, call cb
+ * with its keyword (a TOK_INCLUDE) and then each of its words (as
+ * TOK_STRINGs), and return B_TRUE.  An include line is recognized the same
+ * way tok_scan() does (a keyword at the start of a line that isn't a
+ * recipe).  A comment ends the list of words.
+ */
+boolean_t
+tok_include_line(make_t *mk, input_t *in, const char *s, size_t len,
+    tok_word_cb_t cb, void *arg)
+{
+	const tok_style_t *ts = NULL;
+	const kw_table_t *kt = NULL;
+	const char *p = s;
+	const char *end = s + len;
+	token_t t = { 0 };
+
+	(void) tok_scan_select(mk->mk_style);
+	ts = &tok_styles[mk->mk_style];
+	kt = &kw_tables[mk->mk_style];
+
+	if (p == end || *p == '\t')
+		return (B_FALSE);
+
+	absorb_whitespace(&p, end, ts->ts_cclass, &t);
+	if (p == end || !parse_start_of_line(kt, &p, end, &t) ||
+	    t.tok_type != TOK_INCLUDE)
+		return (B_FALSE);
+
+	t.tok_src = in;
+	cb(&t, arg);
+
+	for (;;) {
+		(void) memset(&t, 0, sizeof (t));
+		absorb_whitespace(&p, end, ts->ts_cclass, &t);
+		if (p == end || *p == '\n' || *p == '#')
+			break;
+
+		t.tok_type = TOK_STRING;
+		t.tok_src = in;
+		parse_span(&p, end, ts->ts_cclass, CC_WORD, &t);
+		cb(&t, arg);
+	}
+
+	return (B_TRUE);
+}
+
+/*
+ * Call tok_include_line() on every line of in, without tokenizing anything
+ * else.  This is only used to look ahead for files to load (see
+ * prefetch.c), so the words after the first line of a continued include
+ * line are missed.
+ */
+void
+tok_includes(make_t *mk, input_t *in, tok_word_cb_t cb, void *arg)
+{
+	size_t nlines = input_numlines(in);
+
+	for (size_t i = 0; i < nlines; i++) {
+		const char *p = input_line(in, i);
+		const char *end = input_line(in, i + 1);
+
+		(void) tok_include_line(mk, in, p, (size_t)(end - p), cb, arg);
+	}
+}
+
+/*
+ * Return the path (which the caller must strfree()) of the file named by t,
+ * a word from an include line of t->tok_src, or NULL if it can't be known
+ * until the line is parsed.  Only literal paths qualify, since macros may
+ * not have their final values until the parser reaches the line.  Paths in
+ * <>'s are searched for along the system include path, so they're skipped
+ * too.
+ */
+char *
+tok_include_path(make_t *mk, const token_t *t)
+{
+	const char *p = t->tok_val;
+	size_t len = t->tok_len;
+
+	if (t->tok_type != TOK_STRING)
+		return (NULL);
+
+	if (len >= 2 && p[0] == '"' && p[len - 1] == '"') {
+		p++;
+		len -= 2;
+	}
+
+	if (len == 0 || len >= PATH_MAX || p[0] == '<' ||
+	    memchr(p, '$', len) != NULL)
+		return (NULL);
+
+	return (input_include_path(t->tok_src, mk->mk_style, p, len));
+}
+
+#define	TOK_INCL_MIN	4U
+
+/*
+ * A tok_word_cb_t that collects the files named on an include line into
+ * arg (a tok_incl_t), and starts prefetching them.  The keyword resets the
+ * list, so one tok_incl_t can be used for every include line of a file.
+ */
+void
+tok_incl_add(const token_t *t, void *arg)
+{
+	tok_incl_t *tl = arg;
+	char *path = NULL;
+
+	if (t->tok_type == TOK_INCLUDE) {
+		tok_incl_reset(tl);
+		/* -include and .-include don't mind a missing file */
+		tl->tl_optional = (memchr(t->tok_val, '-',
+		    t->tok_len) != NULL) ? B_TRUE : B_FALSE;
+		return;
+	}
+
+	if ((path = tok_include_path(tl->tl_mk, t)) == NULL)
+		return;
+
+	prefetch(path);
+
+	if (tl->tl_n == tl->tl_alloc) {
+		size_t newn = MAX(tl->tl_alloc * 2, TOK_INCL_MIN);
+
+		tl->tl_paths = xrealloc(tl->tl_paths,
+		    tl->tl_alloc * sizeof (char *), newn * sizeof (char *));
+		tl->tl_alloc = newn;
+	}
+	tl->tl_paths[tl->tl_n++] = path;
+}
+
+/*
+ * Push the files collected in tl onto iter, so they are read (in the order
+ * they were named) before the rest of the current input.  The current
+ * input must already be positioned just past the include line.
+ */
+void
+tok_incl_push(tok_incl_t *tl, input_iter_t *iter)
+{
+	input_t **ins = NULL;
+	size_t n = 0;
+
+	if (tl->tl_n == 0)
+		return;
+
+	ins = xcalloc(tl->tl_n, sizeof (input_t *));
+	for (size_t i = 0; i < tl->tl_n; i++) {
+		const char *path = tl->tl_paths[i];
+
+		if (tl->tl_optional && access(path, R_OK) != 0)
 			continue;
+		if ((ins[n] = prefetch_input(path)) != NULL)
+			n++;
+	}
+
+	if (n > 0)
+		iter_push_all(iter, ins, n);
+
+	for (size_t i = 0; i < n; i++)
+		input_free(ins[i]);
+	cfree(ins, tl->tl_n, sizeof (input_t *));
+	tok_incl_reset(tl);
+}
+
+void
+tok_incl_reset(tok_incl_t *tl)
+{
+	for (size_t i = 0; i < tl->tl_n; i++)
+		strfree(tl->tl_paths[i]);
+	tl->tl_n = 0;
+}
+
+void
+tok_incl_fini(tok_incl_t *tl)
+{
+	tok_incl_reset(tl);
+	cfree(tl->tl_paths, tl->tl_alloc, sizeof (char *));
+	tl->tl_paths = NULL;
+	tl->tl_alloc = 0;
+}
+
+/*
+ * A pull-based tokenizer.  Rather than producing every token of an input
+ * up front (as tokenize() does), tok_next() scans the next token on demand.
+ * The tokenizer sits on top of an input_iter_t, so the files named on an
+ * include line are pushed when the line ends, and tokens are then produced
+ * from the included files until they are exhausted, after which tokenizing
+ * resumes in the including file.
+ *
+ * tk_p and tk_end point into the input that is currently at the top of
+ * tk_iter.  The position of tk_iter is only updated when we switch inputs
+ * (it tracks lines, while we scan tokens), and so inputs are only pushed
+ * at the start of a line (i.e. after a TOK_NL).
+ */
+struct tokenizer {
+	make_t		*tk_mk;
+	tok_scan_fn_t	tk_scan;
+	input_iter_t	*tk_iter;
+	input_t		*tk_in;		/* input tk_p points into */
+	size_t		tk_depth;	/* depth of tk_in in tk_iter */
+	const char	*tk_p;
+	const char	*tk_end;
+	boolean_t	tk_sol;		/* at start of line */
+	boolean_t	tk_include;	/* in an include line */
+	boolean_t	tk_err;
+	tok_incl_t	tk_incl;	/* files named by the include line */
+};
+
+tokenizer_t *
+tokenizer_new(make_t *mk, input_t *in, iter_cb_t cb, void *arg)
+{
+	tokenizer_t *tk = zalloc(sizeof (*tk));
+
+	tk->tk_mk = mk;
+	tk->tk_scan = tok_scan_select(mk->mk_style);
+	tk->tk_iter = iter_new(in, cb, arg);
+	tk->tk_incl.tl_mk = mk;
+	return (tk);
+}
+
+void
+tokenizer_free(tokenizer_t *tk)
+{
+	if (tk == NULL)
+		return;
+
+	tok_incl_fini(&tk->tk_incl);
+	iter_free(tk->tk_iter);
+	umem_free(tk, sizeof (*tk));
+}
+
+void
+tokenizer_push(tokenizer_t *tk, input_t *in)
+{
+	/* Save where we are in the current input so we can resume there */
+	if (tk->tk_in != NULL)
+		iter_seek(tk->tk_iter, tk->tk_p);
+	tk->tk_in = NULL;
+
+	iter_push(tk->tk_iter, in);
+}
+
+/* The include line ended, so read the files it named next */
+static void
+tokenizer_include(tokenizer_t *tk)
+{
+	tk->tk_include = B_FALSE;
+
+	/*
+	 * Save where we are in the current input so we can resume there.  The
+	 * line might have been the last of the input, so don't look at tk_p
+	 * again until tok_next() has checked which input is on top.
+	 */
+	iter_seek(tk->tk_iter, tk->tk_p);
+	tk->tk_in = NULL;
+	tok_incl_push(&tk->tk_incl, tk->tk_iter);
+}
+
+boolean_t
+tokenizer_error(const tokenizer_t *tk)
+{
+	return (tk->tk_err);
+}
+
+input_iter_t *
+tokenizer_iter(const tokenizer_t *tk)
+{
+	return (tk->tk_iter);
+}
+
+boolean_t
+tok_next(tokenizer_t *tk, token_t *t)
+{
+	input_iter_t *iter = tk->tk_iter;
+	int ret;
+
+	if (tk->tk_err)
+		return (B_FALSE);
+
+	for (;;) {
+		/* Exhausted the current input, let the iterator pop it */
+		if (tk->tk_in != NULL && tk->tk_p == tk->tk_end) {
+			if (tk->tk_include) {
+				/* An include line without a trailing newline */
+				tokenizer_include(tk);
+			} else {
+				iter_seek(iter, tk->tk_end);
+				tk->tk_in = NULL;
+			}
 		}
 
-		t->tok_type = TOK_STRING;
-		parse_span(&p, end, " \t\n", t);
+		/* An input was pushed or popped since the last token */
+		if (tk->tk_in == NULL || tk->tk_in != iter_input(iter) ||
+		    tk->tk_depth != iter_depth(iter)) {
+			tk->tk_p = iter_cursor(iter, &tk->tk_end);
+			if (tk->tk_p == NULL) {
+				tk->tk_in = NULL;
+				return (B_FALSE);
+			}
+			tk->tk_in = iter_input(iter);
+			tk->tk_depth = iter_depth(iter);
+			tk->tk_sol = B_TRUE;
+		}
+
+		ret = tk->tk_scan(&tk->tk_p, tk->tk_end, tk->tk_sol, t);
+		if (ret < 0) {
+			tk->tk_err = B_TRUE;
+			return (B_FALSE);
+		}
+		if (ret > 0)
+			break;
+
+		/* Only whitespace was left in the input, move to the next */
+		tk->tk_p = tk->tk_end;
+	}
+
+	t->tok_src = tk->tk_in;
+	tk->tk_sol = (t->tok_type == TOK_NL) ? B_TRUE : B_FALSE;
+
+	switch (t->tok_type) {
+	case TOK_INCLUDE:
+		tk->tk_include = B_TRUE;
+		tok_incl_add(t, &tk->tk_incl);
+		break;
+	case TOK_NL:
+		if (tk->tk_include)
+			tokenizer_include(tk);
+		break;
+	case TOK_STRING:
+		if (tk->tk_include)
+			tok_incl_add(t, &tk->tk_incl);
+		break;
+	default:
+		break;
 	}
 
-	tok_print(&ta.ta_tokens[ta.ta_n - 1]);
 	return (B_TRUE);
 }
 
@@ -509,16 +1282,11 @@ tok_print_val(const token_t *t, FILE *f, boolean_t ws)
 	(void) fprintf(f, "%.*s%.*s", wslen, wsp, tlen, t->tok_val);
 }
 
-static void
-tok_print(token_t *t)
+void
+tok_print(const token_t *t, FILE *f)
 {
-	static size_t count = 0;
-
-	printf("%s", tok_type_name(t->tok_type));
+	(void) fprintf(f, "%s", tok_type_name(t->tok_type));
 	if (t->tok_type != TOK_NL)
-		printf("('%.*s')", (int)t->tok_len, t->tok_val);
-	fputc('\n', stdout);
-
-	if (++count > 100)
-		exit(1);
+		(void) fprintf(f, "('%.*s')", (int)t->tok_len, t->tok_val);
+	(void) fputc('\n', f);
 }
@@ -18,6 +18,7 @@
 
 #include <stdio.h>
 #include <sys/types.h>
+#include "input.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -87,8 +88,60 @@ typedef struct token {
 	token_type_t	tok_type;	/* type */
 } token_t;
 
-boolean_t tokenize(struct make *, struct input *);
-void tok_print_val(const token_t *, FILE *, boolean_t);
+struct tok_array;
+struct tok_chunk;
+struct tokenizer;
+typedef struct tok_array tok_array_t;
+typedef struct tok_chunk tok_chunk_t;
+typedef struct tokenizer tokenizer_t;
+typedef void (*tok_word_cb_t)(const token_t *, void *);
+
+typedef struct tok_iter {
+	const tok_array_t	*ti_ta;
+	size_t			ti_chunk;	/* current chunk */
+	size_t			ti_idx;		/* index in current chunk */
+} tok_iter_t;
+
+tok_array_t	*tokenize(struct make *, struct input *);
+void		tok_array_free(tok_array_t *);
+size_t		tok_array_len(const tok_array_t *);
+boolean_t	tok_get(const tok_array_t *, size_t, token_t *);
+token_type_t	tok_type(const tok_array_t *, size_t);
+void		tok_iter_init(tok_iter_t *, const tok_array_t *);
+boolean_t	tok_iter_next(tok_iter_t *, token_t *);
+void		tok_print_val(const token_t *, FILE *, boolean_t);
+void		tok_print(const token_t *, FILE *);
+boolean_t	tok_include_line(struct make *, struct input *, const char *,
+    size_t, tok_word_cb_t, void *);
+void		tok_includes(struct make *, struct input *, tok_word_cb_t,
+    void *);
+char		*tok_include_path(struct make *, const token_t *);
+
+/*
+ * The files named on an include line.  tok_incl_add() is passed as the
+ * tok_word_cb_t to tok_include_line() to fill one in, and tok_incl_push()
+ * then pushes the files so they're read next.
+ */
+typedef struct tok_incl {
+	struct make	*tl_mk;
+	char		**tl_paths;
+	size_t		tl_n;
+	size_t		tl_alloc;
+	boolean_t	tl_optional;	/* missing files are ignored */
+} tok_incl_t;
+
+void		tok_incl_add(const token_t *, void *);
+void		tok_incl_push(tok_incl_t *, input_iter_t *);
+void		tok_incl_reset(tok_incl_t *);
+void		tok_incl_fini(tok_incl_t *);
+
+tokenizer_t	*tokenizer_new(struct make *, struct input *, iter_cb_t,
+    void *);
+void		tokenizer_free(tokenizer_t *);
+void		tokenizer_push(tokenizer_t *, struct input *);
+boolean_t	tokenizer_error(const tokenizer_t *);
+input_iter_t	*tokenizer_iter(const tokenizer_t *);
+boolean_t	tok_next(tokenizer_t *, token_t *);
 
 #ifdef __cplusplus
 }
@@ -28,12 +28,46 @@ uadd_overflow(size_t a, size_t b, size_t *cp)
 	return ((*cp < a || *cp < b) ? B_TRUE : B_FALSE);
 }
 
+/*
+ * Counts of the allocations made via zalloc() (which all of our allocation
+ * wrappers, and custr_t's, use).  These are only for the benchmarks, so
+ * they're only kept when built with ALLOC_STATS (as bench is), and make
+ * itself doesn't pay for them on every allocation.  Since the prefetch
+ * threads also allocate, they are updated atomically.  No ordering is
+ * needed, so relaxed updates suffice.
+ */
+#ifdef ALLOC_STATS
+static size_t alloc_count;
+static size_t alloc_bytes;
+#endif
+
 void *
 zalloc(size_t len)
 {
+#ifdef ALLOC_STATS
+	(void) __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+	(void) __atomic_fetch_add(&alloc_bytes, len, __ATOMIC_RELAXED);
+#endif
 	return (umem_zalloc(len, UMEM_NOFAIL));
 }
 
+/* Without ALLOC_STATS, no allocations are counted */
+void
+alloc_stats(size_t *countp, size_t *bytesp)
+{
+#ifdef ALLOC_STATS
+	if (countp != NULL)
+		*countp = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+	if (bytesp != NULL)
+		*bytesp = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED);
+#else
+	if (countp != NULL)
+		*countp = 0;
+	if (bytesp != NULL)
+		*bytesp = 0;
+#endif
+}
+
 char *
 xprintf(const char *fmt, ...)
 {
@@ -113,8 +147,7 @@ cfree(void *p, size_t nelem, size_t elsize)
 void
 append_range(const char *p, size_t len, custr_t *str)
 {
-	for (size_t i = 0; i < len; i++)
-		VERIFY0(custr_appendc(str, p[i]));
+	VERIFY0(custr_append_range(str, p, len));
 }
 
 static const custr_memops_t i_memops = {
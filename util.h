@@ -35,6 +35,7 @@ boolean_t umul_overflow(size_t, size_t, size_t *);
 void append_range(const char *, size_t, struct custr *);
 
 void *zalloc(size_t);
+void alloc_stats(size_t *, size_t *);
 void *xcalloc(size_t, size_t);
 void *xrealloc(void *, size_t, size_t);
 char *xprintf(const char *, ...);
@@ -0,0 +1,1308 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2018 Jason King
+ */
+
+/*
+ * Macro expansion.
+ *
+ * A recursive macro (VAS_RECURSIVE) is expanded every time it is
+ * referenced, and something like CFLAGS is referenced once per compile.
+ * Instead of scanning the value for references on each expansion, a value
+ * is compiled (once, the first time it is expanded) into a var_prog_t: a
+ * list of operations that either copy a span of literal text, or expand
+ * another macro.  Referenced macros are looked up at compile time (macros
+ * never move, see macro.c), so running the program is just a series of
+ * appends.
+ *
+ * A reference whose name itself contains references (e.g.
+ * $(CFLAGS_$(MACH))) has the name compiled to a program of its own, which
+ * is run to compute the name.  Likewise, modifiers (everything after the
+ * ':' in $(SRCS:.c=.o)) are compiled to a program, though when the
+ * modifier is literal (the usual case), it is also split into its parts
+ * at compile time.
+ *
+ * The program for a macro is saved with the macro (macro_t.prog), and is
+ * discarded by macro.c when the value of the macro changes.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/debug.h>
+#include <sys/types.h>
+#include <umem.h>
+
+#include "atom.h"
+#include "custr.h"
+#include "macro.h"
+#include "make.h"
+#include "util.h"
+#include "var.h"
+
+/* How deeply macros can reference other macros before we give up */
+#define	VAR_EXPAND_MAX	64U
+
+typedef enum var_optype {
+	VOP_LIT,		/* copy vo_len bytes at vp_text + vo_off */
+	VOP_REF,		/* expand macro vo_macro */
+	VOP_DYNREF,		/* expand the macro named by vo_dynname */
+} var_optype_t;
+
+/* Parsed modifiers, e.g. the .c=.o of $(SRCS:.c=.o) */
+typedef struct var_mods var_mods_t;
+
+typedef struct var_op {
+	var_optype_t	vo_type;
+	uint32_t	vo_off;
+	uint32_t	vo_len;
+	macro_t		*vo_macro;	/* VOP_REF */
+	var_prog_t	*vo_dynname;	/* VOP_DYNREF */
+	var_prog_t	*vo_mod;	/* modifier text, if any */
+	var_mods_t	*vo_mods;	/* vo_mod, if it is literal */
+} var_op_t;
+
+struct var_prog {
+	char		*vp_text;
+	size_t		vp_textlen;
+	var_op_t	*vp_ops;
+	size_t		vp_nops;
+	size_t		vp_alloc;
+};
+
+static var_prog_t *var_compile_range(const char *, size_t);
+struct var_ctx;
+static boolean_t var_run(struct var_ctx *, const var_prog_t *, custr_t *,
+    uint_t);
+
+static var_op_t *
+var_op_add(var_prog_t *vp, var_optype_t type)
+{
+	var_op_t *vo = NULL;
+
+	if (vp->vp_nops == vp->vp_alloc) {
+		size_t newn = (vp->vp_alloc == 0) ? 4 : vp->vp_alloc * 2;
+
+		vp->vp_ops = xrealloc(vp->vp_ops,
+		    vp->vp_alloc * sizeof (var_op_t), newn * sizeof (var_op_t));
+		vp->vp_alloc = newn;
+	}
+
+	vo = &vp->vp_ops[vp->vp_nops++];
+	vo->vo_type = type;
+	return (vo);
+}
+
+static void
+var_lit_add(var_prog_t *vp, size_t off, size_t len)
+{
+	var_op_t *vo = NULL;
+
+	if (len == 0)
+		return;
+
+	vo = var_op_add(vp, VOP_LIT);
+	vo->vo_off = (uint32_t)off;
+	vo->vo_len = (uint32_t)len;
+}
+
+/*
+ * Find the end of the reference whose opening '(' or '{' is at s[0].  The
+ * closing character is only recognized outside of any nested references.
+ * Returns the offset of the close, and sets *colonp to the offset of the
+ * first top level ':' (or the close, if there is none).  Returns len if
+ * the reference is not terminated.
+ */
+static size_t
+var_ref_end(const char *s, size_t len, size_t *colonp)
+{
+	char close = (s[0] == '(') ? ')' : '}';
+	size_t depth = 0;
+
+	*colonp = len;
+	for (size_t i = 1; i < len; i++) {
+		switch (s[i]) {
+		case '$':
+			if (i + 1 < len &&
+			    (s[i + 1] == '(' || s[i + 1] == '{')) {
+				depth++;
+				i++;
+			}
+			continue;
+		case ')':
+		case '}':
+			if (depth > 0) {
+				depth--;
+				continue;
+			}
+			if (s[i] != close)
+				continue;
+			if (*colonp == len)
+				*colonp = i;
+			return (i);
+		case ':':
+			if (depth == 0 && *colonp == len)
+				*colonp = i;
+			continue;
+		default:
+			continue;
+		}
+	}
+
+	return (len);
+}
+
+/*
+ * Modifiers.
+ *
+ * The modifiers of a reference (everything after the ':') are a list of
+ * steps, each applied in turn to the words of the value:
+ *
+ *	Mpattern	Keep only the words matching the glob pattern.
+ *	Npattern	Remove the words matching the glob pattern.
+ *	O		Sort the words.
+ *	u		Remove adjacent duplicate words.
+ *	from=to		Replace the suffix from of each word with to.  With a
+ *			pattern (e.g. %.c=obj/%.o), the '%' in from matches
+ *			any stem, which replaces the first '%' in to.  As with
+ *			SysV make, this takes the rest of the modifiers.
+ *
+ * Steps are separated by ':', e.g. $(SRCS:M*.c:O:%.c=%.o).
+ *
+ * Lists like OBJS can have thousands of words, so the value is split into
+ * words once, as a list of spans (var_wlist_t), and each step then works
+ * on the whole list.  Words that a step doesn't change are never copied,
+ * and new words are written into large chunks of text owned by the list,
+ * so filtering and sorting just rearrange the spans.  The words are joined
+ * with single spaces once all of the steps have been applied.
+ */
+typedef enum var_steptype {
+	VS_SUBST,
+	VS_MATCH,
+	VS_NOMATCH,
+	VS_SORT,
+	VS_UNIQ,
+} var_steptype_t;
+
+typedef struct var_step {
+	var_steptype_t	vs_type;
+	char		*vs_from;	/* VS_SUBST, or the pattern */
+	char		*vs_to;		/* VS_SUBST */
+	size_t		vs_fromlen;
+	size_t		vs_tolen;
+	const char	*vs_pct;	/* the '%' in vs_from, if any */
+	const char	*vs_tpct;	/* the first '%' in vs_to, if vs_pct */
+} var_step_t;
+
+struct var_mods {
+	var_step_t	*vms_steps;
+	size_t		vms_n;
+	size_t		vms_alloc;
+	boolean_t	vms_valid;	/* B_FALSE if any step is unknown */
+};
+
+typedef struct var_word {
+	const char	*vw_str;
+	size_t		vw_len;
+} var_word_t;
+
+#define	VAR_TEXT_CHUNK	(16U * 1024U)
+
+typedef struct var_text {
+	struct var_text	*vx_next;
+	char		*vx_buf;
+	size_t		vx_size;
+	size_t		vx_used;
+} var_text_t;
+
+typedef struct var_wlist {
+	var_word_t	*vl_words;
+	size_t		vl_n;
+	size_t		vl_alloc;
+	var_text_t	*vl_text;	/* new words, most recent first */
+} var_wlist_t;
+
+static char *
+var_step_str(const char *s, size_t len)
+{
+	char *str = zalloc(len + 1);
+
+	(void) memcpy(str, s, len);
+	return (str);
+}
+
+static var_step_t *
+var_step_add(var_mods_t *vms, var_steptype_t type, const char *from,
+    size_t fromlen)
+{
+	var_step_t *vs = NULL;
+
+	if (vms->vms_n == vms->vms_alloc) {
+		size_t newn = (vms->vms_alloc == 0) ? 2 : vms->vms_alloc * 2;
+
+		vms->vms_steps = xrealloc(vms->vms_steps,
+		    vms->vms_alloc * sizeof (var_step_t),
+		    newn * sizeof (var_step_t));
+		vms->vms_alloc = newn;
+	}
+
+	vs = &vms->vms_steps[vms->vms_n++];
+	vs->vs_type = type;
+	if (from != NULL) {
+		vs->vs_from = var_step_str(from, fromlen);
+		vs->vs_fromlen = fromlen;
+	}
+	return (vs);
+}
+
+static void
+var_mods_free(var_mods_t *vms)
+{
+	if (vms == NULL)
+		return;
+
+	for (size_t i = 0; i < vms->vms_n; i++) {
+		strfree(vms->vms_steps[i].vs_from);
+		strfree(vms->vms_steps[i].vs_to);
+	}
+	cfree(vms->vms_steps, vms->vms_alloc, sizeof (var_step_t));
+	umem_free(vms, sizeof (*vms));
+}
+
+/*
+ * Parse the len bytes of modifier text at mod.  If any step isn't
+ * understood, the result is marked invalid, and the value is left alone
+ * when it is applied.
+ */
+static var_mods_t *
+var_mods_new(const char *mod, size_t len)
+{
+	var_mods_t *vms = zalloc(sizeof (*vms));
+	const char *end = mod + len;
+	const char *p = mod;
+
+	vms->vms_valid = (len > 0) ? B_TRUE : B_FALSE;
+
+	while (p < end && vms->vms_valid) {
+		const char *eq = memchr(p, '=', (size_t)(end - p));
+		const char *colon = memchr(p, ':', (size_t)(end - p));
+		size_t steplen;
+		var_step_t *vs = NULL;
+		boolean_t bsd;
+
+		if (colon == NULL)
+			colon = end;
+		steplen = (size_t)(colon - p);
+
+		/*
+		 * A step with an '=' in it is a SysV from=to substitution,
+		 * even when from starts with a letter that BSD make uses
+		 * for a modifier (e.g. $(X:Makefile=mk)).  An '=' in a later
+		 * step doesn't count (e.g. $(X:Q:a=b) has the unknown step Q).
+		 */
+		bsd = (eq == NULL || eq > colon) ? B_TRUE : B_FALSE;
+
+		if (bsd && steplen > 0 && p[0] == 'M') {
+			(void) var_step_add(vms, VS_MATCH, p + 1, steplen - 1);
+		} else if (bsd && steplen > 0 && p[0] == 'N') {
+			(void) var_step_add(vms, VS_NOMATCH, p + 1,
+			    steplen - 1);
+		} else if (bsd && steplen == 1 && p[0] == 'O') {
+			(void) var_step_add(vms, VS_SORT, NULL, 0);
+		} else if (bsd && steplen == 1 && p[0] == 'u') {
+			(void) var_step_add(vms, VS_UNIQ, NULL, 0);
+		} else if (!bsd) {
+			vs = var_step_add(vms, VS_SUBST, p, (size_t)(eq - p));
+			vs->vs_tolen = (size_t)(end - eq - 1);
+			vs->vs_to = var_step_str(eq + 1, vs->vs_tolen);
+			vs->vs_pct = strchr(vs->vs_from, '%');
+			if (vs->vs_pct != NULL)
+				vs->vs_tpct = strchr(vs->vs_to, '%');
+			break;
+		} else {
+			vms->vms_valid = B_FALSE;
+		}
+
+		p = (colon < end) ? colon + 1 : end;
+	}
+
+	return (vms);
+}
+
+/* Return len bytes of space (that never moves) for new words of wl */
+static char *
+var_wl_alloc(var_wlist_t *wl, size_t len)
+{
+	var_text_t *vx = wl->vl_text;
+	char *p = NULL;
+
+	if (vx == NULL || vx->vx_size - vx->vx_used < len) {
+		vx = zalloc(sizeof (*vx));
+		vx->vx_size = (len > VAR_TEXT_CHUNK) ? len : VAR_TEXT_CHUNK;
+		vx->vx_buf = zalloc(vx->vx_size);
+		vx->vx_next = wl->vl_text;
+		wl->vl_text = vx;
+	}
+
+	p = vx->vx_buf + vx->vx_used;
+	vx->vx_used += len;
+	return (p);
+}
+
+/* Split the len bytes at s into words.  The words refer to s. */
+static void
+var_wl_split(var_wlist_t *wl, const char *s, size_t len)
+{
+	size_t i = 0;
+
+	while (i < len) {
+		size_t start;
+
+		while (i < len && (s[i] == ' ' || s[i] == '\t' || s[i] == '\n'))
+			i++;
+		for (start = i; i < len &&
+		    s[i] != ' ' && s[i] != '\t' && s[i] != '\n'; i++)
+			;
+		if (i == start)
+			break;
+
+		if (wl->vl_n == wl->vl_alloc) {
+			size_t newn = (wl->vl_alloc == 0) ?
+			    64 : wl->vl_alloc * 2;
+
+			wl->vl_words = xrealloc(wl->vl_words,
+			    wl->vl_alloc * sizeof (var_word_t),
+			    newn * sizeof (var_word_t));
+			wl->vl_alloc = newn;
+		}
+		wl->vl_words[wl->vl_n].vw_str = s + start;
+		wl->vl_words[wl->vl_n].vw_len = i - start;
+		wl->vl_n++;
+	}
+}
+
+static void
+var_wl_fini(var_wlist_t *wl)
+{
+	var_text_t *vx = wl->vl_text;
+
+	while (vx != NULL) {
+		var_text_t *next = vx->vx_next;
+
+		umem_free(vx->vx_buf, vx->vx_size);
+		umem_free(vx, sizeof (*vx));
+		vx = next;
+	}
+	cfree(wl->vl_words, wl->vl_alloc, sizeof (var_word_t));
+}
+
+static void
+var_wl_subst(var_wlist_t *wl, const var_step_t *vs)
+{
+	size_t pre = 0, suf = 0;
+
+	if (vs->vs_pct != NULL) {
+		pre = (size_t)(vs->vs_pct - vs->vs_from);
+		suf = vs->vs_fromlen - pre - 1;
+	}
+
+	for (size_t i = 0; i < wl->vl_n; i++) {
+		var_word_t *vw = &wl->vl_words[i];
+		const char *stem = NULL;
+		size_t stemlen, len, tpre;
+		char *p = NULL;
+
+		if (vs->vs_pct == NULL) {
+			if (vw->vw_len < vs->vs_fromlen ||
+			    memcmp(vw->vw_str + vw->vw_len - vs->vs_fromlen,
+			    vs->vs_from, vs->vs_fromlen) != 0)
+				continue;
+
+			len = vw->vw_len - vs->vs_fromlen;
+			p = var_wl_alloc(wl, len + vs->vs_tolen);
+			(void) memcpy(p, vw->vw_str, len);
+			(void) memcpy(p + len, vs->vs_to, vs->vs_tolen);
+			vw->vw_str = p;
+			vw->vw_len = len + vs->vs_tolen;
+			continue;
+		}
+
+		if (vw->vw_len < pre + suf ||
+		    memcmp(vw->vw_str, vs->vs_from, pre) != 0 ||
+		    memcmp(vw->vw_str + vw->vw_len - suf, vs->vs_pct + 1,
+		    suf) != 0)
+			continue;
+
+		/* Without a '%' in vs_to, the word is simply replaced */
+		if (vs->vs_tpct == NULL) {
+			vw->vw_str = vs->vs_to;
+			vw->vw_len = vs->vs_tolen;
+			continue;
+		}
+
+		stem = vw->vw_str + pre;
+		stemlen = vw->vw_len - pre - suf;
+		tpre = (size_t)(vs->vs_tpct - vs->vs_to);
+		len = vs->vs_tolen - 1 + stemlen;
+
+		p = var_wl_alloc(wl, len);
+		(void) memcpy(p, vs->vs_to, tpre);
+		(void) memcpy(p + tpre, stem, stemlen);
+		(void) memcpy(p + tpre + stemlen, vs->vs_tpct + 1,
+		    vs->vs_tolen - tpre - 1);
+		vw->vw_str = p;
+		vw->vw_len = len;
+	}
+}
+
+/*
+ * Match c against the [...] set that starts at pat[p].  Returns B_FALSE
+ * (and leaves *nextp alone) if the set is unterminated, in which case the
+ * '[' is just a '['.  Otherwise, sets *matchp, and *nextp to the offset
+ * just past the ']'.
+ */
+static boolean_t
+var_glob_set(const char *pat, size_t patlen, size_t p, char c,
+    boolean_t *matchp, size_t *nextp)
+{
+	boolean_t neg = B_FALSE;
+	boolean_t match = B_FALSE;
+	size_t j = p + 1;
+	size_t first;
+
+	if (j < patlen && (pat[j] == '!' || pat[j] == '^')) {
+		neg = B_TRUE;
+		j++;
+	}
+
+	/* A ']' right after the '[' (or '[!') is part of the set */
+	for (first = j; j < patlen && (pat[j] != ']' || j == first); j++) {
+		uchar_t lo = (uchar_t)pat[j];
+		uchar_t hi = lo;
+
+		if (j + 2 < patlen && pat[j + 1] == '-' && pat[j + 2] != ']') {
+			hi = (uchar_t)pat[j + 2];
+			j += 2;
+		}
+		if ((uchar_t)c >= lo && (uchar_t)c <= hi)
+			match = B_TRUE;
+	}
+
+	if (j == patlen)
+		return (B_FALSE);
+
+	*matchp = neg ? !match : match;
+	*nextp = j + 1;
+	return (B_TRUE);
+}
+
+/*
+ * Does the len bytes at s match the glob pattern pat?  pat may contain '*'
+ * (any string), '?' (any character), [...] (any of a set of characters or
+ * ranges, or none of them if the set starts with '!' or '^'), and '\' to
+ * match the next character literally.
+ */
+static boolean_t
+var_glob(const char *pat, size_t patlen, const char *s, size_t len)
+{
+	size_t p = 0, i = 0;
+	size_t star_p = SIZE_MAX, star_i = 0;
+
+	while (i < len) {
+		boolean_t match = B_FALSE;
+		size_t next = p + 1;
+
+		if (p < patlen) {
+			switch (pat[p]) {
+			case '*':
+				star_p = p++;
+				star_i = i;
+				continue;
+			case '?':
+				match = B_TRUE;
+				break;
+			case '[':
+				if (var_glob_set(pat, patlen, p, s[i], &match,
+				    &next))
+					break;
+				match = (s[i] == '[') ? B_TRUE : B_FALSE;
+				break;
+			case '\\':
+				if (p + 1 < patlen) {
+					match = (pat[p + 1] == s[i]) ?
+					    B_TRUE : B_FALSE;
+					next = p + 2;
+					break;
+				}
+				/* FALLTHROUGH */
+			default:
+				match = (pat[p] == s[i]) ? B_TRUE : B_FALSE;
+				break;
+			}
+		}
+
+		if (match) {
+			p = next;
+			i++;
+			continue;
+		}
+
+		/* Mismatch: let the last '*' match one more character */
+		if (star_p == SIZE_MAX)
+			return (B_FALSE);
+		p = star_p + 1;
+		i = ++star_i;
+	}
+
+	while (p < patlen && pat[p] == '*')
+		p++;
+	return ((p == patlen) ? B_TRUE : B_FALSE);
+}
+
+static void
+var_wl_match(var_wlist_t *wl, const var_step_t *vs, boolean_t keep)
+{
+	size_t n = 0;
+
+	for (size_t i = 0; i < wl->vl_n; i++) {
+		const var_word_t *vw = &wl->vl_words[i];
+
+		if (var_glob(vs->vs_from, vs->vs_fromlen, vw->vw_str,
+		    vw->vw_len) == keep)
+			wl->vl_words[n++] = *vw;
+	}
+	wl->vl_n = n;
+}
+
+static int
+var_word_cmp(const void *a, const void *b)
+{
+	const var_word_t *l = a;
+	const var_word_t *r = b;
+	size_t len = (l->vw_len < r->vw_len) ? l->vw_len : r->vw_len;
+	int ret = memcmp(l->vw_str, r->vw_str, len);
+
+	if (ret < 0)
+		return (-1);
+	if (ret > 0)
+		return (1);
+	if (l->vw_len < r->vw_len)
+		return (-1);
+	if (l->vw_len > r->vw_len)
+		return (1);
+	return (0);
+}
+
+static void
+var_wl_uniq(var_wlist_t *wl)
+{
+	size_t n = 0;
+
+	for (size_t i = 0; i < wl->vl_n; i++) {
+		if (n > 0 &&
+		    var_word_cmp(&wl->vl_words[n - 1], &wl->vl_words[i]) == 0)
+			continue;
+		wl->vl_words[n++] = wl->vl_words[i];
+	}
+	wl->vl_n = n;
+}
+
+/* Apply vms to the len bytes of s, and append the result to out */
+static void
+var_mods_apply(const var_mods_t *vms, const char *s, size_t len,
+    custr_t *out)
+{
+	var_wlist_t wl = { 0 };
+
+	if (!vms->vms_valid) {
+		VERIFY0(custr_append_range(out, s, len));
+		return;
+	}
+
+	var_wl_split(&wl, s, len);
+
+	for (size_t i = 0; i < vms->vms_n; i++) {
+		const var_step_t *vs = &vms->vms_steps[i];
+
+		switch (vs->vs_type) {
+		case VS_SUBST:
+			var_wl_subst(&wl, vs);
+			break;
+		case VS_MATCH:
+			var_wl_match(&wl, vs, B_TRUE);
+			break;
+		case VS_NOMATCH:
+			var_wl_match(&wl, vs, B_FALSE);
+			break;
+		case VS_SORT:
+			if (wl.vl_n > 1) {
+				qsort(wl.vl_words, wl.vl_n, sizeof (var_word_t),
+				    var_word_cmp);
+			}
+			break;
+		case VS_UNIQ:
+			var_wl_uniq(&wl);
+			break;
+		}
+	}
+
+	for (size_t i = 0; i < wl.vl_n; i++) {
+		if (i > 0)
+			VERIFY0(custr_appendc(out, ' '));
+		VERIFY0(custr_append_range(out, wl.vl_words[i].vw_str,
+		    wl.vl_words[i].vw_len));
+	}
+
+	var_wl_fini(&wl);
+}
+
+/* Does vp only copy literal text?  (i.e. no references) */
+static boolean_t
+var_is_literal(const var_prog_t *vp)
+{
+	return ((vp->vp_nops == 0 ||
+	    (vp->vp_nops == 1 && vp->vp_ops[0].vo_type == VOP_LIT)) ?
+	    B_TRUE : B_FALSE);
+}
+
+static void
+var_compile_ref(var_prog_t *vp, size_t start, size_t colon, size_t end)
+{
+	const char *name = vp->vp_text + start;
+	size_t namelen = colon - start;
+	var_op_t *vo = NULL;
+
+	if (memchr(name, '$', namelen) != NULL) {
+		vo = var_op_add(vp, VOP_DYNREF);
+		vo->vo_dynname = var_compile_range(name, namelen);
+	} else {
+		vo = var_op_add(vp, VOP_REF);
+		vo->vo_macro = macro_ref(atom_intern(name, namelen));
+	}
+
+	if (colon == end)
+		return;
+
+	vo->vo_mod = var_compile_range(vp->vp_text + colon + 1,
+	    end - colon - 1);
+	if (var_is_literal(vo->vo_mod)) {
+		vo->vo_mods = var_mods_new(vp->vp_text + colon + 1,
+		    end - colon - 1);
+	}
+}
+
+static var_prog_t *
+var_compile_range(const char *s, size_t len)
+{
+	var_prog_t *vp = zalloc(sizeof (*vp));
+	const char *text = NULL;
+	size_t i = 0, lit = 0;
+
+	VERIFY3U(len, <, UINT32_MAX);
+
+	vp->vp_text = zalloc(len + 1);
+	vp->vp_textlen = len;
+	(void) memcpy(vp->vp_text, s, len);
+	text = vp->vp_text;
+
+	while (i < len) {
+		const char *dollar = memchr(text + i, '$', len - i);
+		size_t colon, end;
+
+		if (dollar == NULL)
+			break;
+		i = (size_t)(dollar - text);
+
+		/* A trailing '$' is just a '$' */
+		if (i + 1 == len)
+			break;
+
+		switch (text[i + 1]) {
+		case '$':
+			/* '$$' is a literal '$', so keep the first */
+			var_lit_add(vp, lit, i + 1 - lit);
+			i += 2;
+			lit = i;
+			continue;
+		case '(':
+		case '{':
+			end = var_ref_end(text + i + 1, len - i - 1, &colon);
+			if (end == len - i - 1) {
+				/* Unterminated, leave it as text */
+				i = len;
+				continue;
+			}
+			var_lit_add(vp, lit, i - lit);
+			var_compile_ref(vp, i + 2, i + 1 + colon, i + 1 + end);
+			i += end + 2;
+			lit = i;
+			continue;
+		default:
+			/* $X, where X is a single character */
+			var_lit_add(vp, lit, i - lit);
+			var_compile_ref(vp, i + 1, i + 2, i + 2);
+			i += 2;
+			lit = i;
+			continue;
+		}
+	}
+
+	var_lit_add(vp, lit, len - lit);
+	return (vp);
+}
+
+/*
+ * Compile the value val into a var_prog_t.
+ */
+var_prog_t *
+var_compile(const char *val)
+{
+	return (var_compile_range(val, strlen(val)));
+}
+
+void
+var_prog_free(var_prog_t *vp)
+{
+	if (vp == NULL)
+		return;
+
+	for (size_t i = 0; i < vp->vp_nops; i++) {
+		var_prog_free(vp->vp_ops[i].vo_dynname);
+		var_prog_free(vp->vp_ops[i].vo_mod);
+		var_mods_free(vp->vp_ops[i].vo_mods);
+	}
+	cfree(vp->vp_ops, vp->vp_alloc, sizeof (var_op_t));
+	umem_free(vp->vp_text, vp->vp_textlen + 1);
+	umem_free(vp, sizeof (*vp));
+}
+
+/*
+ * Expansion memos.
+ *
+ * Most expansions are repeated with the same inputs (e.g. CFLAGS for every
+ * compile), so the result of expanding a macro is saved with it
+ * (macro_t.memo), along with every macro that was read to produce it (its
+ * dependencies) and the generation of each at the time.  macro.c bumps the
+ * generation of a macro whenever its value (or its conditional values)
+ * change, so a memo is valid as long as the generation of each of its
+ * dependencies is unchanged.  Macros that were referenced but undefined are
+ * dependencies too (macro_ref() gives them a placeholder macro_t), since
+ * defining them later changes the result.
+ *
+ * A memo is normally shared by all targets.  If anything used in the
+ * expansion has conditional (target specific) values, the memo is instead
+ * only used for the target it was expanded for.  There can be one of those
+ * for every target, so rather than hanging them off the macro, they are
+ * kept in a hash table (var_memo_tab) keyed by the macro and target.  A
+ * memo there is never freed by macro_changed(), so it also records the
+ * generation of its own macro.
+ */
+typedef struct var_dep {
+	macro_t		*vd_macro;
+	uint64_t	vd_gen;
+} var_dep_t;
+
+struct var_memo {
+	struct var_memo	*vm_next;	/* in macro_t.memo or a hash chain */
+	macro_t		*vm_macro;
+	uint64_t	vm_gen;		/* of vm_macro */
+	atom_t		vm_target;	/* ATOM_NONE if for all targets */
+	boolean_t	vm_cond;	/* used conditional values */
+	char		*vm_val;
+	size_t		vm_len;
+	var_dep_t	*vm_deps;
+	size_t		vm_ndeps;
+};
+
+#define	VAR_MEMO_MINBUCKETS	64U
+
+/* The memos that used conditional values, by (macro, target) */
+typedef struct var_memo_table {
+	var_memo_t	**vmt_buckets;
+	size_t		vmt_nbuckets;
+	size_t		vmt_n;		/* # of memos */
+	uint_t		vmt_shift;	/* 64 - log2(vmt_nbuckets) */
+} var_memo_table_t;
+
+static var_memo_table_t var_memo_tab;
+
+/* The state of a single expansion */
+typedef struct var_ctx {
+	atom_t		vc_target;	/* ATOM_NONE if not for a target */
+	const macro_env_t *vc_env;	/* conditional values for vc_target */
+	boolean_t	vc_cond;	/* used conditional values */
+	var_dep_t	*vc_deps;	/* everything read so far */
+	size_t		vc_ndeps;
+	size_t		vc_alloc;
+} var_ctx_t;
+
+static void
+var_dep_add(var_ctx_t *ctx, macro_t *m, uint64_t gen)
+{
+	if (ctx->vc_ndeps == ctx->vc_alloc) {
+		size_t newn = (ctx->vc_alloc == 0) ? 16 : ctx->vc_alloc * 2;
+
+		ctx->vc_deps = xrealloc(ctx->vc_deps,
+		    ctx->vc_alloc * sizeof (var_dep_t),
+		    newn * sizeof (var_dep_t));
+		ctx->vc_alloc = newn;
+	}
+
+	ctx->vc_deps[ctx->vc_ndeps].vd_macro = m;
+	ctx->vc_deps[ctx->vc_ndeps].vd_gen = gen;
+	ctx->vc_ndeps++;
+}
+
+static int
+var_dep_cmp(const void *a, const void *b)
+{
+	uintptr_t l = (uintptr_t)((const var_dep_t *)a)->vd_macro;
+	uintptr_t r = (uintptr_t)((const var_dep_t *)b)->vd_macro;
+
+	if (l < r)
+		return (-1);
+	if (l > r)
+		return (1);
+	return (0);
+}
+
+static void
+var_memo_free_one(var_memo_t *vm)
+{
+	umem_free(vm->vm_val, vm->vm_len + 1);
+	cfree(vm->vm_deps, vm->vm_ndeps, sizeof (var_dep_t));
+	umem_free(vm, sizeof (*vm));
+}
+
+void
+var_memo_free(var_memo_t *vm)
+{
+	while (vm != NULL) {
+		var_memo_t *next = vm->vm_next;
+
+		var_memo_free_one(vm);
+		vm = next;
+	}
+}
+
+static boolean_t
+var_memo_valid(const var_memo_t *vm)
+{
+	if (vm->vm_macro->gen != vm->vm_gen)
+		return (B_FALSE);
+
+	for (size_t i = 0; i < vm->vm_ndeps; i++) {
+		if (vm->vm_deps[i].vd_macro->gen != vm->vm_deps[i].vd_gen)
+			return (B_FALSE);
+	}
+	return (B_TRUE);
+}
+
+/* Fibonacci hashing, as in macro.c, of the macro's address and the target */
+static inline size_t
+var_memo_hash(const macro_t *m, atom_t target, uint_t shift)
+{
+	uint64_t key = (uint64_t)(uintptr_t)m ^ ((uint64_t)target << 32);
+
+	return ((size_t)((key * 0x9E3779B97F4A7C15ULL) >> shift));
+}
+
+/*
+ * Keep the average chain at most one memo long.  Memos for a target that is
+ * never expanded again would otherwise stay forever, so stale ones are
+ * dropped while rehashing.
+ */
+static void
+var_memo_table_grow(var_memo_table_t *vmt)
+{
+	var_memo_t **buckets = NULL;
+	size_t nbuckets;
+	uint_t shift;
+
+	if (vmt->vmt_n < vmt->vmt_nbuckets)
+		return;
+
+	if (vmt->vmt_nbuckets == 0) {
+		nbuckets = VAR_MEMO_MINBUCKETS;
+		shift = 64;
+		for (size_t n = nbuckets; n > 1; n >>= 1)
+			shift--;
+	} else {
+		nbuckets = vmt->vmt_nbuckets * 2;
+		shift = vmt->vmt_shift - 1;
+	}
+
+	buckets = xcalloc(nbuckets, sizeof (var_memo_t *));
+	for (size_t i = 0; i < vmt->vmt_nbuckets; i++) {
+		var_memo_t *vm = NULL;
+
+		while ((vm = vmt->vmt_buckets[i]) != NULL) {
+			size_t b = var_memo_hash(vm->vm_macro, vm->vm_target,
+			    shift);
+
+			vmt->vmt_buckets[i] = vm->vm_next;
+			if (!var_memo_valid(vm)) {
+				var_memo_free_one(vm);
+				vmt->vmt_n--;
+				continue;
+			}
+			vm->vm_next = buckets[b];
+			buckets[b] = vm;
+		}
+	}
+
+	cfree(vmt->vmt_buckets, vmt->vmt_nbuckets, sizeof (var_memo_t *));
+	vmt->vmt_buckets = buckets;
+	vmt->vmt_nbuckets = nbuckets;
+	vmt->vmt_shift = shift;
+}
+
+/* Find the memo of m for target in var_memo_tab, discarding it if stale */
+static var_memo_t *
+var_memo_lookup(macro_t *m, atom_t target)
+{
+	var_memo_table_t *vmt = &var_memo_tab;
+	var_memo_t **vmp = NULL;
+	var_memo_t *vm = NULL;
+
+	if (vmt->vmt_nbuckets == 0)
+		return (NULL);
+
+	vmp = &vmt->vmt_buckets[var_memo_hash(m, target, vmt->vmt_shift)];
+	for (; (vm = *vmp) != NULL; vmp = &vm->vm_next) {
+		if (vm->vm_macro != m || vm->vm_target != target)
+			continue;
+
+		if (var_memo_valid(vm))
+			return (vm);
+
+		*vmp = vm->vm_next;
+		var_memo_free_one(vm);
+		vmt->vmt_n--;
+		break;
+	}
+
+	return (NULL);
+}
+
+/*
+ * Find a memo of m usable for target.  Any stale memos that are found along
+ * the way are discarded.
+ */
+static var_memo_t *
+var_memo_find(macro_t *m, atom_t target)
+{
+	var_memo_t **vmp = &m->memo;
+	var_memo_t *vm = NULL;
+
+	while ((vm = *vmp) != NULL) {
+		if (!var_memo_valid(vm)) {
+			*vmp = vm->vm_next;
+			var_memo_free_one(vm);
+			continue;
+		}
+		return (vm);
+	}
+
+	return (var_memo_lookup(m, target));
+}
+
+static void
+var_memo_add(macro_t *m, const var_ctx_t *ctx, const char *val, size_t len,
+    const var_dep_t *deps, size_t ndeps)
+{
+	var_memo_table_t *vmt = &var_memo_tab;
+	var_memo_t *vm = zalloc(sizeof (*vm));
+	var_memo_t **vmp = NULL;
+	size_t n = 0;
+
+	vm->vm_macro = m;
+	vm->vm_gen = m->gen;
+	vm->vm_target = ctx->vc_cond ? ctx->vc_target : ATOM_NONE;
+	vm->vm_cond = ctx->vc_cond;
+	vm->vm_val = zalloc(len + 1);
+	vm->vm_len = len;
+	(void) memcpy(vm->vm_val, val, len);
+
+	/* The same macro is often referenced more than once */
+	if (ndeps > 0) {
+		vm->vm_deps = xcalloc(ndeps, sizeof (var_dep_t));
+		(void) memcpy(vm->vm_deps, deps, ndeps * sizeof (var_dep_t));
+		qsort(vm->vm_deps, ndeps, sizeof (var_dep_t), var_dep_cmp);
+		for (size_t i = 0; i < ndeps; i++) {
+			const var_dep_t *vd = &vm->vm_deps[i];
+
+			if (n > 0 &&
+			    vm->vm_deps[n - 1].vd_macro == vd->vd_macro)
+				continue;
+			vm->vm_deps[n++] = *vd;
+		}
+		vm->vm_deps = xrealloc(vm->vm_deps,
+		    ndeps * sizeof (var_dep_t), n * sizeof (var_dep_t));
+	}
+	vm->vm_ndeps = n;
+
+	if (!vm->vm_cond) {
+		vm->vm_next = m->memo;
+		m->memo = vm;
+		return;
+	}
+
+	/* var_memo_find() already discarded any stale memo for the target */
+	var_memo_table_grow(vmt);
+	vmp = &vmt->vmt_buckets[var_memo_hash(m, vm->vm_target,
+	    vmt->vmt_shift)];
+	vm->vm_next = *vmp;
+	*vmp = vm;
+	vmt->vmt_n++;
+}
+
+static boolean_t
+var_run_prog(var_ctx_t *ctx, var_prog_t **vpp, const char *val,
+    custr_t *out, uint_t depth)
+{
+	if (*vpp == NULL)
+		*vpp = var_compile(val);
+	return (var_run(ctx, *vpp, out, depth));
+}
+
+/*
+ * Expand the value of m, including any conditional values for the target
+ * of the expansion.  A conditional assignment replaces the value, and a
+ * conditional append adds to it (in the order they were defined).
+ */
+static boolean_t
+var_expand_value(var_ctx_t *ctx, macro_t *m, custr_t *out, uint_t depth)
+{
+	const macro_override_t *mo = NULL;
+	size_t n = 0, i = 0;
+	size_t base = custr_len(out);
+
+	if (m->cond != NULL)
+		mo = macro_env_find(ctx->vc_env, m, &n);
+
+	/* Only the last assignment (and what follows it) matters */
+	for (i = n; i > 0 && !mo[i - 1].mo_cond->assign; i--)
+		;
+
+	if (i == 0) {
+		if (m->val != NULL &&
+		    !var_run_prog(ctx, &m->prog, macro_val(m), out, depth))
+			return (B_FALSE);
+	} else {
+		cond_macro_t *cm = mo[--i].mo_cond;
+
+		if (!var_run_prog(ctx, &cm->prog, cm->val, out, depth))
+			return (B_FALSE);
+		i++;
+	}
+
+	for (; i < n; i++) {
+		cond_macro_t *cm = mo[i].mo_cond;
+
+		if (custr_len(out) > base)
+			VERIFY0(custr_appendc(out, ' '));
+		if (!var_run_prog(ctx, &cm->prog, cm->val, out, depth))
+			return (B_FALSE);
+	}
+
+	return (B_TRUE);
+}
+
+static boolean_t
+var_expand_macro(var_ctx_t *ctx, macro_t *m, custr_t *out, uint_t depth)
+{
+	var_memo_t *vm = NULL;
+	size_t base, start;
+	boolean_t cond;
+
+	/* Undefined (so far) */
+	if (m->val == NULL && m->cond == NULL) {
+		var_dep_add(ctx, m, m->gen);
+		return (B_TRUE);
+	}
+
+	if (depth == VAR_EXPAND_MAX) {
+		(void) fprintf(stderr,
+		    _("Macro %s references itself (or is nested too deeply)\n"),
+		    atom_name(m->name));
+		return (B_FALSE);
+	}
+
+	if ((vm = var_memo_find(m, ctx->vc_target)) != NULL) {
+		VERIFY0(custr_append_range(out, vm->vm_val, vm->vm_len));
+		for (size_t i = 0; i < vm->vm_ndeps; i++) {
+			var_dep_add(ctx, vm->vm_deps[i].vd_macro,
+			    vm->vm_deps[i].vd_gen);
+		}
+		var_dep_add(ctx, m, m->gen);
+		if (vm->vm_cond)
+			ctx->vc_cond = B_TRUE;
+		return (B_TRUE);
+	}
+
+	base = ctx->vc_ndeps;
+	start = custr_len(out);
+	cond = ctx->vc_cond;
+	ctx->vc_cond = (m->cond != NULL) ? B_TRUE : B_FALSE;
+
+	if (!var_expand_value(ctx, m, out, depth + 1))
+		return (B_FALSE);
+
+	var_memo_add(m, ctx, custr_cstr(out) + start, custr_len(out) - start,
+	    ctx->vc_deps + base, ctx->vc_ndeps - base);
+
+	var_dep_add(ctx, m, m->gen);
+	if (cond)
+		ctx->vc_cond = B_TRUE;
+	return (B_TRUE);
+}
+
+static boolean_t
+var_run_op(var_ctx_t *ctx, const var_op_t *vo, custr_t *out, uint_t depth)
+{
+	custr_t *name = NULL;
+	custr_t *val = NULL;
+	custr_t *mod = NULL;
+	macro_t *m = NULL;
+	boolean_t ok = B_FALSE;
+
+	if (vo->vo_type == VOP_REF) {
+		m = vo->vo_macro;
+	} else {
+		VERIFY0(custr_alloc(&name, cu_memops));
+		if (!var_run(ctx, vo->vo_dynname, name, depth))
+			goto done;
+		m = macro_ref(atom_intern(custr_cstr(name), custr_len(name)));
+	}
+
+	if (vo->vo_mod == NULL) {
+		ok = var_expand_macro(ctx, m, out, depth);
+		goto done;
+	}
+
+	/* Modifiers work on the expanded value, so expand it separately */
+	VERIFY0(custr_alloc(&val, cu_memops));
+	if (!var_expand_macro(ctx, m, val, depth))
+		goto done;
+
+	if (vo->vo_mods != NULL) {
+		var_mods_apply(vo->vo_mods, custr_cstr(val), custr_len(val),
+		    out);
+	} else {
+		var_mods_t *vms = NULL;
+
+		VERIFY0(custr_alloc(&mod, cu_memops));
+		if (!var_run(ctx, vo->vo_mod, mod, depth))
+			goto done;
+
+		vms = var_mods_new(custr_cstr(mod), custr_len(mod));
+		var_mods_apply(vms, custr_cstr(val), custr_len(val), out);
+		var_mods_free(vms);
+	}
+	ok = B_TRUE;
+
+done:
+	if (name != NULL)
+		custr_free(name);
+	if (val != NULL)
+		custr_free(val);
+	if (mod != NULL)
+		custr_free(mod);
+	return (ok);
+}
+
+static boolean_t
+var_run(var_ctx_t *ctx, const var_prog_t *vp, custr_t *out, uint_t depth)
+{
+	for (size_t i = 0; i < vp->vp_nops; i++) {
+		const var_op_t *vo = &vp->vp_ops[i];
+
+		if (vo->vo_type == VOP_LIT) {
+			VERIFY0(custr_append_range(out,
+			    vp->vp_text + vo->vo_off, vo->vo_len));
+			continue;
+		}
+
+		if (!var_run_op(ctx, vo, out, depth))
+			return (B_FALSE);
+	}
+	return (B_TRUE);
+}
+
+/*
+ * Set name to the (unexpanded) value val.
+ */
+void
+var_set(make_t *mk __unused, const char *name, const char *val)
+{
+	bookmark_t where = { 0 };
+
+	macro_assign(name, val, where);
+}
+
+static boolean_t
+var_get_common(atom_t target, const char *name, custr_t *out)
+{
+	var_ctx_t ctx = { .vc_target = target };
+	macro_t *m = macro_get(atom_find(name, strlen(name)));
+	boolean_t ok;
+
+	if (m == NULL || (m->val == NULL && m->cond == NULL))
+		return (B_FALSE);
+
+	if (target != ATOM_NONE)
+		ctx.vc_env = macro_env(target);
+
+	ok = var_expand_macro(&ctx, m, out, 0);
+	cfree(ctx.vc_deps, ctx.vc_alloc, sizeof (var_dep_t));
+	return (ok);
+}
+
+/*
+ * Append the expanded value of name to out.  Returns B_FALSE if name is not
+ * defined, or could not be expanded.
+ */
+boolean_t
+var_get(make_t *mk __unused, const char *name, custr_t *out)
+{
+	return (var_get_common(ATOM_NONE, name, out));
+}
+
+/*
+ * Like var_get(), but including any conditional values of the macros
+ * involved for target.
+ */
+boolean_t
+var_get_target(make_t *mk __unused, const char *target, const char *name,
+    custr_t *out)
+{
+	return (var_get_common(atom_intern_str(target), name, out));
+}
+
+/*
+ * Append the expansion of the arbitrary text s (e.g. a recipe line) to
+ * out.
+ */
+boolean_t
+var_expand(make_t *mk __unused, const char *s, custr_t *out)
+{
+	var_ctx_t ctx = { .vc_target = ATOM_NONE };
+	var_prog_t *vp = var_compile(s);
+	boolean_t ok = var_run(&ctx, vp, out, 0);
+
+	var_prog_free(vp);
+	cfree(ctx.vc_deps, ctx.vc_alloc, sizeof (var_dep_t));
+	return (ok);
+}
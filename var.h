@@ -24,6 +24,9 @@ extern "C" {
 
 struct custr;
 struct make;
+struct var_prog;
+typedef struct var_prog var_prog_t;
+typedef struct var_memo var_memo_t;
 
 typedef enum var_assign {
 	VAS_RECURSIVE,		/* var = value			*/
@@ -33,6 +36,12 @@ typedef enum var_assign {
 
 void		var_set(struct make *, const char *, const char *);
 boolean_t	var_get(struct make *, const char *, struct custr *);
+boolean_t	var_get_target(struct make *, const char *, const char *,
+    struct custr *);
+boolean_t	var_expand(struct make *, const char *, struct custr *);
+var_prog_t	*var_compile(const char *);
+void		var_prog_free(var_prog_t *);
+void		var_memo_free(var_memo_t *);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,474 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2018 Jason King
+ */
+
+
+/*
+ * The search path for prerequisites (.PATH and VPATH).
+ *
+ * A prerequisite that isn't where it's named is looked for in each of the
+ * search directories in turn.  With a dozen directories and tens of
+ * thousands of sources, doing that with a stat() of each candidate is
+ * almost all failed lookups.  Instead, the first time a directory is
+ * searched, the names in it are read (with readdir() alone) into a hash
+ * set, so searching it from then on needs no system calls at all.
+ * Directories are only read when they are first searched, so one that
+ * is never needed is never read.
+ *
+ * A listing only goes out of date when a file is created in the directory,
+ * and the only thing make knows to be creating files is itself: when it
+ * builds a file, vpath_created() adds the name to the listing of its
+ * directory (if that has been read).
+ *
+ * The search path is set before the build starts, and the listings are
+ * protected by vp_lock, so vpath_find() and vpath_created() can be called
+ * from build workers.
+ */
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/debug.h>
+#include <sys/types.h>
+#include <umem.h>
+
+#include "atom.h"
+#include "custr.h"
+#include "make.h"
+#include "target.h"
+#include "util.h"
+#include "var.h"
+#include "vpath.h"
+
+#define	VP_MINDIRS	64U	/* must be a power of 2 */
+#define	VP_MINSLOTS	64U	/* must be a power of 2 */
+#define	VP_MINNAMES	1024U
+#define	VP_MINSEARCH	8U
+
+#ifndef MAX
+#define	MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+typedef struct vp_slot {
+	uint32_t	vs_hash;
+	uint32_t	vs_name;	/* offset in vd_names + 1, 0 if empty */
+} vp_slot_t;
+
+typedef struct vp_dir {
+	struct vp_dir	*vd_next;	/* hash chain */
+	char		*vd_path;
+	size_t		vd_len;
+	uint32_t	vd_hash;
+	boolean_t	vd_loaded;
+	vp_slot_t	*vd_slots;	/* open addressed, linear probing */
+	size_t		vd_nslots;
+	size_t		vd_n;
+	char		*vd_names;	/* NUL terminated names */
+	size_t		vd_namelen;
+	size_t		vd_namealloc;
+} vp_dir_t;
+
+typedef struct vp_search {
+	char		*vs_path;
+	size_t		vs_len;
+} vp_search_t;
+
+static pthread_mutex_t vp_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static vp_dir_t **vp_dirs;	/* hash table of directories */
+static size_t vp_ndirs;
+static size_t vp_dirbuckets;
+
+static vp_search_t *vp_search;	/* the search path, in order */
+static size_t vp_nsearch;
+static size_t vp_searchalloc;
+
+/* 32-bit FNV-1a */
+static uint32_t
+vp_hash(const char *s, size_t len)
+{
+	uint32_t h = 2166136261U;
+
+	for (size_t i = 0; i < len; i++) {
+		h ^= (uchar_t)s[i];
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+static void
+vp_slot_insert(vp_slot_t *slots, size_t nslots, uint32_t hash, uint32_t name)
+{
+	size_t mask = nslots - 1;
+	size_t i;
+
+	for (i = hash & mask; slots[i].vs_name != 0; i = (i + 1) & mask)
+		;
+
+	slots[i].vs_hash = hash;
+	slots[i].vs_name = name;
+}
+
+static boolean_t
+vp_dir_has(const vp_dir_t *vd, const char *name, size_t len, uint32_t hash)
+{
+	size_t mask = vd->vd_nslots - 1;
+
+	if (vd->vd_nslots == 0)
+		return (B_FALSE);
+
+	for (size_t i = hash & mask; vd->vd_slots[i].vs_name != 0;
+	    i = (i + 1) & mask) {
+		const char *s = NULL;
+
+		if (vd->vd_slots[i].vs_hash != hash)
+			continue;
+
+		s = vd->vd_names + vd->vd_slots[i].vs_name - 1;
+		if (strncmp(s, name, len) == 0 && s[len] == '\0')
+			return (B_TRUE);
+	}
+
+	return (B_FALSE);
+}
+
+/* Add the len byte name to vd (if it's not already there) */
+static void
+vp_dir_add(vp_dir_t *vd, const char *name, size_t len)
+{
+	uint32_t hash = vp_hash(name, len);
+	uint32_t off;
+
+	if (vp_dir_has(vd, name, len, hash))
+		return;
+
+	/* Keep the table at most half full */
+	if ((vd->vd_n + 1) * 2 > vd->vd_nslots) {
+		size_t nslots = MAX(vd->vd_nslots * 2, VP_MINSLOTS);
+		vp_slot_t *slots = xcalloc(nslots, sizeof (vp_slot_t));
+
+		for (size_t i = 0; i < vd->vd_nslots; i++) {
+			if (vd->vd_slots[i].vs_name != 0) {
+				vp_slot_insert(slots, nslots,
+				    vd->vd_slots[i].vs_hash,
+				    vd->vd_slots[i].vs_name);
+			}
+		}
+
+		cfree(vd->vd_slots, vd->vd_nslots, sizeof (vp_slot_t));
+		vd->vd_slots = slots;
+		vd->vd_nslots = nslots;
+	}
+
+	if (vd->vd_namelen + len + 1 > vd->vd_namealloc) {
+		size_t newn = MAX(vd->vd_namealloc, VP_MINNAMES);
+
+		while (newn < vd->vd_namelen + len + 1)
+			newn *= 2;
+
+		vd->vd_names = xrealloc(vd->vd_names, vd->vd_namealloc, newn);
+		vd->vd_namealloc = newn;
+	}
+
+	VERIFY3U(vd->vd_namelen, <, UINT32_MAX - len - 1);
+	off = (uint32_t)vd->vd_namelen;
+	(void) memcpy(vd->vd_names + off, name, len);
+	vd->vd_names[off + len] = '\0';
+	vd->vd_namelen += len + 1;
+
+	vp_slot_insert(vd->vd_slots, vd->vd_nslots, hash, off + 1);
+	vd->vd_n++;
+}
+
+/* Keep the hash table of directories at most twice as full as its buckets */
+static void
+vp_dir_grow(void)
+{
+	vp_dir_t **dirs = NULL;
+	size_t nbuckets;
+
+	if (vp_ndirs < vp_dirbuckets * 2)
+		return;
+
+	nbuckets = (vp_dirbuckets == 0) ? VP_MINDIRS : vp_dirbuckets * 2;
+	dirs = xcalloc(nbuckets, sizeof (vp_dir_t *));
+
+	for (size_t i = 0; i < vp_dirbuckets; i++) {
+		vp_dir_t *vd = vp_dirs[i];
+
+		while (vd != NULL) {
+			vp_dir_t *next = vd->vd_next;
+			size_t b = vd->vd_hash & (nbuckets - 1);
+
+			vd->vd_next = dirs[b];
+			dirs[b] = vd;
+			vd = next;
+		}
+	}
+
+	cfree(vp_dirs, vp_dirbuckets, sizeof (vp_dir_t *));
+	vp_dirs = dirs;
+	vp_dirbuckets = nbuckets;
+}
+
+/*
+ * Find the directory with the len byte path.  If create is set, it's
+ * created (but not read) if necessary, otherwise NULL is returned.
+ */
+static vp_dir_t *
+vp_dir(const char *path, size_t len, boolean_t create)
+{
+	uint32_t hash = vp_hash(path, len);
+	vp_dir_t *vd = NULL;
+	size_t b;
+
+	if (vp_dirbuckets > 0) {
+		b = hash & (vp_dirbuckets - 1);
+		for (vd = vp_dirs[b]; vd != NULL; vd = vd->vd_next) {
+			if (vd->vd_hash == hash && vd->vd_len == len &&
+			    memcmp(vd->vd_path, path, len) == 0)
+				return (vd);
+		}
+	}
+
+	if (!create)
+		return (NULL);
+
+	vp_dir_grow();
+
+	vd = zalloc(sizeof (*vd));
+	vd->vd_path = zalloc(len + 1);
+	(void) memcpy(vd->vd_path, path, len);
+	vd->vd_len = len;
+	vd->vd_hash = hash;
+
+	b = hash & (vp_dirbuckets - 1);
+	vd->vd_next = vp_dirs[b];
+	vp_dirs[b] = vd;
+	vp_ndirs++;
+	return (vd);
+}
+
+/*
+ * Read the names in vd.  A directory that can't be read is treated as
+ * empty, which is what searching it one file at a time would find too.
+ */
+static void
+vp_dir_load(vp_dir_t *vd)
+{
+	struct dirent *dp = NULL;
+	DIR *d = NULL;
+
+	vd->vd_loaded = B_TRUE;
+	if ((d = opendir(vd->vd_path)) == NULL)
+		return;
+
+	while ((dp = readdir(d)) != NULL)
+		vp_dir_add(vd, dp->d_name, strlen(dp->d_name));
+	(void) closedir(d);
+}
+
+/* Split path into the directory (len bytes at dir) and the rest */
+static const char *
+vp_split(const char *path, size_t len, const char **dirp, size_t *dirlenp)
+{
+	const char *slash = NULL;
+
+	for (size_t i = len; i > 0; i--) {
+		if (path[i - 1] == '/') {
+			slash = path + i - 1;
+			break;
+		}
+	}
+
+	if (slash == NULL) {
+		*dirp = ".";
+		*dirlenp = 1;
+		return (path);
+	}
+
+	*dirp = path;
+	*dirlenp = (slash == path) ? 1 : (size_t)(slash - path);
+	return (slash + 1);
+}
+
+/* Add the len byte dir to the end of the search path */
+void
+vpath_add(const char *dir, size_t len)
+{
+	vp_search_t *vs = NULL;
+
+	/* a/b/ is the same directory as a/b */
+	while (len > 1 && dir[len - 1] == '/')
+		len--;
+	if (len == 0)
+		return;
+
+	for (size_t i = 0; i < vp_nsearch; i++) {
+		if (vp_search[i].vs_len == len &&
+		    memcmp(vp_search[i].vs_path, dir, len) == 0)
+			return;
+	}
+
+	if (vp_nsearch == vp_searchalloc) {
+		size_t newn = MAX(vp_searchalloc * 2, VP_MINSEARCH);
+
+		vp_search = xrealloc(vp_search,
+		    vp_searchalloc * sizeof (vp_search_t),
+		    newn * sizeof (vp_search_t));
+		vp_searchalloc = newn;
+	}
+
+	vs = &vp_search[vp_nsearch++];
+	vs->vs_path = zalloc(len + 1);
+	(void) memcpy(vs->vs_path, dir, len);
+	vs->vs_len = len;
+}
+
+/*
+ * Set up the search path from the makefiles: the dependencies of .PATH,
+ * then the directories in $(VPATH) (separated by colons or blanks).
+ */
+void
+vpath_load(make_t *mk)
+{
+	target_t *t = target_get(atom_find(".PATH", 5));
+	custr_t *cu = NULL;
+	const char *p = NULL;
+
+	for (size_t i = 0; t != NULL && i < t->ndeps; i++) {
+		atom_t dir = t->deps[i]->target->name;
+
+		vpath_add(atom_name(dir), atom_len(dir));
+	}
+
+	VERIFY0(custr_alloc(&cu, cu_memops));
+	if (var_get(mk, "VPATH", cu)) {
+		p = custr_cstr(cu);
+		while (*p != '\0') {
+			size_t len = strcspn(p, ": \t");
+
+			vpath_add(p, len);
+			p += len;
+			p += strspn(p, ": \t");
+		}
+	}
+
+	custr_free(cu);
+}
+
+/*
+ * Look for name in the search path.  Returns the path it was found at, or
+ * ATOM_NONE if it's not in any of the directories (or is absolute, so
+ * isn't searched for).
+ */
+atom_t
+vpath_find(atom_t name)
+{
+	const char *s = atom_name(name);
+	size_t len = atom_len(name);
+	atom_t found = ATOM_NONE;
+	custr_t *cu = NULL;
+
+	if (vp_nsearch == 0 || len == 0 || s[0] == '/')
+		return (ATOM_NONE);
+
+	VERIFY0(custr_alloc(&cu, cu_memops));
+	(void) pthread_mutex_lock(&vp_lock);
+
+	for (size_t i = 0; i < vp_nsearch; i++) {
+		const vp_search_t *vs = &vp_search[i];
+		const char *dir = NULL, *base = NULL;
+		size_t dirlen;
+		vp_dir_t *vd = NULL;
+
+		custr_reset(cu);
+		if (vs->vs_len != 1 || vs->vs_path[0] != '.') {
+			VERIFY0(custr_append(cu, vs->vs_path));
+			if (vs->vs_path[vs->vs_len - 1] != '/')
+				VERIFY0(custr_appendc(cu, '/'));
+		}
+		VERIFY0(custr_append(cu, s));
+
+		base = vp_split(custr_cstr(cu), custr_len(cu), &dir, &dirlen);
+		if (*base == '\0')
+			continue;
+
+		vd = vp_dir(dir, dirlen, B_TRUE);
+		if (!vd->vd_loaded)
+			vp_dir_load(vd);
+
+		if (vp_dir_has(vd, base, strlen(base),
+		    vp_hash(base, strlen(base)))) {
+			found = atom_intern(custr_cstr(cu), custr_len(cu));
+			break;
+		}
+	}
+
+	(void) pthread_mutex_unlock(&vp_lock);
+	custr_free(cu);
+	return (found);
+}
+
+/* make has created path, so add it to its directory (if that's been read) */
+void
+vpath_created(atom_t path)
+{
+	const char *dir = NULL, *base = NULL;
+	size_t dirlen;
+	vp_dir_t *vd = NULL;
+
+	base = vp_split(atom_name(path), atom_len(path), &dir, &dirlen);
+	if (*base == '\0')
+		return;
+
+	(void) pthread_mutex_lock(&vp_lock);
+	vd = vp_dir(dir, dirlen, B_FALSE);
+	if (vd != NULL && vd->vd_loaded)
+		vp_dir_add(vd, base, strlen(base));
+	(void) pthread_mutex_unlock(&vp_lock);
+}
+
+/* Forget the search path, and every directory that's been read */
+void
+vpath_reset(void)
+{
+	(void) pthread_mutex_lock(&vp_lock);
+
+	for (size_t i = 0; i < vp_dirbuckets; i++) {
+		vp_dir_t *vd = vp_dirs[i];
+
+		while (vd != NULL) {
+			vp_dir_t *next = vd->vd_next;
+
+			cfree(vd->vd_slots, vd->vd_nslots, sizeof (vp_slot_t));
+			cfree(vd->vd_names, vd->vd_namealloc, 1);
+			umem_free(vd->vd_path, vd->vd_len + 1);
+			umem_free(vd, sizeof (*vd));
+			vd = next;
+		}
+	}
+	cfree(vp_dirs, vp_dirbuckets, sizeof (vp_dir_t *));
+	vp_dirs = NULL;
+	vp_ndirs = vp_dirbuckets = 0;
+
+	for (size_t i = 0; i < vp_nsearch; i++)
+		umem_free(vp_search[i].vs_path, vp_search[i].vs_len + 1);
+	cfree(vp_search, vp_searchalloc, sizeof (vp_search_t));
+	vp_search = NULL;
+	vp_nsearch = vp_searchalloc = 0;
+
+	(void) pthread_mutex_unlock(&vp_lock);
+}
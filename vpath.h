@@ -0,0 +1,39 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2018 Jason King
+ */
+
+
+#ifndef _VPATH_H
+#define	_VPATH_H
+
+#include <sys/types.h>
+#include "atom.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct make;
+
+void	vpath_add(const char *, size_t);
+void	vpath_load(struct make *);
+atom_t	vpath_find(atom_t);
+void	vpath_created(atom_t);
+void	vpath_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _VPATH_H */